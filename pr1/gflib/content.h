@@ -10,9 +10,28 @@
  * Subsequent calls to content_get with a key value
  * as an argument will return the file descriptor for the 
  * given file path.
+ *
+ * Keys are looked up in an open-addressing hash table; use
+ * content_init_index to pick the index explicitly.
  */
 int content_init(char *filename);
 
+/*
+ * Index backends for content_init_index.
+ * - CONTENT_INDEX_SORTED keeps the items in a sorted array and
+ *   binary searches it with strcmp.
+ * - CONTENT_INDEX_HASH stores the keys in one arena and their
+ *   precomputed hashes in a linear-probing table, so a lookup
+ *   hashes the key once and usually compares a single string.
+ */
+#define CONTENT_INDEX_SORTED 0
+#define CONTENT_INDEX_HASH 1
+
+/*
+ * Same as content_init, using the given index backend.
+ */
+int content_init_index(char *filename, int index);
+
 /* 
  * Returns the file descriptor associated with the input key.
  * Returns -1 if the the key is not found
@@ -6,6 +6,7 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <pthread.h>
 
 #include "workload.h"
 #include "gfclient.h"
@@ -19,6 +20,8 @@
 "  -w [workload_path]  Path to workload file (Default: workload.txt)\n"       \
 "  -t [nthreads]       Number of threads (Default 1)\n"                       \
 "  -n [num_requests]   Requests download per thread (Default: 1)\n"           \
+"  -b [batch_size]     Requests sent over one connection (Default: 1)\n"     \
+"  -r [nranges]        Ranges of each file fetched in parallel (Default: 1)\n" \
 "  -h                  Show this help message\n"                              \
 
 /* OPTIONS DESCRIPTOR ====================================================== */
@@ -28,6 +31,8 @@ static struct option gLongOptions[] = {
   {"workload-path", required_argument,      NULL,           'w'},
   {"nthreads",      required_argument,      NULL,           't'},
   {"nrequests",     required_argument,      NULL,           'n'},
+  {"batch",         required_argument,      NULL,           'b'},
+  {"ranges",        required_argument,      NULL,           'r'},
   {"help",          no_argument,            NULL,           'h'},
   {NULL,            0,                      NULL,             0}
 };
@@ -70,6 +75,21 @@ static FILE* openFile(char *path){
   return ans;
 }
 
+/* Attempts at a range, each resuming where the previous one stopped */
+#define RANGE_ATTEMPTS 3
+
+/* One part of a file downloaded on its own connection */
+typedef struct{
+  char *server;
+  unsigned short port;
+  char *path;
+  int fd;
+  size_t offset;
+  size_t len;
+  size_t received;
+  pthread_t thread;
+} range_t;
+
 /* Callbacks ========================================================= */
 static void writecb(void* data, size_t data_len, void *arg){
   FILE *file = (FILE*) arg;
@@ -77,6 +97,113 @@ static void writecb(void* data, size_t data_len, void *arg){
   fwrite(data, 1, data_len, file);
 }
 
+static void rangecb(void* data, size_t data_len, void *arg){
+  range_t *range = (range_t*) arg;
+
+  if ((ssize_t) data_len != pwrite(range->fd, data, data_len, range->offset + range->received))
+    perror("Unable to write the file");
+  range->received += data_len;
+}
+
+/* Ranges ============================================================ */
+static void* fetch_range(void *arg){
+  range_t *range = (range_t*) arg;
+  gfcsession_t *session;
+  gfcrequest_t *gfr;
+  int attempt;
+
+  if (NULL == (session = gfc_session_create(range->server, range->port)))
+    return NULL;
+
+  gfr = gfc_create();
+  gfc_set_session(gfr, session);
+  gfc_set_path(gfr, range->path);
+  gfc_set_writefunc(gfr, rangecb);
+  gfc_set_writearg(gfr, range);
+
+  for(attempt = 0; attempt < RANGE_ATTEMPTS && range->received < range->len; attempt++){
+    gfc_reset(gfr);
+    gfc_set_range(gfr, range->offset + range->received, range->len - range->received);
+
+    /* a broken connection is retried, an answer other than OK is not */
+    if ( 0 > gfc_perform(gfr) && gfc_get_status(gfr) == GF_INVALID)
+      continue;
+    if ( gfc_get_status(gfr) != GF_OK)
+      break;
+  }
+
+  gfc_cleanup(gfr);
+  gfc_session_destroy(session);
+
+  return NULL;
+}
+
+/*
+ * Downloads path into file as nranges ranges fetched in parallel, each on
+ * its own connection and written in place with pwrite.  A range whose
+ * connection breaks is resumed from the last byte received.  Returns the
+ * number of bytes of the file received, or -1 if the file is not on the
+ * server; the size of the file is set to *total.
+ */
+static ssize_t download_ranges(char *server, unsigned short port, char *path, FILE *file, int nranges, size_t *total){
+  range_t probe, *ranges;
+  gfcrequest_t *gfr;
+  size_t received;
+  int i;
+
+  /* the first byte tells the size of the file */
+  memset(&probe, 0, sizeof(probe));
+  probe.fd = fileno(file);
+
+  gfr = gfc_create();
+  gfc_set_server(gfr, server);
+  gfc_set_path(gfr, path);
+  gfc_set_port(gfr, port);
+  gfc_set_range(gfr, 0, 1);
+  gfc_set_writefunc(gfr, rangecb);
+  gfc_set_writearg(gfr, &probe);
+
+  if ( 0 > gfc_perform(gfr) || gfc_get_status(gfr) != GF_OK){
+    gfc_cleanup(gfr);
+    return -1;
+  }
+  *total = gfc_get_totallen(gfr);
+  gfc_cleanup(gfr);
+
+  /* a server without ranges already sent the whole file */
+  if (probe.received >= *total)
+    return (ssize_t) probe.received;
+
+  if (NULL == (ranges = (range_t*) calloc(nranges, sizeof(range_t)))){
+    perror("Unable to allocate memory");
+    exit(EXIT_FAILURE);
+  }
+
+  for(i = 0; i < nranges; i++){
+    ranges[i].server = server;
+    ranges[i].port = port;
+    ranges[i].path = path;
+    ranges[i].fd = fileno(file);
+    ranges[i].offset = probe.received + (*total - probe.received) * i / nranges;
+    ranges[i].len = probe.received + (*total - probe.received) * (i + 1) / nranges - ranges[i].offset;
+
+    if (0 != pthread_create(&ranges[i].thread, NULL, fetch_range, &ranges[i])){
+      fprintf(stderr, "Error creating thread\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  received = probe.received;
+  for(i = 0; i < nranges; i++){
+    pthread_join(ranges[i].thread, NULL);
+    received += ranges[i].received;
+  }
+
+  free(ranges);
+
+  return (ssize_t) received;
+}
+
 /* Main ========================================================= */
 int main(int argc, char **argv) {
 /* COMMAND LINE OPTIONS ============================================= */
@@ -84,18 +211,22 @@ int main(int argc, char **argv) {
   unsigned short port = 8888;
   char *workload_path = "workload.txt";
 
-  int i;
+  int i, j, n;
   int option_char = 0;
   int nrequests = 1;
   int nthreads = 1;
+  int batch = 1;
+  int nranges = 1;
   int returncode;
-  gfcrequest_t *gfr;
-  FILE *file;
+  ssize_t received;
+  size_t total;
+  gfcrequest_t **gfrs;
+  FILE **files;
   char *req_path;
-  char local_path[512];
+  char (*local_paths)[512];
 
   // Parse and set command line arguments
-  while ((option_char = getopt_long(argc, argv, "s:p:w:n:t:h", gLongOptions, NULL)) != -1) {
+  while ((option_char = getopt_long(argc, argv, "s:p:w:n:t:b:r:h", gLongOptions, NULL)) != -1) {
     switch (option_char) {
       case 's': // server
         server = optarg;
@@ -109,6 +240,20 @@ int main(int argc, char **argv) {
       case 'n': // nrequests
         nrequests = atoi(optarg);
         break;
+      case 'b': // batch
+        batch = atoi(optarg);
+        if(batch < 1){
+          fprintf(stderr, "Batch size must be at least 1.\n");
+          exit(1);
+        }
+        break;
+      case 'r': // ranges
+        nranges = atoi(optarg);
+        if(nranges < 1){
+          fprintf(stderr, "Range count must be at least 1.\n");
+          exit(1);
+        }
+        break;
       case 't': // nthreads
         nthreads = atoi(optarg);
         if(nthreads != 1){
@@ -133,8 +278,16 @@ int main(int argc, char **argv) {
 
   gfc_global_init();
 
-  /*Making the requests...*/
-  for(i = 0; i < nrequests * nthreads; i++){
+  gfrs = (gfcrequest_t **) malloc(batch * sizeof(gfcrequest_t *));
+  files = (FILE **) malloc(batch * sizeof(FILE *));
+  local_paths = malloc(batch * sizeof(*local_paths));
+  if(gfrs == NULL || files == NULL || local_paths == NULL){
+    perror("Unable to allocate memory");
+    exit(EXIT_FAILURE);
+  }
+
+  /*Making the requests, each split into ranges...*/
+  for(i = 0; nranges > 1 && i < nrequests * nthreads; i++){
     req_path = workload_get_path();
 
     if(strlen(req_path) > 256){
@@ -142,40 +295,81 @@ int main(int argc, char **argv) {
       exit(EXIT_FAILURE);
     }
 
-    localPath(req_path, local_path);
+    localPath(req_path, local_paths[0]);
 
-    file = openFile(local_path);
+    files[0] = openFile(local_paths[0]);
 
-    gfr = gfc_create();
-    gfc_set_server(gfr, server);
-    gfc_set_path(gfr, req_path);
-    gfc_set_port(gfr, port);
-    gfc_set_writefunc(gfr, writecb);
-    gfc_set_writearg(gfr, file);
+    fprintf(stdout, "Requesting %s%s in %d ranges\n", server, req_path, nranges);
 
-    fprintf(stdout, "Requesting %s%s\n", server, req_path);
+    total = 0;
+    received = download_ranges(server, port, req_path, files[0], nranges, &total);
 
-    if ( 0 > (returncode = gfc_perform(gfr))){
-      fprintf(stdout, "gfc_perform returned an error %d\n", returncode);
-      fclose(file);
-      if ( 0 > unlink(local_path))
-        fprintf(stderr, "unlink failed on %s\n", local_path);
-    }
-    else {
-        fclose(file);
+    fclose(files[0]);
+
+    /* drop failed and incomplete downloads */
+    if ( received < 0 || (size_t) received != total){
+      if ( 0 > unlink(local_paths[0]))
+        fprintf(stderr, "unlink failed on %s\n", local_paths[0]);
     }
 
-    if ( gfc_get_status(gfr) != GF_OK){
-      if ( 0 > unlink(local_path))
-        fprintf(stderr, "unlink failed on %s\n", local_path);
+    fprintf(stdout, "Status: %s\n", received < 0 ? "FILE_NOT_FOUND" : "OK");
+    fprintf(stdout, "Received %zd of %zu bytes\n", received < 0 ? 0 : received, total);
+  }
+
+  /*Making the requests, batch at a time...*/
+  for(i = 0; nranges == 1 && i < nrequests * nthreads; i += n){
+    n = nrequests * nthreads - i < batch ? nrequests * nthreads - i : batch;
+
+    for(j = 0; j < n; j++){
+      req_path = workload_get_path();
+
+      if(strlen(req_path) > 256){
+        fprintf(stderr, "Request path exceeded maximum of 256 characters\n.");
+        exit(EXIT_FAILURE);
+      }
+
+      localPath(req_path, local_paths[j]);
+
+      files[j] = openFile(local_paths[j]);
+
+      gfrs[j] = gfc_create();
+      gfc_set_server(gfrs[j], server);
+      gfc_set_path(gfrs[j], req_path);
+      gfc_set_port(gfrs[j], port);
+      gfc_set_writefunc(gfrs[j], writecb);
+      gfc_set_writearg(gfrs[j], files[j]);
+
+      fprintf(stdout, "Requesting %s%s\n", server, req_path);
     }
 
-    fprintf(stdout, "Status: %s\n", gfc_strstatus(gfc_get_status(gfr)));
-    fprintf(stdout, "Received %zu of %zu bytes\n", gfc_get_bytesreceived(gfr), gfc_get_filelen(gfr));
+    if (n == 1)
+      returncode = gfc_perform(gfrs[0]);
+    else
+      returncode = gfc_perform_many(gfrs, n);
 
-    gfc_cleanup(gfr);
+    if ( 0 > returncode)
+      fprintf(stdout, "gfc_perform returned an error %d\n", returncode);
+
+    for(j = 0; j < n; j++){
+      fclose(files[j]);
+
+      /* drop failed and incomplete downloads */
+      if ( gfc_get_status(gfrs[j]) != GF_OK || gfc_get_bytesreceived(gfrs[j]) != gfc_get_filelen(gfrs[j])){
+        if ( 0 > unlink(local_paths[j]))
+          fprintf(stderr, "unlink failed on %s\n", local_paths[j]);
+      }
+
+      fprintf(stdout, "Status: %s\n", gfc_strstatus(gfc_get_status(gfrs[j])));
+      fprintf(stdout, "Received %zu of %zu bytes\n", gfc_get_bytesreceived(gfrs[j]), gfc_get_filelen(gfrs[j]));
+
+      gfc_cleanup(gfrs[j]);
+    }
   }
 
+  free(local_paths);
+  free(files);
+  free(gfrs);
+
   gfc_global_cleanup();
 
   return 0;
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <unistd.h>
 #include <pthread.h>
@@ -8,8 +10,18 @@
 #include <sys/socket.h>
 #include <netdb.h>
 #include <stdio.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <stdint.h>
 
 #include "gfserver.h"
+#include "metrics.h"
+#include "log.h"
 
 /*
  * Modify this file to implement the interface specified in
@@ -21,24 +33,96 @@
 #define METHOD_POST "POST"
 #define METHOD_PUT "PUT"
 #define METHOD_DELETE "DELETE"
-#define HEADER_RESPONSE "GETFILE %s %d\r\n\r\n"
+#define HEADER_OK "GETFILE OK "
+#define HEADER_FILE_NOT_FOUND "GETFILE FILE_NOT_FOUND "
+#define HEADER_ERROR "GETFILE ERROR "
+#define HEADER_RANGE " RANGE "
+#define HEADER_KEEPALIVE " KEEPALIVE"
+// longest header: prefix, three 64-bit numbers and every option
+#define HEADER_MAX_LEN 128
+#define OPTION_KEEPALIVE "KEEPALIVE"
+#define OPTION_RANGE "RANGE"
 #define END_OF_REQUEST "\r\n\r\n"
+#define END_OF_RESPONSE "\r\n\r\n"
+#define MAX_EVENTS 1024
+#define REQUEST_BUFFER_SIZE 1024
+#define COPY_BUFFER_SIZE 4096
+// most response bytes an epoll-mode connection keeps in memory, file ranges not counted
+#define OUTPUT_BUFFER_LIMIT (256 * 1024)
+// seconds a blocking-mode connection may sit idle between requests
+#define KEEPALIVE_TIMEOUT 5
 
 #define true 1
 #define false 0
 typedef int bool;
 
+/*
+ * States of the request parser, in the order a request goes through them.
+ * Anything before PARSE_DONE still needs more bytes.
+ */
+typedef enum {
+    PARSE_SCHEME,
+    PARSE_METHOD,
+    PARSE_PATH,
+    PARSE_OPTION,
+    PARSE_RANGE,
+    PARSE_DONE,
+    PARSE_INVALID
+} parse_state_t;
+
+/*
+ * Incremental request parser.  It is fed the buffer a request is read
+ * into, each time with more bytes in it, and resumes where it stopped, so
+ * every byte is looked at once.  Tokens are checked as soon as they end
+ * and terminated in place, which is how the handler gets its path without
+ * a copy.  All of its state is here, one per connection.
+ */
 struct request_t {
-    bool is_valid_request;
-    char *scheme;
-    char *method;
-    char *path;
+    parse_state_t state;
+    // next byte to look at, once done the length of the request
+    size_t pos;
+    // first byte of the token being read, if in_token
+    size_t start;
+    bool in_token;
+    // bytes of END_OF_REQUEST seen in a row
+    int matched;
+    // offset of the path in the buffer
+    size_t path;
+    bool keepalive;
+    bool ranged;
+    long long range_first;
+    long long range_last;
+};
+
+/*
+ * Per-connection state used by the epoll event loop
+ * reading header -> handler -> streaming body -> close
+ * or, for a keep-alive request, back to reading the next header
+ */
+typedef enum {
+    CONN_READING,
+    CONN_WRITING,
+    CONN_CLOSING
+} conn_state_t;
+
+/*
+ * A file range queued by gfs_sendfile in epoll mode.  It goes out once
+ * the output buffer is written up to at, its place in the byte stream.
+ */
+struct file_range_t {
+    struct file_range_t *next;
+    int fd;
+    off_t offset;
+    size_t len;
+    uint64_t at;
 };
 
 struct gfserver_t {
     int listenfd;
     unsigned short port;
     int max_npending;
+    int mode;
+    bool keepalive;
     ssize_t (*handler)(gfcontext_t *, char *, void *);
     void* args;
 };
@@ -46,40 +130,484 @@ struct gfserver_t {
 struct gfcontext_t {
     int connfd;
     struct sockaddr_in client_addr;
-    struct request_t *request;
+    struct request_t request;
+    // the client asked to keep the connection open after this response
+    bool keepalive;
+    // the client asked for the bytes first to last only, last -1 is EOF
+    bool ranged;
+    long long range_first;
+    long long range_last;
+    // set by gfs_getrange, the response header then describes the range
+    bool range_resolved;
+    long long range_offset;
+    long long range_total;
+
+    // event loop state, unused in blocking mode
+    bool nonblocking;
+    conn_state_t state;
+    // the client closed its side, no request follows this one
+    bool eof;
+    char inbuf[REQUEST_BUFFER_SIZE];
+    size_t inlen;
+    char *outbuf;
+    size_t outlen;
+    size_t outpos;
+    size_t outcap;
+    // stream offset of outbuf[0], which places the file ranges among its bytes
+    uint64_t outbase;
+    // file bodies queued by gfs_sendfile, oldest first
+    struct file_range_t *ranges;
+    struct file_range_t *ranges_tail;
 };
 
+int gfs_getrange(gfcontext_t *ctx, size_t file_len, off_t *offset, size_t *len){
+    long long last;
+
+    if (!ctx->ranged) {
+        *offset = 0;
+        *len = file_len;
+        return 0;
+    }
+
+    // a range past the end of the file is answered with an empty body
+    ctx->range_total = (long long)file_len;
+    ctx->range_offset = ctx->range_first < ctx->range_total ? ctx->range_first : ctx->range_total;
+    last = ctx->range_last < 0 || ctx->range_last >= ctx->range_total ? ctx->range_total - 1 : ctx->range_last;
+    ctx->range_resolved = true;
+
+    *offset = (off_t)ctx->range_offset;
+    *len = last >= ctx->range_offset ? (size_t)(last - ctx->range_offset + 1) : 0;
+    return 1;
+}
+
+/*
+ * Appends data to the connection's pending output.  The event loop drains
+ * it when the socket becomes writable again.
+ */
+static ssize_t buffer_output(gfcontext_t *ctx, const char *data, size_t len) {
+    // reuse the space already written before growing
+    if (ctx->outpos > 0 && ctx->outlen + len > ctx->outcap) {
+        memmove(ctx->outbuf, ctx->outbuf + ctx->outpos, ctx->outlen - ctx->outpos);
+        ctx->outbase += ctx->outpos;
+        ctx->outlen -= ctx->outpos;
+        ctx->outpos = 0;
+    }
+
+    if (ctx->outlen + len > ctx->outcap) {
+        size_t capacity = ctx->outcap ? ctx->outcap : BUFSIZ;
+        char *outbuf;
+
+        while (capacity < ctx->outlen + len) {
+            capacity *= 2;
+        }
+        if ((outbuf = realloc(ctx->outbuf, capacity)) == NULL) {
+            perror("Unable to allocate memory");
+            return -1;
+        }
+        ctx->outbuf = outbuf;
+        ctx->outcap = capacity;
+    }
+
+    memcpy(ctx->outbuf + ctx->outlen, data, len);
+    ctx->outlen += len;
+
+    return (ssize_t)len;
+}
+
+/*
+ * Queues len bytes of fd from offset behind the pending output.
+ */
+static int queue_file(gfcontext_t *ctx, int fd, off_t offset, size_t len) {
+    struct file_range_t *range;
+
+    if ((range = (struct file_range_t *)malloc(sizeof(struct file_range_t))) == NULL) {
+        perror("Unable to allocate memory");
+        return -1;
+    }
+    range->next = NULL;
+    range->fd = fd;
+    range->offset = offset;
+    range->len = len;
+    range->at = ctx->outbase + ctx->outlen;
+
+    if (ctx->ranges_tail != NULL) {
+        ctx->ranges_tail->next = range;
+    } else {
+        ctx->ranges = range;
+    }
+    ctx->ranges_tail = range;
+
+    return 0;
+}
+
+static void drop_file(gfcontext_t *ctx) {
+    struct file_range_t *range = ctx->ranges;
+
+    if ((ctx->ranges = range->next) == NULL) {
+        ctx->ranges_tail = NULL;
+    }
+    free(range);
+}
+
+/*
+ * Writes as much pending output as the socket accepts without blocking,
+ * stopping where the next queued file range goes.  Returns 1 once that
+ * point is reached, 0 if the socket is full and -1 if the connection is
+ * broken.
+ */
+static int flush_output(gfcontext_t *ctx) {
+    size_t end = ctx->ranges != NULL ? (size_t)(ctx->ranges->at - ctx->outbase) : ctx->outlen;
+    ssize_t n;
+
+    while (ctx->outpos < end) {
+        // a queued file range follows, let the kernel coalesce them
+        n = send(ctx->connfd, ctx->outbuf + ctx->outpos, end - ctx->outpos, MSG_NOSIGNAL | (ctx->ranges != NULL ? MSG_MORE : 0));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        ctx->outpos += n;
+    }
+
+    if (ctx->outpos == ctx->outlen) {
+        ctx->outbase += ctx->outlen;
+        ctx->outpos = ctx->outlen = 0;
+    }
+    return 1;
+}
+
+/*
+ * Sends a chunk of the first queued file range with pread and send, for
+ * descriptors sendfile does not support.  What the socket does not take
+ * is read again next time.  Same return convention as flush_output.
+ */
+static int copy_file_chunk(gfcontext_t *ctx) {
+    struct file_range_t *range = ctx->ranges;
+    char buffer[COPY_BUFFER_SIZE];
+    ssize_t n;
+
+    n = pread(range->fd, buffer, range->len < COPY_BUFFER_SIZE ? range->len : COPY_BUFFER_SIZE, range->offset);
+    if (n <= 0) {
+        return -1;
+    }
+    while ((n = send(ctx->connfd, buffer, (size_t)n, MSG_NOSIGNAL)) < 0 && errno == EINTR);
+    if (n < 0) {
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    }
+    range->offset += n;
+    range->len -= n;
+
+    return 1;
+}
+
+/*
+ * Writes the pending output and streams the queued file ranges among it
+ * with sendfile until the socket is full.  Same return convention as
+ * flush_output, 1 meaning everything is written.
+ */
+static int flush_pending(gfcontext_t *ctx) {
+    struct file_range_t *range;
+    ssize_t n;
+    int flushed;
+
+    for ( ; ; ) {
+        if ((flushed = flush_output(ctx)) != 1 || (range = ctx->ranges) == NULL) {
+            return flushed;
+        }
+
+        while (range->len > 0) {
+            n = sendfile(ctx->connfd, range->fd, &range->offset, range->len);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return 0;
+                }
+                if (errno == EINVAL || errno == ENOSYS) {
+                    // descriptor does not support sendfile, copy it instead
+                    if ((flushed = copy_file_chunk(ctx)) != 1) {
+                        return flushed;
+                    }
+                    continue;
+                }
+                return -1;
+            }
+            if (n == 0) {
+                // file is shorter than announced
+                return -1;
+            }
+            range->len -= n;
+        }
+        drop_file(ctx);
+    }
+}
+
+/*
+ * Writes pending output, waiting for the socket, until at most limit
+ * bytes of it are left.  This is the one place the epoll loop stalls on a
+ * single connection: a handler passing gfs_send more than the client reads
+ * and OUTPUT_BUFFER_LIMIT holds is held here instead of growing the buffer
+ * without bound.  Queued file ranges cost no memory and never wait here.
+ * Returns 0, or -1 if the connection is broken or the client read nothing
+ * for KEEPALIVE_TIMEOUT seconds.
+ */
+static int drain_output(gfcontext_t *ctx, size_t limit) {
+    struct pollfd pfd;
+    int n;
+
+    pfd.fd = ctx->connfd;
+    pfd.events = POLLOUT;
+    for ( ; ; ) {
+        if (flush_pending(ctx) < 0) {
+            return -1;
+        }
+        if (ctx->outlen - ctx->outpos <= limit) {
+            return 0;
+        }
+        while ((n = poll(&pfd, 1, KEEPALIVE_TIMEOUT * 1000)) < 0 && errno == EINTR);
+        if (n <= 0) {
+            return -1;
+        }
+    }
+}
+
+/*
+ * Writes the pending output followed by data in one call, so that a held
+ * back header leaves in the same segment as the start of the body.
+ * Returns how many bytes of data were written, or -1 if the connection
+ * is broken.  Whatever is not written stays pending for flush_output.
+ */
+static ssize_t flush_output_with(gfcontext_t *ctx, void *data, size_t len) {
+    struct iovec iov[2];
+    struct msghdr msg;
+    size_t queued = ctx->outlen - ctx->outpos;
+    ssize_t n;
+
+    iov[0].iov_base = ctx->outbuf + ctx->outpos;
+    iov[0].iov_len = queued;
+    iov[1].iov_base = data;
+    iov[1].iov_len = len;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+
+    while ((n = sendmsg(ctx->connfd, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR);
+    if (n < 0) {
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    }
+    if ((size_t)n < queued) {
+        ctx->outpos += n;
+        return 0;
+    }
+
+    ctx->outbase += ctx->outlen;
+    ctx->outpos = ctx->outlen = 0;
+    return n - (ssize_t)queued;
+}
+
+/*
+ * Appends the decimal digits of value to buffer and returns their count.
+ */
+static size_t format_number(char *buffer, uint64_t value) {
+    char digits[20];
+    size_t ndigits = 0, i;
+
+    do {
+        digits[ndigits++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value != 0);
+
+    for (i = 0; i < ndigits; i++) {
+        buffer[i] = digits[ndigits - 1 - i];
+    }
+
+    return ndigits;
+}
+
+static size_t append(char *buffer, const char *text, size_t len) {
+    memcpy(buffer, text, len);
+    return len;
+}
+
 ssize_t gfs_sendheader(gfcontext_t *ctx, gfstatus_t status, size_t file_len){
-    char header[BUFSIZ];
+    char header[HEADER_MAX_LEN];
+    size_t len;
+    bool more;
 
+    // "GETFILE OK <len> [RANGE <offset>/<total>] [KEEPALIVE]\r\n\r\n"
     switch (status) {
         case GF_OK:
-            // "GETFILE OK %d \r\n\r\n"
-            sprintf(header, HEADER_RESPONSE, "OK", (int)file_len);
-            memcpy(header, header, strlen(header));
+            len = append(header, HEADER_OK, sizeof(HEADER_OK) - 1);
             break;
         case GF_FILE_NOT_FOUND:
-            // "GETFILE FILE_NOT_FOUND 0 \r\n\r\n"
-            sprintf(header, HEADER_RESPONSE, "FILE_NOT_FOUND", (int)file_len);
-            memcpy(header, header, strlen(header));
+            len = append(header, HEADER_FILE_NOT_FOUND, sizeof(HEADER_FILE_NOT_FOUND) - 1);
             break;
         case GF_ERROR:
         default:
-            // "GETFILE ERROR 0 \r\n\r\n"
-            sprintf(header, HEADER_RESPONSE, "ERROR", (int)file_len);
-            memcpy(header, header, strlen(header));
+            len = append(header, HEADER_ERROR, sizeof(HEADER_ERROR) - 1);
             break;
     }
+    len += format_number(header + len, (uint64_t)file_len);
 
-    return send(ctx->connfd, header, strlen(header), 0);
+    if (status == GF_OK && ctx->range_resolved) {
+        len += append(header + len, HEADER_RANGE, sizeof(HEADER_RANGE) - 1);
+        len += format_number(header + len, (uint64_t)ctx->range_offset);
+        header[len++] = '/';
+        len += format_number(header + len, (uint64_t)ctx->range_total);
+    }
+    // tell the client whether the connection stays open after the body
+    if (ctx->keepalive) {
+        len += append(header + len, HEADER_KEEPALIVE, sizeof(HEADER_KEEPALIVE) - 1);
+    }
+    len += append(header + len, END_OF_RESPONSE, sizeof(END_OF_RESPONSE) - 1);
+    metrics_status(status);
+
+    // hold the header back so that it leaves with the first body bytes
+    more = status == GF_OK && file_len > 0;
+
+    if (!ctx->nonblocking) {
+        return send(ctx->connfd, header, len, more ? MSG_MORE : 0);
+    }
+
+    if (more) {
+        if (ctx->state == CONN_CLOSING || buffer_output(ctx, header, len) < 0) {
+            ctx->state = CONN_CLOSING;
+            return -1;
+        }
+        return (ssize_t)len;
+    }
+
+    return gfs_send(ctx, header, len);
 }
 
 ssize_t gfs_send(gfcontext_t *ctx, void *data, size_t len){
-    return send(ctx->connfd, data, len, 0);
+    ssize_t n = 0;
+    size_t chunk;
+
+    if (!ctx->nonblocking) {
+        return send(ctx->connfd, data, len, MSG_NOSIGNAL);
+    }
+
+    if (ctx->state == CONN_CLOSING) {
+        return -1;
+    }
+
+    // queued file ranges go first, data behind them waits in the buffer
+    if (ctx->ranges != NULL && flush_pending(ctx) < 0) {
+        ctx->state = CONN_CLOSING;
+        return -1;
+    }
+
+    // keep ordering: write directly only behind what is queued
+    if (ctx->ranges != NULL) {
+        n = 0;
+    } else if (ctx->outlen == 0) {
+        while ((n = send(ctx->connfd, data, len, MSG_NOSIGNAL)) < 0 && errno == EINTR);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                ctx->state = CONN_CLOSING;
+                return -1;
+            }
+            n = 0;
+        }
+    } else if ((n = flush_output_with(ctx, data, len)) < 0) {
+        ctx->state = CONN_CLOSING;
+        return -1;
+    }
+
+    // queue the rest, never holding more than OUTPUT_BUFFER_LIMIT bytes
+    while ((size_t)n < len) {
+        chunk = len - (size_t)n < OUTPUT_BUFFER_LIMIT ? len - (size_t)n : OUTPUT_BUFFER_LIMIT;
+        if ((ctx->outlen - ctx->outpos + chunk > OUTPUT_BUFFER_LIMIT && drain_output(ctx, OUTPUT_BUFFER_LIMIT - chunk) < 0)
+                || buffer_output(ctx, (char *)data + n, chunk) < 0) {
+            ctx->state = CONN_CLOSING;
+            return -1;
+        }
+        n += chunk;
+    }
+
+    return (ssize_t)len;
+}
+
+/*
+ * Sends the file with a read/send copy loop.
+ */
+static ssize_t copy_file(gfcontext_t *ctx, int fildes, off_t offset, size_t len) {
+    char buffer[COPY_BUFFER_SIZE];
+    size_t bytes_transferred = 0;
+    ssize_t read_len, write_len;
+
+    while (bytes_transferred < len) {
+        read_len = pread(fildes, buffer, len - bytes_transferred < COPY_BUFFER_SIZE ? len - bytes_transferred : COPY_BUFFER_SIZE, offset + (off_t)bytes_transferred);
+        if (read_len <= 0) {
+            return -1;
+        }
+        write_len = gfs_send(ctx, buffer, (size_t)read_len);
+        if (write_len != read_len) {
+            return -1;
+        }
+        bytes_transferred += write_len;
+    }
+
+    return (ssize_t)bytes_transferred;
+}
+
+ssize_t gfs_sendfile(gfcontext_t *ctx, int fildes, off_t offset, size_t len){
+    size_t bytes_transferred = 0;
+    ssize_t n;
+
+    if (ctx->nonblocking) {
+        if (ctx->state == CONN_CLOSING) {
+            return -1;
+        }
+        if (len > 0 && queue_file(ctx, fildes, offset, len) < 0) {
+            ctx->state = CONN_CLOSING;
+            return -1;
+        }
+        // start right away, behind a held back header if there is one
+        if (flush_pending(ctx) < 0) {
+            ctx->state = CONN_CLOSING;
+            return -1;
+        }
+        return (ssize_t)len;
+    }
+
+    while (bytes_transferred < len) {
+        n = sendfile(ctx->connfd, fildes, &offset, len - bytes_transferred);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EINVAL || errno == ENOSYS) {
+                // sendfile is not supported for this descriptor
+                if ((n = copy_file(ctx, fildes, offset, len - bytes_transferred)) < 0) {
+                    return -1;
+                }
+                return (ssize_t)(bytes_transferred + n);
+            }
+            return -1;
+        }
+        if (n == 0) {
+            // file is shorter than requested
+            return -1;
+        }
+        bytes_transferred += n;
+    }
+
+    return (ssize_t)bytes_transferred;
 }
 
 void gfs_abort(gfcontext_t *ctx){
+    if (ctx->nonblocking) {
+        // the event loop owns the descriptor and closes it after the handler returns
+        ctx->state = CONN_CLOSING;
+        return;
+    }
     close(ctx->connfd);
+    ctx->connfd = -1;
 }
 
 gfserver_t* gfserver_create(){
@@ -97,6 +625,8 @@ gfserver_t* gfserver_create(){
     }
 
     gfs->listenfd = listenfd;
+    gfs->mode = GFS_MODE_BLOCKING;
+    gfs->keepalive = false;
 
     return gfs;
 }
@@ -108,6 +638,14 @@ void gfserver_set_maxpending(gfserver_t *gfs, int max_npending){
     gfs->max_npending = max_npending;
 }
 
+void gfserver_set_mode(gfserver_t *gfs, int mode){
+    gfs->mode = mode;
+}
+
+void gfserver_set_keepalive(gfserver_t *gfs, int enabled){
+    gfs->keepalive = enabled ? true : false;
+}
+
 void gfserver_set_handler(gfserver_t *gfs, ssize_t (*handler)(gfcontext_t *, char *, void*)){
     gfs->handler = handler;
 }
@@ -116,25 +654,42 @@ void gfserver_set_handlerarg(gfserver_t *gfs, void* arg){
     gfs->args = arg;
 }
 
-static int get_request(gfcontext_t *ctx, char *buffer, int size) {
-    int request_size = 0;
-    ssize_t n;
-    char temp[size];
+static void request_init(struct request_t *req) {
+    memset(req, 0, sizeof(*req));
+    req->state = PARSE_SCHEME;
+}
 
-    while ((n = recv(ctx->connfd, temp, (size_t)size, 0)) > 0) {
-        if ((request_size + n) > size) {
-            n = size - request_size;
-        }
+/*
+ * Parses the <first>-[<last>] argument of a RANGE option into req.
+ */
+static bool parse_range(struct request_t *req, char *range) {
+    char *end;
 
-        memcpy(buffer + request_size, temp, n);
-        request_size += (int)n;
-        buffer[request_size] = '\0';
-        if (strstr(buffer, END_OF_REQUEST) != NULL) {
-            break;
+    if (!isdigit((unsigned char)range[0])) {
+        return false;
+    }
+
+    req->range_first = strtoll(range, &end, 10);
+    if (*end != '-') {
+        return false;
+    }
+
+    range = end + 1;
+    if (*range == '\0') {
+        // "<first>-" runs to the end of the file
+        req->range_last = -1;
+    } else {
+        if (!isdigit((unsigned char)range[0])) {
+            return false;
+        }
+        req->range_last = strtoll(range, &end, 10);
+        if (*end != '\0' || req->range_last < req->range_first) {
+            return false;
         }
     }
 
-    return request_size;
+    req->ranged = true;
+    return true;
 }
 
 bool check_valid_method (char *method) {
@@ -151,12 +706,202 @@ bool check_valid_method (char *method) {
     return false;
 }
 
-void gfserver_serve(gfserver_t *gfs){
-    struct sockaddr_in serv_addr;
-    char buffer[BUFSIZ];
+/*
+ * Checks the token that starts at buffer[req->start] and has just been
+ * terminated, and moves on to the next field.
+ * i.e. <scheme> <method> <path> [RANGE <first>-[<last>]] [KEEPALIVE]
+ */
+static void parse_token(struct request_t *req, char *buffer) {
+    char *token = buffer + req->start;
 
-    // clean the buffer
-    memset(&buffer, 0, BUFSIZ);
+    switch (req->state) {
+        case PARSE_SCHEME:
+            req->state = strcmp(token, SCHEME) == 0 ? PARSE_METHOD : PARSE_INVALID;
+            break;
+        case PARSE_METHOD:
+            req->state = check_valid_method(token) ? PARSE_PATH : PARSE_INVALID;
+            break;
+        case PARSE_PATH:
+            req->path = req->start;
+            req->state = token[0] == '/' ? PARSE_OPTION : PARSE_INVALID;
+            break;
+        case PARSE_OPTION:
+            // unknown options are ignored
+            if (strcmp(token, OPTION_RANGE) == 0) {
+                req->state = PARSE_RANGE;
+            } else if (strcmp(token, OPTION_KEEPALIVE) == 0) {
+                req->keepalive = true;
+            }
+            break;
+        case PARSE_RANGE:
+            req->state = parse_range(req, token) ? PARSE_OPTION : PARSE_INVALID;
+            break;
+        default:
+            break;
+    }
+}
+
+/*
+ * Parses the bytes of buffer, which now holds len of them, that the last
+ * call did not see.  A request still incomplete once it fills size bytes
+ * is invalid.  Returns the new state: PARSE_DONE once the request is whole,
+ * with req->pos its length, PARSE_INVALID as soon as it cannot be valid,
+ * or an earlier state if more bytes are needed.
+ */
+static parse_state_t request_parse(struct request_t *req, char *buffer, size_t len, size_t size) {
+    char c;
+
+    while (req->state < PARSE_DONE && req->pos < len) {
+        c = buffer[req->pos];
+
+        if (c == END_OF_REQUEST[req->matched]) {
+            req->matched++;
+        } else {
+            req->matched = c == END_OF_REQUEST[0] ? 1 : 0;
+        }
+
+        if (c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+            if (req->in_token) {
+                buffer[req->pos] = '\0';
+                req->in_token = false;
+                parse_token(req, buffer);
+            }
+        } else {
+            if (!req->in_token) {
+                req->start = req->pos;
+                req->in_token = true;
+            }
+            // reject a bad scheme or path without waiting for its end
+            if ((req->state == PARSE_SCHEME && (req->pos - req->start >= strlen(SCHEME) || c != SCHEME[req->pos - req->start]))
+                    || (req->state == PARSE_PATH && req->pos == req->start && c != '/')) {
+                req->state = PARSE_INVALID;
+            }
+        }
+        req->pos++;
+
+        if (req->matched == (int)strlen(END_OF_REQUEST) && req->state < PARSE_DONE) {
+            // complete once the path is in, whatever option follows
+            req->state = req->state == PARSE_OPTION ? PARSE_DONE : PARSE_INVALID;
+        }
+    }
+
+    if (req->state < PARSE_DONE && req->pos >= size) {
+        // oversized request
+        req->state = PARSE_INVALID;
+    }
+
+    return req->state;
+}
+
+/*
+ * Ends a request the client stopped sending without END_OF_REQUEST, which
+ * is whole if it got as far as its path.
+ */
+static parse_state_t request_finish(struct request_t *req, char *buffer, size_t len) {
+    if (req->state >= PARSE_DONE) {
+        return req->state;
+    }
+
+    if (req->in_token) {
+        buffer[len] = '\0';
+        req->in_token = false;
+        parse_token(req, buffer);
+    }
+    req->state = req->state == PARSE_OPTION ? PARSE_DONE : PARSE_INVALID;
+    req->pos = len;
+
+    return req->state;
+}
+
+/*
+ * Reads until buffer, which already holds len bytes, contains a whole
+ * request, parsing it as it arrives.  Bytes a client pipelined behind it
+ * are kept for the next call.  Returns the number of bytes in buffer, 0
+ * if the client closed the connection without sending anything or -1 on
+ * error.
+ */
+static ssize_t get_request(gfcontext_t *ctx, char *buffer, size_t len, size_t size) {
+    ssize_t n;
+
+    while (request_parse(&ctx->request, buffer, len, size) < PARSE_DONE) {
+        if ((n = recv(ctx->connfd, buffer + len, size - len, 0)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            // serve whatever arrived before the client hung up
+            if (len > 0) {
+                request_finish(&ctx->request, buffer, len);
+            }
+            break;
+        }
+
+        len += n;
+    }
+
+    return (ssize_t)len;
+}
+
+/*
+ * Calls the handler for the request parsed from buffer.
+ */
+static void serve_request(gfserver_t *gfs, gfcontext_t *ctx, char *buffer) {
+    struct request_t *req = &ctx->request;
+    char *path = buffer + req->path;
+    int transfer_size;
+    uint64_t started;
+
+    ctx->keepalive = false;
+    ctx->ranged = false;
+    ctx->range_resolved = false;
+
+    if (req->state != PARSE_DONE) {
+        // error
+        L(WARN, "invalid request");
+        gfs_sendheader(ctx, GF_FILE_NOT_FOUND, 0);
+        return;
+    }
+
+    // asks to reuse the connection
+    ctx->keepalive = gfs->keepalive && req->keepalive;
+    ctx->ranged = req->ranged;
+    ctx->range_first = req->range_first;
+    ctx->range_last = req->range_last;
+
+    L(DEBUG, "Sending the file '%s'", path);
+
+    // send the file
+    started = metrics_clock();
+    transfer_size = (int)gfs->handler(ctx, path, gfs->args);
+    metrics_stage(METRICS_HANDLER, started);
+    L(DEBUG, "Transfer: %d bytes", transfer_size);
+    if (transfer_size < 0) {
+        // the response may be incomplete, do not reuse the connection
+        ctx->keepalive = false;
+    } else {
+        metrics_bytes((size_t)transfer_size);
+    }
+}
+
+/*
+ * Serves the first request in buffer, which holds len bytes, and drops it,
+ * moving any pipelined bytes behind it to the front.  Returns the number
+ * of bytes left in buffer.
+ */
+static size_t serve_next_request(gfserver_t *gfs, gfcontext_t *ctx, char *buffer, size_t len) {
+    size_t request_len = ctx->request.state == PARSE_DONE ? ctx->request.pos : len;
+
+    serve_request(gfs, ctx, buffer);
+
+    memmove(buffer, buffer + request_len, len - request_len);
+    request_init(&ctx->request);
+    return len - request_len;
+}
+
+static void start_listening(gfserver_t *gfs) {
+    struct sockaddr_in serv_addr;
 
     printf("Starting server...\n");
 
@@ -179,80 +924,255 @@ void gfserver_serve(gfserver_t *gfs){
     }
 
     printf("Server listening on port %d\n", gfs->port);
+}
+
+static int set_nonblocking(int fd) {
+    int flags;
+
+    if ((flags = fcntl(fd, F_GETFL, 0)) < 0) {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void close_connection(gfcontext_t *ctx) {
+    while (ctx->ranges != NULL) {
+        drop_file(ctx);
+    }
+    // closing the descriptor also removes it from the epoll set
+    close(ctx->connfd);
+    free(ctx->outbuf);
+    free(ctx);
+}
+
+/*
+ * Accepts every pending connection.  The listener is edge-triggered,
+ * so keep going until accept reports EAGAIN.
+ */
+static void accept_connections(gfserver_t *gfs, int epollfd) {
+    struct epoll_event ev;
 
-    // infinite loop, continuously listening
     for ( ; ; ) {
-        gfcontext_t *ctx = (gfcontext_t *)malloc(sizeof(gfcontext_t));
+        gfcontext_t *ctx = (gfcontext_t *)calloc(1, sizeof(gfcontext_t));
         socklen_t client_size = sizeof(ctx->client_addr);
-//        struct request_t *req;
-        int transfer_size;
 
-//        printf("Listening for incoming connection...\n");
+        if (ctx == NULL) {
+            perror("Unable to allocate memory");
+            return;
+        }
 
-        // accept connection from an incoming client
-        if ((ctx->connfd = accept(gfs->listenfd, (struct sockaddr *)&(ctx->client_addr), &client_size)) < 0) {
-            perror("Error accepting client");
-            exit(EXIT_FAILURE);
+        ctx->connfd = accept4(gfs->listenfd, (struct sockaddr *)&(ctx->client_addr), &client_size, SOCK_NONBLOCK);
+        if (ctx->connfd < 0) {
+            free(ctx);
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                L(ERROR, "Error accepting client: %s", strerror(errno));
+            }
+            return;
         }
 
-//        printf("Incoming client connection was accepted\n");
+        ctx->nonblocking = true;
+        ctx->state = CONN_READING;
+        metrics_accepted();
 
-        // get the request from the client
-        if (get_request(ctx, buffer, BUFSIZ) < 0) {
-            perror("Error receiving request");
-            // Do not exit but just close the client's socket
-        } else {
-//            printf("Request: '%s'\n", buffer);
+        // register for both directions once; edge-triggered needs no re-arming
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = ctx;
+        if (epoll_ctl(epollfd, EPOLL_CTL_ADD, ctx->connfd, &ev) < 0) {
+            L(ERROR, "Error registering client: %s", strerror(errno));
+            close_connection(ctx);
+        }
+    }
+}
 
-            // parse the request i.e. <schema> <method> <path> \r\n\r\n
-            char temp_buffer[strlen(buffer)];
-            strcpy(temp_buffer, buffer);
-            char *scheme;
-            char *method;
-            char *path;
-            bool is_valid_request = true;
-
-            // get the scheme, set is_valid_request to false if not a valid scheme
-            scheme = strtok(temp_buffer, " \t");
-            if (strcmp(scheme, SCHEME) != 0) {
-                is_valid_request = false;
+/*
+ * Reads the request header until the socket runs dry.  Returns true once
+ * the whole header is in ctx->inbuf, which may already be the case for a
+ * pipelined request.
+ */
+static bool read_request(gfcontext_t *ctx) {
+    ssize_t n;
+
+    for ( ; ; ) {
+        // an oversized request is answered as an invalid one
+        if (request_parse(&ctx->request, ctx->inbuf, ctx->inlen, REQUEST_BUFFER_SIZE - 1) >= PARSE_DONE) {
+            return true;
+        }
+
+        n = recv(ctx->connfd, ctx->inbuf + ctx->inlen, REQUEST_BUFFER_SIZE - 1 - ctx->inlen, 0);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
             }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                ctx->state = CONN_CLOSING;
+            }
+            return false;
+        }
+        if (n == 0) {
+            if (ctx->inlen == 0) {
+                ctx->state = CONN_CLOSING;
+                return false;
+            }
+            // serve whatever arrived before the client hung up, as blocking mode does
+            request_finish(&ctx->request, ctx->inbuf, ctx->inlen);
+            ctx->eof = true;
+            return true;
+        }
 
-            if (is_valid_request) {
-                // get the method, set is_valid_request to false if not a valid method
-                method = strtok(NULL, " \t");
-                bool valid_method = check_valid_method(method);
-                if (valid_method != true) {
-                    is_valid_request = false;
-                }
+        ctx->inlen += n;
+    }
+}
+
+/*
+ * Advances the state machine of one connection after an epoll event.
+ */
+static void handle_connection(gfserver_t *gfs, gfcontext_t *ctx, uint32_t events) {
+    if (events & EPOLLERR) {
+        ctx->state = CONN_CLOSING;
+    }
+
+    // a keep-alive connection goes straight on to a request that was
+    // pipelined behind the one just answered
+    while (ctx->state != CONN_CLOSING) {
+        if (ctx->state == CONN_READING) {
+            if (!read_request(ctx)) {
+                // wait for the next EPOLLIN
+                break;
+            }
+            ctx->inlen = serve_next_request(gfs, ctx, ctx->inbuf, ctx->inlen);
+            if (ctx->eof) {
+                ctx->keepalive = false;
+            }
+            if (ctx->state != CONN_CLOSING) {
+                ctx->state = CONN_WRITING;
             }
+        }
 
-            if (is_valid_request) {
-                // get the path, set is_valid_request to false if path does not start with '/'
-                path = strtok(NULL, " \t\r\n");
-                if (path[0] != '/') {
-                    is_valid_request = false;
-                }
+        // the next request waits until this response is fully written, so
+        // a slow reader never has its handler called with output pending
+        if (ctx->state == CONN_WRITING) {
+            int flushed = flush_pending(ctx);
+
+            if (flushed == 0) {
+                // wait for the next EPOLLOUT
+                break;
             }
+            // response fully written or connection broken
+            ctx->state = flushed == 1 && ctx->keepalive ? CONN_READING : CONN_CLOSING;
+        }
+    }
 
-            if (is_valid_request != true) {
-                // error
-                fprintf(stderr, "buffer: '%s'\n", buffer);
-                gfs_sendheader(ctx, GF_FILE_NOT_FOUND, 0);
-            } else {
-                printf("Sending the file...\n");
-                printf("path: '%s'\n", path);
+    if (ctx->state == CONN_CLOSING) {
+        close_connection(ctx);
+    }
+}
+
+static void serve_epoll(gfserver_t *gfs) {
+    struct epoll_event ev;
+    struct epoll_event events[MAX_EVENTS];
+    int epollfd;
+    int nready;
+    int i;
+
+    if (set_nonblocking(gfs->listenfd) < 0) {
+        perror("Unable to make the socket non-blocking");
+        exit(EXIT_FAILURE);
+    }
+
+    if ((epollfd = epoll_create1(0)) < 0) {
+        perror("Unable to create the epoll instance");
+        exit(EXIT_FAILURE);
+    }
+
+    // a NULL data pointer marks the listening socket
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, gfs->listenfd, &ev) < 0) {
+        perror("Unable to register the socket");
+        exit(EXIT_FAILURE);
+    }
+
+    for ( ; ; ) {
+        if ((nready = epoll_wait(epollfd, events, MAX_EVENTS, -1)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Error waiting for events");
+            exit(EXIT_FAILURE);
+        }
 
-                // send the file
-                transfer_size = (int)gfs->handler(ctx, path, gfs->args);
-                printf("Transfer: %d bytes\n", transfer_size);
+        for (i = 0; i < nready; i++) {
+            if (events[i].data.ptr == NULL) {
+                accept_connections(gfs, epollfd);
+            } else {
+                handle_connection(gfs, (gfcontext_t *)events[i].data.ptr, events[i].events);
             }
         }
+    }
+}
+
+void gfserver_serve(gfserver_t *gfs){
+    char buffer[BUFSIZ];
+    struct timeval timeout = {KEEPALIVE_TIMEOUT, 0};
+    ssize_t len;
+
+    // sendfile cannot pass MSG_NOSIGNAL, a client leaving mid-body must not end the server
+    signal(SIGPIPE, SIG_IGN);
+
+    // clean the buffer
+    memset(&buffer, 0, BUFSIZ);
+
+    start_listening(gfs);
+
+    if (gfs->mode == GFS_MODE_EPOLL) {
+        serve_epoll(gfs);
+        return;
+    }
+
+    // infinite loop, continuously listening
+    for ( ; ; ) {
+        gfcontext_t *ctx = (gfcontext_t *)calloc(1, sizeof(gfcontext_t));
+        socklen_t client_size = sizeof(ctx->client_addr);
+
+//        printf("Listening for incoming connection...\n");
+
+        // accept connection from an incoming client
+        if ((ctx->connfd = accept(gfs->listenfd, (struct sockaddr *)&(ctx->client_addr), &client_size)) < 0) {
+            perror("Error accepting client");
+            exit(EXIT_FAILURE);
+        }
+        metrics_accepted();
+
+//        printf("Incoming client connection was accepted\n");
+
+        // an idle keep-alive client must not hold the server forever
+        if (gfs->keepalive) {
+            setsockopt(ctx->connfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        }
+
+        // serve requests until one of them does not ask for keep-alive
+        len = 0;
+        do {
+            // get the request from the client
+            if ((len = get_request(ctx, buffer, (size_t)len, BUFSIZ - 1)) <= 0) {
+                if (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                    L(ERROR, "Error receiving request: %s", strerror(errno));
+                }
+                // Do not exit but just close the client's socket
+                break;
+            }
+//            printf("Request: '%s'\n", buffer);
+            len = (ssize_t)serve_next_request(gfs, ctx, buffer, (size_t)len);
+        } while (ctx->keepalive && ctx->connfd >= 0);
 
         // close the accepted connection
-        close(ctx->connfd);
+        if (ctx->connfd >= 0) {
+            close(ctx->connfd);
+        }
         // clean up and free malloc
         free(ctx);
     }
 }
-
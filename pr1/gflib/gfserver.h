@@ -1,6 +1,7 @@
 #ifndef __GF_SERVER_H__
 #define __GF_SERVER_H__
 
+#include <sys/types.h>
 
 /*
  * gfserver is a server library for transferring files using the GETFILE
@@ -39,6 +40,52 @@ void gfserver_set_port(gfserver_t *gfs, unsigned short port);
 void gfserver_set_maxpending(gfserver_t *gfs, int max_npending);
 
 
+/*
+ * Serving modes for gfserver_set_mode.
+ * - GFS_MODE_BLOCKING (the default) serves one connection at a time.
+ * - GFS_MODE_EPOLL multiplexes every connection on a single thread with a
+ *   non-blocking, edge-triggered epoll loop.  The handler is still called
+ *   once per request, and only once the previous response is written.
+ *   Whatever the socket does not accept right away is queued and drained
+ *   as the client reads it: gfs_sendfile ranges without limit, gfs_send
+ *   bytes up to 256 KB per connection.  A handler passing gfs_send more
+ *   than that to a slow client stalls the whole loop until the client
+ *   reads, for at most 5 seconds, so large bodies should go through
+ *   gfs_sendfile.
+ */
+#define GFS_MODE_BLOCKING 0
+#define GFS_MODE_EPOLL 1
+
+/*
+ * Sets the serving mode used by gfserver_serve.
+ */
+void gfserver_set_mode(gfserver_t *gfs, int mode);
+
+/*
+ * Enables the keep-alive extension of the protocol.  A client that ends
+ * its request with an extra KEEPALIVE token, i.e.
+ *   GETFILE GET <path> KEEPALIVE\r\n\r\n
+ * then gets the same token back at the end of the response header, and
+ * the connection stays open for its next request, which may already be
+ * pipelined behind the first one.  Requests without the token, and every
+ * request while keep-alive is disabled (the default), close the connection
+ * after the response.  In GFS_MODE_BLOCKING an idle keep-alive connection
+ * is closed after a few seconds so that it cannot hold the server.
+ */
+void gfserver_set_keepalive(gfserver_t *gfs, int enabled);
+
+/*
+ * Every request may also ask for part of the file only, with a trailing
+ * RANGE option naming the first and last byte, both included:
+ *   GETFILE GET <path> RANGE <first>-[<last>]\r\n\r\n
+ * Without <last> the range runs to the end of the file.  A handler that
+ * supports ranges calls gfs_getrange before sending the header; the
+ * response then names the offset of the body and the size of the whole
+ * file after the length,
+ *   GETFILE OK <length> RANGE <offset>/<total>\r\n\r\n
+ * and other handlers keep sending the whole file, without the option.
+ */
+
 /*
  * Sets the handler callback, a function that will be called for each each
  * request.  As arguments, this function receives:
@@ -75,6 +122,29 @@ ssize_t gfs_sendheader(gfcontext_t *ctx, gfstatus_t status, size_t file_len);
  */
 ssize_t gfs_send(gfcontext_t *ctx, void *data, size_t size);
 
+/*
+ * Sends len bytes of the open file fildes, starting at offset, to the
+ * client.  The bytes go from the page cache to the socket with
+ * sendfile(2); a read/send copy loop is only used if sendfile fails.
+ * The file offset of fildes is left untouched, so a descriptor may be
+ * shared between concurrent requests.  In GFS_MODE_EPOLL the transfer
+ * may complete after the handler returns, so fildes must stay open.
+ * This function should only be called from within a callback registered
+ * with gfserver_set_handler.
+ */
+ssize_t gfs_sendfile(gfcontext_t *ctx, int fildes, off_t offset, size_t len);
+
+/*
+ * Resolves the range the client asked for against a file of file_len
+ * bytes and sets offset and len to the part of the file to send, which is
+ * the whole file if the request has no RANGE option.  A range starting at
+ * or after the end of the file gives an empty body.  Returns 1 for a range
+ * request, whose header gfs_sendheader then completes, and 0 otherwise.
+ * This function should only be called from within a callback registered
+ * with gfserver_set_handler.
+ */
+int gfs_getrange(gfcontext_t *ctx, size_t file_len, off_t *offset, size_t *len);
+
 /*
  * Aborts the connection to the client associated with the input
  * gfcontext_t.
@@ -8,6 +8,7 @@
 
 #include "gfserver.h"
 #include "content.h"
+#include "metrics.h"
 
 #define USAGE                                                                 \
 "usage:\n"                                                                    \
@@ -15,6 +16,9 @@
 "options:\n"                                                                  \
 "  -p                  Listen port (Default: 8888)\n"                         \
 "  -c                  Content file mapping keys to content files\n"          \
+"  -e                  Serve with the epoll event loop\n"                     \
+"  -k                  Keep connections open for keep-alive clients\n"       \
+"  -a [admin_port]     Report metrics to connections on this loopback port\n" \
 "  -h                  Show this help message\n"                              
 
 extern ssize_t handler_get(gfcontext_t *ctx, char *path, void* arg);
@@ -25,10 +29,13 @@ int main(int argc, char **argv) {
   int option_char = 0;
   unsigned short port = 8888;
   char *content = "content.txt";
+  int mode = GFS_MODE_BLOCKING;
+  int keepalive = 0;
+  unsigned short admin_port = 0;
   gfserver_t *gfs;
 
   // Parse and set command line arguments
-  while ((option_char = getopt(argc, argv, "p:t:s:h")) != -1) {
+  while ((option_char = getopt(argc, argv, "p:t:s:c:eka:h")) != -1) {
     switch (option_char) {
       case 'p': // listen-port
         port = atoi(optarg);
@@ -36,6 +43,15 @@ int main(int argc, char **argv) {
       case 'c': // file-path
         content = optarg;
         break;                                          
+      case 'e': // epoll
+        mode = GFS_MODE_EPOLL;
+        break;
+      case 'k': // keep-alive
+        keepalive = 1;
+        break;
+      case 'a': // admin-port
+        admin_port = atoi(optarg);
+        break;
       case 'h': // help
         fprintf(stdout, "%s", USAGE);
         exit(0);
@@ -48,11 +64,17 @@ int main(int argc, char **argv) {
   
   content_init(content);
 
+  if (admin_port != 0 && 0 > metrics_init(admin_port)) {
+    exit(EXIT_FAILURE);
+  }
+
   /*Initializing server*/
   gfs = gfserver_create();
 
   /*Setting options*/
   gfserver_set_port(gfs, port);
+  gfserver_set_mode(gfs, mode);
+  gfserver_set_keepalive(gfs, keepalive);
   gfserver_set_maxpending(gfs, 100);
   gfserver_set_handler(gfs, handler_get);
   gfserver_set_handlerarg(gfs, NULL);
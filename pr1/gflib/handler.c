@@ -7,14 +7,13 @@
 
 #include "gfserver.h"
 #include "content.h"
-
-#define BUFFER_SIZE 4096
+#include "log.h"
 
 ssize_t handler_get(gfcontext_t *ctx, char *path, void* arg){
 	int fildes;
 	ssize_t file_len, bytes_transferred;
-	ssize_t read_len, write_len;
-	char buffer[BUFFER_SIZE];
+	off_t offset;
+	size_t len;
 
 	if( 0 > (fildes = content_get(path)))
 		return gfs_sendheader(ctx, GF_FILE_NOT_FOUND, 0);
@@ -22,24 +21,17 @@ ssize_t handler_get(gfcontext_t *ctx, char *path, void* arg){
 	/* Calculating the file size */
 	file_len = lseek(fildes, 0, SEEK_END);
 
-	gfs_sendheader(ctx, GF_OK, file_len);
-
-	/* Sending the file contents chunk by chunk. */
-	bytes_transferred = 0;
-	while(bytes_transferred < file_len){
-		read_len = pread(fildes, buffer, BUFFER_SIZE, bytes_transferred);
-		if (read_len <= 0){
-			fprintf(stderr, "handle_with_file read error, %zd, %zu, %zu", read_len, bytes_transferred, file_len );
-			gfs_abort(ctx);
-			return -1;
-		}
-		write_len = gfs_send(ctx, buffer, read_len);
-		if (write_len != read_len){
-			fprintf(stderr, "handle_with_file write error");
-			gfs_abort(ctx);
-			return -1;
-		}
-		bytes_transferred += write_len;
+	/* Only the part of the file the client asked for, if any. */
+	gfs_getrange(ctx, file_len, &offset, &len);
+
+	gfs_sendheader(ctx, GF_OK, len);
+
+	/* Sending the file contents straight from the page cache. */
+	bytes_transferred = gfs_sendfile(ctx, fildes, offset, len);
+	if (bytes_transferred != (ssize_t)len){
+		L(ERROR, "handle_with_file sendfile error, %zd, %zu", bytes_transferred, len);
+		gfs_abort(ctx);
+		return -1;
 	}
 
 	return bytes_transferred;
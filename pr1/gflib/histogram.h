@@ -0,0 +1,45 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+
+/*
+ * HDR-style latency histogram.  Values are counted in log2 buckets each
+ * split into 2^HISTOGRAM_SUB_BITS linear sub-buckets, so any 64 bit value
+ * is recorded in constant time and reported within 1% of its true value.
+ * Recording never allocates; give each thread its own histogram and merge
+ * them when the run is over, or while it goes on: a merge may run
+ * concurrently with the single thread recording into a histogram.
+ */
+
+#define HISTOGRAM_SUB_BITS 7
+#define HISTOGRAM_SUB_COUNT (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_COUNT)
+
+typedef struct{
+  uint64_t counts[HISTOGRAM_BUCKETS];
+  uint64_t total;
+  uint64_t min;
+  uint64_t max;
+  double sum;
+}histogram_t;
+
+/* Initializes an empty histogram */
+void histogram_init(histogram_t* this);
+
+/* Counts one occurrence of value */
+void histogram_record(histogram_t* this, uint64_t value);
+
+/* Adds the counts of other to this */
+void histogram_merge(histogram_t* this, histogram_t* other);
+
+/*
+ * Returns the value below which percentile (0 to 100) percent of the
+ * recorded values fall, as the highest value of its sub-bucket
+ */
+uint64_t histogram_percentile(histogram_t* this, double percentile);
+
+/* Returns the mean of the recorded values, 0 if there are none */
+double histogram_mean(histogram_t* this);
+
+#endif
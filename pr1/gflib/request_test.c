@@ -0,0 +1,288 @@
+/*
+ * Fuzz tests and a throughput benchmark for the GETFILE request parser.
+ * The parser is static to gfserver.c, so the whole file is compiled in.
+ *
+ *   request_test [seed]         runs the tests, fuzzing with seed
+ *   request_test -b [count]     parses count requests and reports the rate
+ */
+#include "gfserver.c"
+
+#include <time.h>
+
+#define FUZZ_ROUNDS 200000
+#define BENCH_COUNT 5000000
+
+typedef struct {
+    const char *request;
+    parse_state_t state;
+    const char *path;
+    bool keepalive;
+    bool ranged;
+    long long range_first;
+    long long range_last;
+} parse_case_t;
+
+static const parse_case_t g_cases[] = {
+    {"GETFILE GET /a\r\n\r\n", PARSE_DONE, "/a", false, false, 0, 0},
+    {"GETFILE GET /courses/ud923/filecorpus/road.jpg\r\n\r\n", PARSE_DONE, "/courses/ud923/filecorpus/road.jpg", false, false, 0, 0},
+    {"GETFILE GET /a KEEPALIVE\r\n\r\n", PARSE_DONE, "/a", true, false, 0, 0},
+    {"GETFILE\tGET\t/a\tKEEPALIVE\r\n\r\n", PARSE_DONE, "/a", true, false, 0, 0},
+    {"GETFILE GET /a RANGE 10-19\r\n\r\n", PARSE_DONE, "/a", false, true, 10, 19},
+    {"GETFILE GET /a RANGE 10- KEEPALIVE\r\n\r\n", PARSE_DONE, "/a", true, true, 10, -1},
+    {"GETFILE GET /a UNKNOWN\r\n\r\n", PARSE_DONE, "/a", false, false, 0, 0},
+    {"GETFILE GET /a\r\n\r\nGETFILE GET /b\r\n\r\n", PARSE_DONE, "/a", false, false, 0, 0},
+    {"GETFILE GET /a\r\n", PARSE_OPTION, NULL, false, false, 0, 0},
+    {"GETFILE GET", PARSE_METHOD, NULL, false, false, 0, 0},
+    {"", PARSE_SCHEME, NULL, false, false, 0, 0},
+    {"GETFILX GET /a\r\n\r\n", PARSE_INVALID, NULL, false, false, 0, 0},
+    {"GETFILEGET /a\r\n\r\n", PARSE_INVALID, NULL, false, false, 0, 0},
+    {"GETFILE PUT /a\r\n\r\n", PARSE_INVALID, NULL, false, false, 0, 0},
+    {"GETFILE GET a\r\n\r\n", PARSE_INVALID, NULL, false, false, 0, 0},
+    {"GETFILE GET\r\n\r\n", PARSE_INVALID, NULL, false, false, 0, 0},
+    {"GETFILE GET /a RANGE\r\n\r\n", PARSE_INVALID, NULL, false, false, 0, 0},
+    {"GETFILE GET /a RANGE 9-1\r\n\r\n", PARSE_INVALID, NULL, false, false, 0, 0},
+    {"GETFILE GET /a RANGE x-1\r\n\r\n", PARSE_INVALID, NULL, false, false, 0, 0},
+    {"GETFILE GET /a RANGE 1-2x\r\n\r\n", PARSE_INVALID, NULL, false, false, 0, 0},
+};
+
+#define NCASES (sizeof(g_cases) / sizeof(g_cases[0]))
+
+static int g_failures;
+
+#define CHECK(cond, format, ...) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "FAIL %s:%d: " format "\n", __FILE__, __LINE__, __VA_ARGS__); \
+        g_failures++; \
+    } \
+} while (0)
+
+/*
+ * Parses data, len bytes, fed in chunks of at most chunk bytes, into a
+ * buffer of size bytes the way the server reads a request.  buffer must
+ * hold size + 1 bytes.
+ */
+static parse_state_t parse_chunked(struct request_t *req, char *buffer, size_t size, const char *data, size_t len, size_t chunk) {
+    size_t fed = 0, n;
+
+    request_init(req);
+    memset(buffer, 0, size + 1);
+    while (fed < len && fed < size) {
+        n = chunk < len - fed ? chunk : len - fed;
+        n = n < size - fed ? n : size - fed;
+        memcpy(buffer + fed, data + fed, n);
+        fed += n;
+        if (request_parse(req, buffer, fed, size) >= PARSE_DONE) {
+            break;
+        }
+    }
+
+    return req->state;
+}
+
+// Checks that two parses of the same bytes agree on everything the server uses
+static void check_same(const char *what, struct request_t *a, char *abuf, struct request_t *b, char *bbuf) {
+    CHECK(a->state == b->state, "%s: state %d != %d", what, a->state, b->state);
+    if (a->state != PARSE_DONE || b->state != PARSE_DONE) {
+        return;
+    }
+    CHECK(a->pos == b->pos, "%s: length %zu != %zu", what, a->pos, b->pos);
+    CHECK(strcmp(abuf + a->path, bbuf + b->path) == 0, "%s: path '%s' != '%s'", what, abuf + a->path, bbuf + b->path);
+    CHECK(a->keepalive == b->keepalive && a->ranged == b->ranged, "%s: options differ", what);
+    CHECK(!a->ranged || (a->range_first == b->range_first && a->range_last == b->range_last), "%s: range differs", what);
+}
+
+// Checks what a finished parse may hand to the server
+static void check_sane(const char *what, struct request_t *req, char *buffer, size_t len) {
+    if (req->state != PARSE_DONE) {
+        return;
+    }
+    CHECK(req->pos <= len, "%s: length %zu past %zu bytes", what, req->pos, len);
+    CHECK(req->path < req->pos && buffer[req->path] == '/', "%s: bad path offset %zu", what, req->path);
+    CHECK(!req->ranged || req->range_last < 0 || req->range_first <= req->range_last, "%s: bad range", what);
+}
+
+static void test_cases(void) {
+    char buffer[REQUEST_BUFFER_SIZE + 1], split[REQUEST_BUFFER_SIZE + 1];
+    struct request_t req, splitreq;
+    const parse_case_t *c;
+    size_t i, len, chunk;
+
+    for (i = 0; i < NCASES; i++) {
+        c = &g_cases[i];
+        len = strlen(c->request);
+
+        parse_chunked(&req, buffer, REQUEST_BUFFER_SIZE, c->request, len, len + 1);
+        CHECK(req.state == c->state, "case %zu: state %d, expected %d", i, req.state, c->state);
+        if (c->state == PARSE_DONE && req.state == PARSE_DONE) {
+            CHECK(strcmp(buffer + req.path, c->path) == 0, "case %zu: path '%s'", i, buffer + req.path);
+            CHECK(req.keepalive == c->keepalive, "case %zu: keepalive %d", i, req.keepalive);
+            CHECK(req.ranged == c->ranged, "case %zu: ranged %d", i, req.ranged);
+            CHECK(!c->ranged || (req.range_first == c->range_first && req.range_last == c->range_last),
+                  "case %zu: range %lld-%lld", i, req.range_first, req.range_last);
+        }
+
+        // any way of splitting the request must give the same result
+        for (chunk = 1; chunk <= len; chunk++) {
+            parse_chunked(&splitreq, split, REQUEST_BUFFER_SIZE, c->request, len, chunk);
+            check_same("split", &req, buffer, &splitreq, split);
+        }
+    }
+}
+
+// A request the client stopped sending is served if its path is in
+static void test_finish(void) {
+    const char *whole = "GETFILE GET /a KEEPALIVE";
+    char buffer[REQUEST_BUFFER_SIZE + 1];
+    struct request_t req;
+    size_t len;
+
+    for (len = 0; len <= strlen(whole); len++) {
+        parse_chunked(&req, buffer, REQUEST_BUFFER_SIZE, whole, len, len + 1);
+        request_finish(&req, buffer, len);
+        CHECK(req.state == (len >= strlen("GETFILE GET /") ? PARSE_DONE : PARSE_INVALID),
+              "finish after %zu bytes: state %d", len, req.state);
+        check_sane("finish", &req, buffer, len);
+    }
+}
+
+// A request that fills the buffer without ending is rejected right away
+static void test_oversized(void) {
+    char data[3 * REQUEST_BUFFER_SIZE], buffer[REQUEST_BUFFER_SIZE + 1];
+    struct request_t req;
+    size_t len;
+
+    len = (size_t)snprintf(data, sizeof(data), "GETFILE GET /");
+    memset(data + len, 'a', sizeof(data) - len);
+
+    parse_chunked(&req, buffer, REQUEST_BUFFER_SIZE, data, sizeof(data), 100);
+    CHECK(req.state == PARSE_INVALID, "oversized: state %d", req.state);
+    CHECK(req.pos <= REQUEST_BUFFER_SIZE, "oversized: read %zu bytes", req.pos);
+}
+
+/*
+ * Mutates valid requests at random, with flips, insertions, deletions and
+ * runs of random bytes, and checks every result is parsed the same way in
+ * one piece and in random chunks, and is sane if accepted, also when the
+ * client hangs up part way.
+ */
+static void test_fuzz(unsigned int seed) {
+    static const char alphabet[] = "GETFILE RANGE KEEPALIVE /-0123456789 \t\r\n";
+    char data[REQUEST_BUFFER_SIZE * 2], buffer[REQUEST_BUFFER_SIZE + 1], split[REQUEST_BUFFER_SIZE + 1];
+    struct request_t req, splitreq;
+    const char *base;
+    size_t len, pos, n, i;
+    int round, edits, failures = g_failures;
+
+    srand(seed);
+    for (round = 0; round < FUZZ_ROUNDS; round++) {
+        base = g_cases[rand() % NCASES].request;
+        len = strlen(base);
+        memcpy(data, base, len);
+
+        for (edits = rand() % 4; edits >= 0; edits--) {
+            pos = len > 0 ? (size_t)rand() % len : 0;
+            switch (rand() % 5) {
+                case 0:
+                    if (len > 0) {
+                        data[pos] = (char)(rand() % 256);
+                    }
+                    break;
+                case 1:
+                    if (len > 0) {
+                        data[pos] = alphabet[rand() % (sizeof(alphabet) - 1)];
+                    }
+                    break;
+                case 2:
+                    if (len < sizeof(data) - 1) {
+                        memmove(data + pos + 1, data + pos, len - pos);
+                        data[pos] = alphabet[rand() % (sizeof(alphabet) - 1)];
+                        len++;
+                    }
+                    break;
+                case 3:
+                    if (len > 0) {
+                        memmove(data + pos, data + pos + 1, len - pos - 1);
+                        len--;
+                    }
+                    break;
+                default:
+                    n = (size_t)rand() % 64;
+                    n = n < sizeof(data) - len ? n : sizeof(data) - len;
+                    memmove(data + pos + n, data + pos, len - pos);
+                    for (i = 0; i < n; i++) {
+                        data[pos + i] = (char)(rand() % 256);
+                    }
+                    len += n;
+                    break;
+            }
+        }
+
+        parse_chunked(&req, buffer, REQUEST_BUFFER_SIZE, data, len, len + 1);
+        check_sane("fuzz", &req, buffer, len);
+        parse_chunked(&splitreq, split, REQUEST_BUFFER_SIZE, data, len, 1 + (size_t)rand() % 16);
+        check_same("fuzz", &req, buffer, &splitreq, split);
+
+        // the client may hang up anywhere
+        pos = len > 0 ? (size_t)rand() % len : 0;
+        if (parse_chunked(&req, buffer, REQUEST_BUFFER_SIZE, data, pos, pos + 1) < PARSE_DONE) {
+            request_finish(&req, buffer, pos);
+            check_sane("fuzz finish", &req, buffer, pos);
+        }
+
+        if (g_failures > failures) {
+            fprintf(stderr, "seed %u, round %d: '%.*s'\n", seed, round, (int)len, data);
+            return;
+        }
+    }
+}
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Parses a typical request count times, the way the server does for each one
+static void bench(long count) {
+    const char *request = "GETFILE GET /courses/ud923/filecorpus/yellowstone.jpg KEEPALIVE\r\n\r\n";
+    char buffer[REQUEST_BUFFER_SIZE + 1];
+    struct request_t req;
+    size_t len = strlen(request), done = 0;
+    double start, elapsed;
+    long i;
+
+    start = now();
+    for (i = 0; i < count; i++) {
+        memcpy(buffer, request, len);
+        request_init(&req);
+        done += request_parse(&req, buffer, len, REQUEST_BUFFER_SIZE) == PARSE_DONE;
+    }
+    elapsed = now() - start;
+
+    printf("parsed %zu of %ld requests of %zu bytes in %.3f s: %.0f requests/s, %.1f MB/s\n",
+           done, count, len, elapsed, count / elapsed, count * len / elapsed / 1e6);
+}
+
+int main(int argc, char **argv) {
+    unsigned int seed;
+
+    if (argc > 1 && strcmp(argv[1], "-b") == 0) {
+        bench(argc > 2 ? atol(argv[2]) : BENCH_COUNT);
+        return 0;
+    }
+
+    seed = argc > 1 ? (unsigned int)strtoul(argv[1], NULL, 10) : (unsigned int)time(NULL);
+
+    test_cases();
+    test_finish();
+    test_oversized();
+    test_fuzz(seed);
+
+    if (g_failures > 0) {
+        fprintf(stderr, "%d checks failed\n", g_failures);
+        return EXIT_FAILURE;
+    }
+    printf("request parser: %zu cases, %d fuzz rounds with seed %u passed\n", NCASES, FUZZ_ROUNDS, seed);
+    return 0;
+}
@@ -1,25 +1,107 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <sys/stat.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/mman.h>
+
+#include "content.h"
 
 #define MAX_KEYLEN 256
 
+/* The file behind a key, addr is NULL until content_map */
 typedef struct{
 	int fildes;
+	void *addr;
+	size_t len;
+} file_t;
+
+typedef struct{
+	file_t file;
 	char key[MAX_KEYLEN];
 } item_t;
 
+/* Open-addressing slot, a hash of 0 marks an empty one */
+typedef struct{
+	uint64_t hash;
+	uint32_t key;	/* offset of the key in the arena */
+	file_t file;
+} slot_t;
+
+static int index_type;
+/* set once content_map has mapped every file */
+static int mapped;
+
+/* CONTENT_INDEX_SORTED */
 static int nitems;
 static item_t *items;
 
+/* CONTENT_INDEX_HASH */
+static slot_t *slots;
+static size_t mask;
+static char *arena;
+static size_t arena_len;
+
 static int _itemcmp(const void *a, const void *b){
 	return strcmp(((item_t*) a)->key,((item_t*) b)->key);
 }
 
+/* 64-bit FNV-1a, never 0 */
+static uint64_t _hash(const char *key){
+	uint64_t h = 14695981039346656037ULL;
+
+	while(*key){
+		h ^= (unsigned char) *key++;
+		h *= 1099511628211ULL;
+	}
+
+	return h ? h : 1;
+}
+
+/* Moves the keys out of items into the arena and hashes them into slots */
+static void _build_hash(){
+	size_t capacity = 16, len, i;
+	int n;
+
+	for(n = 0, arena_len = 0; n < nitems; n++)
+		arena_len += strlen(items[n].key) + 1;
+
+	/* keep the load factor at or below 1/2 */
+	while(capacity < 2 * (size_t) nitems)
+		capacity *= 2;
+
+	arena = (char*) malloc(arena_len ? arena_len : 1);
+	slots = (slot_t*) calloc(capacity, sizeof(slot_t));
+	if(arena == NULL || slots == NULL){
+		fprintf(stderr, "Unable to allocate the content index.\n");
+		exit(EXIT_FAILURE);
+	}
+	mask = capacity - 1;
+
+	for(n = 0, arena_len = 0; n < nitems; n++){
+		uint64_t h = _hash(items[n].key);
+
+		for(i = h & mask; slots[i].hash != 0; i = (i + 1) & mask);
+
+		len = strlen(items[n].key) + 1;
+		memcpy(arena + arena_len, items[n].key, len);
+		slots[i].hash = h;
+		slots[i].key = (uint32_t) arena_len;
+		slots[i].file = items[n].file;
+		arena_len += len;
+	}
+
+	free(items);
+	items = NULL;
+}
+
 int content_init(char *filename){
+	return content_init_index(filename, CONTENT_INDEX_HASH);
+}
+
+int content_init_index(char *filename, int index){
 	FILE *filelist;
 	int capacity = 16;
 	char *path, *ptr;
@@ -40,7 +122,9 @@ int content_init(char *filename){
 		strsep(&ptr, " \t"); 		/* The key is first */
 		path = strsep(&ptr, " \t"); /* The path second */
 
-		if( 0 > (items[nitems].fildes = open(path, O_RDONLY))){
+		items[nitems].file.addr = NULL;
+		items[nitems].file.len = 0;
+		if( 0 > (items[nitems].file.fildes = open(path, O_RDONLY))){
 			fprintf(stderr, "Unable to open file %s.\n", path);
 			exit(EXIT_FAILURE);
 		}
@@ -55,12 +139,27 @@ int content_init(char *filename){
 
 	fclose(filelist);
 
-	qsort(items, nitems, sizeof(item_t), _itemcmp);
+	index_type = index;
+	if(index_type == CONTENT_INDEX_HASH)
+		_build_hash();
+	else
+		qsort(items, nitems, sizeof(item_t), _itemcmp);
 
 	return EXIT_SUCCESS;
 }
 
-int content_get(char *key){
+static file_t *_get_hash(char *key){
+	uint64_t h = _hash(key);
+	size_t i;
+
+	for(i = h & mask; slots[i].hash != 0; i = (i + 1) & mask){
+		if(slots[i].hash == h && strcmp(arena + slots[i].key, key) == 0)
+			return &slots[i].file;
+	}
+	return NULL;
+}
+
+static file_t *_get_sorted(char *key){
 	int lo = 0;
 	int hi = nitems - 1;
 	int mid, cmp;
@@ -70,18 +169,126 @@ int content_get(char *key){
 		cmp = strcmp(key,items[mid].key);
 		if ( cmp < 0) hi = mid - 1;
 		else if (cmp > 0) lo = mid + 1;
-		else{
-			lseek(items[mid].fildes, 0, SEEK_SET);
-			return items[mid].fildes;
-		} 
+		else
+			return &items[mid].file;
+	}
+	return NULL;
+}
+
+static file_t *_get(char *key){
+	if(index_type == CONTENT_INDEX_HASH)
+		return _get_hash(key);
+	return _get_sorted(key);
+}
+
+int content_get(char *key){
+	file_t *file;
+
+	if(NULL == (file = _get(key)))
+		return -1;
+
+	lseek(file->fildes, 0, SEEK_SET);
+	return file->fildes;
+}
+
+static int _filecmp(const void *a, const void *b){
+	size_t la = (*(file_t**) a)->len, lb = (*(file_t**) b)->len;
+
+	return la < lb ? -1 : la > lb;
+}
+
+int content_map(size_t lock_budget){
+	file_t **files;
+	struct stat st;
+	size_t nfiles = 0, locked = 0, i;
+
+	if(NULL == (files = (file_t**) malloc((index_type == CONTENT_INDEX_HASH ? mask + 1 : (size_t) nitems) * sizeof(file_t*)))){
+		fprintf(stderr, "Unable to allocate memory in content_map.\n");
+		return -1;
 	}
-	return -1;
+
+	if(index_type == CONTENT_INDEX_HASH){
+		for(i = 0; i <= mask; i++)
+			if(slots[i].hash != 0)
+				files[nfiles++] = &slots[i].file;
+	} else {
+		for(i = 0; i < (size_t) nitems; i++)
+			files[nfiles++] = &items[i].file;
+	}
+
+	for(i = 0; i < nfiles; i++){
+		if(0 > fstat(files[i]->fildes, &st)){
+			perror("Unable to stat content");
+			free(files);
+			return -1;
+		}
+		files[i]->len = (size_t) st.st_size;
+
+		/* an empty file cannot be mapped, its NULL address is never read */
+		if(files[i]->len == 0)
+			continue;
+
+		if(MAP_FAILED == (files[i]->addr = mmap(NULL, files[i]->len, PROT_READ, MAP_SHARED, files[i]->fildes, 0))){
+			perror("Unable to map content");
+			files[i]->addr = NULL;
+			free(files);
+			return -1;
+		}
+		madvise(files[i]->addr, files[i]->len, MADV_WILLNEED);
+	}
+
+	/* pin the smallest files first, they are the most of them per byte */
+	qsort(files, nfiles, sizeof(file_t*), _filecmp);
+	for(i = 0; i < nfiles && locked + files[i]->len <= lock_budget; i++){
+		if(files[i]->len > 0 && 0 > mlock(files[i]->addr, files[i]->len)){
+			perror("Unable to lock content in memory");
+			break;
+		}
+		locked += files[i]->len;
+	}
+
+	free(files);
+	mapped = 1;
+
+	return 0;
+}
+
+int content_get_mapped(char *key, void **addr, size_t *len){
+	file_t *file;
+
+	/* addr alone cannot tell, an empty file stays NULL once mapped */
+	if(!mapped || NULL == (file = _get(key)))
+		return -1;
+
+	*addr = file->addr;
+	*len = file->len;
+	return 0;
+}
+
+static void _close(file_t *file){
+	if(file->addr != NULL)
+		munmap(file->addr, file->len);
+	close(file->fildes);
 }
 
 void content_destroy(){
-	int i;
-	for(i = 0; i < nitems; i++)
-		close(items[i].fildes);
-	
+	size_t i;
+	int n;
+
+	mapped = 0;
+	if(index_type == CONTENT_INDEX_HASH){
+		for(i = 0; i <= mask; i++)
+			if(slots[i].hash != 0)
+				_close(&slots[i].file);
+		free(slots);
+		free(arena);
+		slots = NULL;
+		arena = NULL;
+		return;
+	}
+
+	for(n = 0; n < nitems; n++)
+		_close(&items[n].file);
+
 	free(items);
-}
\ No newline at end of file
+}
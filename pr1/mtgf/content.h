@@ -10,15 +10,51 @@
  * Subsequent calls to content_get with a key value
  * as an argument will return the file descriptor for the 
  * given file path.
+ *
+ * Keys are looked up in an open-addressing hash table; use
+ * content_init_index to pick the index explicitly.
  */
 int content_init(char *filename);
 
+/*
+ * Index backends for content_init_index.
+ * - CONTENT_INDEX_SORTED keeps the items in a sorted array and
+ *   binary searches it with strcmp.
+ * - CONTENT_INDEX_HASH stores the keys in one arena and their
+ *   precomputed hashes in a linear-probing table, so a lookup
+ *   hashes the key once and usually compares a single string.
+ */
+#define CONTENT_INDEX_SORTED 0
+#define CONTENT_INDEX_HASH 1
+
+/*
+ * Same as content_init, using the given index backend.
+ */
+int content_init_index(char *filename, int index);
+
 /* 
  * Returns the file descriptor associated with the input key.
  * Returns -1 if the the key is not found
  */
 int content_get(char *key);
 
+/*
+ * Maps every file of the content into memory once, read-only, and
+ * advises the kernel to read it in ahead of the first request.  Files
+ * are then locked in memory with mlock, smallest first, until
+ * lock_budget bytes are locked; 0 locks nothing.  Must be called after
+ * content_init and before any call to content_get_mapped.  Returns 0,
+ * or -1 if a file could not be mapped.
+ */
+int content_map(size_t lock_budget);
+
+/*
+ * Sets addr and len to the mapping of the file associated with the
+ * input key, without any system call.  Returns -1 if the key is not
+ * found or content_map was not called.
+ */
+int content_get_mapped(char *key, void **addr, size_t *len);
+
 /* 
  * Frees all memory and closes all file descriptors
  * associated with the cache.
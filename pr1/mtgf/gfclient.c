@@ -0,0 +1,654 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <ctype.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include "gfclient.h"
+#include "log.h"
+
+#define BUFFER_SIZE 4096
+#define SCHEME "GETFILE"
+#define STATUS_OK "OK"
+#define STATUS_FILE_NOT_FOUND "FILE_NOT_FOUND"
+#define STATUS_ERROR "ERROR"
+#define HEADER_REQUEST "GETFILE %s %s\r\n\r\n"
+#define HEADER_REQUEST_KEEPALIVE "GETFILE %s %s KEEPALIVE\r\n\r\n"
+#define OPTION_KEEPALIVE "KEEPALIVE"
+#define END_OF_RESPONSE "\r\n\r\n"
+// requests in flight on a keep-alive connection
+#define PIPELINE_DEPTH 16
+// idle connections a session keeps open
+#define SESSION_POOL_SIZE 4
+
+#define true 1
+#define false 0
+typedef int bool;
+
+struct addrinfo *addr_hints;
+
+/*
+ * States of the response header parser, in the order a header goes
+ * through them.  Anything before PARSE_DONE still needs more bytes.
+ */
+typedef enum {
+    PARSE_SCHEME,
+    PARSE_STATUS,
+    PARSE_LENGTH,
+    PARSE_OPTION,
+    PARSE_DONE,
+    PARSE_INVALID
+} parse_state_t;
+
+/*
+ * Incremental response header parser.  It is fed the connection buffer
+ * each time more bytes arrive and resumes where it stopped, so a header
+ * split over any number of reads is scanned once.  Tokens are read in
+ * place, the buffer is left as received for the header callback.
+ */
+struct response_t {
+    parse_state_t state;
+    // next byte to look at, once done the length of the header
+    size_t pos;
+    // first byte of the token being read, if in_token
+    size_t start;
+    bool in_token;
+    // bytes of END_OF_RESPONSE seen in a row
+    int matched;
+    gfstatus_t status;
+    size_t filelen;
+    bool keepalive;
+};
+
+/*
+ * The server address, resolved once, and the keep-alive connections that
+ * are idle between requests, most recently used last.
+ */
+struct gfcsession_t {
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    int family;
+    int socktype;
+    int protocol;
+    int idle[SESSION_POOL_SIZE];
+    int nidle;
+};
+
+/*
+ * A connection to the server.  The buffer holds bytes received but not
+ * yet consumed, which for a pipelined connection may be the start of the
+ * next response.
+ */
+struct gfconn_t {
+    int sockfd;
+    char buffer[BUFFER_SIZE + 1];
+    size_t len;
+};
+
+struct gfcrequest_t {
+    int sockfd;
+    char *server;
+    char *path;
+    unsigned short port;
+    void (*headerfunc)(void*, size_t, void *);
+    void *headerarg;
+    void (*writefunc)(void*, size_t, void *);
+    void *writearg;
+    gfstatus_t status;
+    size_t filelen;
+    size_t bytesrecv;
+    struct response_t response;
+    gfcsession_t *session;
+};
+
+gfcrequest_t *gfc_create(){
+    gfcrequest_t *gfr;
+
+    if ((gfr = (gfcrequest_t *)malloc(sizeof(gfcrequest_t))) == NULL) {
+        perror("Unable to allocate memory");
+        exit(EXIT_FAILURE);
+    }
+    gfr->sockfd = -1;
+    gfr->status = GF_INVALID;
+    gfr->filelen = 0;
+    gfr->bytesrecv = 0;
+    gfr->headerfunc = NULL;
+    gfr->writefunc = NULL;
+    gfr->session = NULL;
+    gfr->response.state = PARSE_SCHEME;
+
+    return gfr;
+}
+
+void gfc_reset(gfcrequest_t *gfr){
+    gfr->status = GF_INVALID;
+    gfr->filelen = 0;
+    gfr->bytesrecv = 0;
+    gfr->response.state = PARSE_SCHEME;
+}
+
+gfcsession_t *gfc_session_create(char *server, unsigned short port){
+    gfcsession_t *session;
+    struct addrinfo *host;
+    char portno[6];
+
+    if ((session = (gfcsession_t *)malloc(sizeof(gfcsession_t))) == NULL) {
+        perror("Unable to allocate memory");
+        exit(EXIT_FAILURE);
+    }
+
+    // convert port to string
+    sprintf(portno, "%d", port);
+
+    if (getaddrinfo(server, portno, addr_hints, &host) != 0) {
+        fprintf(stderr, "Unable to resolve %s\n", server);
+        free(session);
+        return NULL;
+    }
+
+    memcpy(&session->addr, host->ai_addr, host->ai_addrlen);
+    session->addrlen = host->ai_addrlen;
+    session->family = host->ai_family;
+    session->socktype = host->ai_socktype;
+    session->protocol = host->ai_protocol;
+    session->nidle = 0;
+
+    freeaddrinfo(host);
+
+    return session;
+}
+
+void gfc_session_destroy(gfcsession_t *session){
+    while (session->nidle > 0) {
+        close(session->idle[--session->nidle]);
+    }
+    free(session);
+}
+
+void gfc_set_session(gfcrequest_t *gfr, gfcsession_t *session){
+    gfr->session = session;
+}
+
+void gfc_set_server(gfcrequest_t *gfr, char* server){
+    gfr->server = server;
+}
+
+void gfc_set_path(gfcrequest_t *gfr, char* path){
+    gfr->path = path;
+}
+
+void gfc_set_port(gfcrequest_t *gfr, unsigned short port){
+    gfr->port = port;
+}
+
+void gfc_set_headerfunc(gfcrequest_t *gfr, void (*headerfunc)(void*, size_t, void *)){
+    gfr->headerfunc = headerfunc;
+}
+
+void gfc_set_headerarg(gfcrequest_t *gfr, void *headerarg){
+    gfr->headerarg = headerarg;
+}
+
+void gfc_set_writefunc(gfcrequest_t *gfr, void (*writefunc)(void*, size_t, void *)){
+    gfr->writefunc = writefunc;
+}
+
+void gfc_set_writearg(gfcrequest_t *gfr, void *writearg){
+    gfr->writearg = writearg;
+}
+
+static bool token_is(const char *token, size_t len, const char *text) {
+    return len == strlen(text) && memcmp(token, text, len) == 0;
+}
+
+// Method to get the status in gfstatus_t type given a token
+static gfstatus_t get_status(const char *status, size_t len) {
+    if (token_is(status, len, STATUS_OK)) {
+        return GF_OK;
+    } else if (token_is(status, len, STATUS_FILE_NOT_FOUND)) {
+        return GF_FILE_NOT_FOUND;
+    } else if (token_is(status, len, STATUS_ERROR)) {
+        return GF_ERROR;
+    }
+    return GF_INVALID;
+}
+
+/*
+ * Reads the decimal number at the start of token into value and returns
+ * how many bytes it took, 0 if there is no number or it overflows.
+ */
+static size_t parse_number(const char *token, size_t len, size_t *value) {
+    size_t i;
+
+    *value = 0;
+    for (i = 0; i < len && isdigit((unsigned char)token[i]); i++) {
+        if (*value > (SIZE_MAX - (size_t)(token[i] - '0')) / 10) {
+            return 0;
+        }
+        *value = *value * 10 + (size_t)(token[i] - '0');
+    }
+
+    return i;
+}
+
+static void response_init(struct response_t *res) {
+    memset(res, 0, sizeof(*res));
+    res->state = PARSE_SCHEME;
+    res->status = GF_INVALID;
+}
+
+/*
+ * Checks the token buffer[res->start..end) and moves on to the next field.
+ * i.e. <scheme> <status> <length> [KEEPALIVE]
+ */
+static void parse_token(struct response_t *res, const char *buffer, size_t end) {
+    const char *token = buffer + res->start;
+    size_t len = end - res->start;
+
+    switch (res->state) {
+        case PARSE_SCHEME:
+            res->state = token_is(token, len, SCHEME) ? PARSE_STATUS : PARSE_INVALID;
+            break;
+        case PARSE_STATUS:
+            res->status = get_status(token, len);
+            res->state = res->status != GF_INVALID ? PARSE_LENGTH : PARSE_INVALID;
+            break;
+        case PARSE_LENGTH:
+            res->state = parse_number(token, len, &res->filelen) == len ? PARSE_OPTION : PARSE_INVALID;
+            break;
+        case PARSE_OPTION:
+            // the server echoes KEEPALIVE if it keeps the connection open
+            if (token_is(token, len, OPTION_KEEPALIVE)) {
+                res->keepalive = true;
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+/*
+ * Parses the bytes of buffer, which now holds len of them, that the last
+ * call did not see.  Returns PARSE_DONE once the header is whole, with
+ * res->pos its length, PARSE_INVALID as soon as it cannot be valid, or an
+ * earlier state if more bytes are needed.
+ */
+static parse_state_t response_parse(struct response_t *res, const char *buffer, size_t len) {
+    char c;
+
+    while (res->state < PARSE_DONE && res->pos < len) {
+        c = buffer[res->pos];
+
+        if (c == END_OF_RESPONSE[res->matched]) {
+            res->matched++;
+        } else {
+            res->matched = c == END_OF_RESPONSE[0] ? 1 : 0;
+        }
+
+        if (c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+            if (res->in_token) {
+                res->in_token = false;
+                parse_token(res, buffer, res->pos);
+            }
+        } else if (!res->in_token) {
+            res->start = res->pos;
+            res->in_token = true;
+        }
+        res->pos++;
+
+        if (res->matched == (int)strlen(END_OF_RESPONSE) && res->state < PARSE_DONE) {
+            // only an OK response has to announce its length
+            if (res->state == PARSE_OPTION || (res->state == PARSE_LENGTH && res->status != GF_OK)) {
+                res->state = PARSE_DONE;
+            } else {
+                res->state = PARSE_INVALID;
+            }
+        }
+    }
+
+    return res->state;
+}
+
+// Opens a connection to the address cached in the session
+static int connect_session(gfcsession_t *session) {
+    int sockfd;
+
+    if ((sockfd = socket(session->family, session->socktype, session->protocol)) < 0) {
+        L(ERROR, "Unable to create the socket: %s", strerror(errno));
+        return -1;
+    }
+
+    if (connect(sockfd, (struct sockaddr *)&session->addr, session->addrlen) < 0) {
+        L(ERROR, "Error connecting: %s", strerror(errno));
+        close(sockfd);
+        return -1;
+    }
+
+    return sockfd;
+}
+
+// Opens a connection to the server of the request, returns -1 on failure
+static int connect_server(gfcrequest_t *gfr) {
+    struct addrinfo *host;
+    int sockfd;
+    char portno[6];
+
+    if (gfr->session != NULL) {
+        return connect_session(gfr->session);
+    }
+
+    // convert port to string
+    sprintf(portno, "%d", gfr->port);
+//    printf("Port Number: %s\n", portno);
+
+    if (getaddrinfo(gfr->server, portno, addr_hints, &host) != 0) {
+        L(ERROR, "Unable to resolve %s", gfr->server);
+        return -1;
+    }
+
+    if ((sockfd = socket(host->ai_family, host->ai_socktype, host->ai_protocol)) < 0) {
+        L(ERROR, "Unable to create the socket: %s", strerror(errno));
+        freeaddrinfo(host);
+        return -1;
+    }
+
+    if (connect(sockfd, host->ai_addr, host->ai_addrlen) < 0) {
+        L(ERROR, "Error connecting: %s", strerror(errno));
+        close(sockfd);
+        freeaddrinfo(host);
+        return -1;
+    }
+
+    // make sure to clean up
+    freeaddrinfo(host);
+
+    return sockfd;
+}
+
+static int send_request(int sockfd, gfcrequest_t *gfr, bool keepalive) {
+    char req[BUFSIZ];
+    size_t len, sent = 0;
+    ssize_t n;
+
+    snprintf(req, sizeof(req), keepalive ? HEADER_REQUEST_KEEPALIVE : HEADER_REQUEST, "GET", gfr->path);
+    len = strlen(req);
+//    printf("Request: '%s'\n", req);
+
+    // the server may already have closed a reused connection
+    while (sent < len) {
+        if ((n = send(sockfd, req + sent, len - sent, MSG_NOSIGNAL)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        sent += n;
+    }
+
+    return 0;
+}
+
+/*
+ * Reads one response from conn.  Bytes that arrive after the body belong
+ * to the next pipelined response and stay in conn->buffer.  Returns 0 on
+ * success and sets keepalive if the server keeps the connection open.
+ */
+static int receive_response(struct gfconn_t *conn, gfcrequest_t *gfr, bool *keepalive) {
+    struct response_t *res = &gfr->response;
+    size_t header_size, body_size, chunk;
+    ssize_t recv_size;
+
+    gfr->status = GF_INVALID;
+    gfr->filelen = 0;
+    gfr->bytesrecv = 0;
+
+    // read the header, however many reads it is split over
+    response_init(res);
+    while (response_parse(res, conn->buffer, conn->len) < PARSE_DONE) {
+        if (conn->len == BUFFER_SIZE) {
+            // could not find end of response in the buffer
+            res->state = PARSE_INVALID;
+            break;
+        }
+        if ((recv_size = recv(conn->sockfd, conn->buffer + conn->len, BUFFER_SIZE - conn->len, 0)) < 0 && errno == EINTR) {
+            continue;
+        }
+        if (recv_size <= 0) {
+            return -1;
+        }
+        conn->len += recv_size;
+    }
+
+    // if header is not in the right format or invalid, return error
+    if (res->state != PARSE_DONE) {
+        L(ERROR, "Header error");
+        return -1;
+    }
+    header_size = res->pos;
+
+    gfr->status = res->status;
+    gfr->filelen = res->filelen;
+    *keepalive = res->keepalive;
+
+    // header callback
+    if (gfr->headerfunc) {
+        gfr->headerfunc(conn->buffer, header_size, gfr->headerarg);
+    }
+
+    // only an OK response carries a body
+    body_size = gfr->status == GF_OK ? gfr->filelen : 0;
+
+    // get remainder of the buffer as the content to write
+    chunk = conn->len - header_size < body_size ? conn->len - header_size : body_size;
+    if (gfr->writefunc && chunk > 0) {
+        gfr->writefunc(conn->buffer + header_size, chunk, gfr->writearg);
+    }
+    gfr->bytesrecv = chunk;
+    conn->len -= header_size + chunk;
+    memmove(conn->buffer, conn->buffer + header_size + chunk, conn->len);
+
+    // read the response until all bytes are received
+    while (gfr->bytesrecv < body_size) {
+        if ((recv_size = recv(conn->sockfd, conn->buffer, BUFFER_SIZE, 0)) < 0 && errno == EINTR) {
+            continue;
+        }
+        if (recv_size <= 0) {
+            return -1;
+        }
+        chunk = (size_t)recv_size < body_size - gfr->bytesrecv ? (size_t)recv_size : body_size - gfr->bytesrecv;
+        if (gfr->writefunc) {
+            gfr->writefunc(conn->buffer, chunk, gfr->writearg);
+        }
+        gfr->bytesrecv += chunk;
+        // keep the start of the next response
+        conn->len = (size_t)recv_size - chunk;
+        memmove(conn->buffer, conn->buffer + chunk, conn->len);
+    }
+
+    return 0;
+}
+
+/*
+ * Performs the request over a connection of the session, reusing an idle
+ * one if there is any, and keeps the connection for later requests if the
+ * server agrees to keep-alive.
+ */
+static int perform_session(gfcrequest_t *gfr) {
+    gfcsession_t *session = gfr->session;
+    struct gfconn_t conn;
+    bool keepalive;
+    bool reused;
+
+    for ( ; ; ) {
+        if ((reused = session->nidle > 0)) {
+            conn.sockfd = session->idle[--session->nidle];
+        } else if ((conn.sockfd = connect_session(session)) < 0) {
+            return -1;
+        }
+        conn.len = 0;
+
+        if (send_request(conn.sockfd, gfr, true) < 0 || receive_response(&conn, gfr, &keepalive) < 0) {
+            close(conn.sockfd);
+            if (reused && conn.len == 0 && gfc_get_status(gfr) == GF_INVALID) {
+                // the server closed the idle connection, try the next one
+                continue;
+            }
+            return -1;
+        }
+
+        // the connection is reusable only if nothing else is pending on it
+        if (keepalive && conn.len == 0 && session->nidle < SESSION_POOL_SIZE) {
+            session->idle[session->nidle++] = conn.sockfd;
+        } else {
+            close(conn.sockfd);
+        }
+
+        return 0;
+    }
+}
+
+int gfc_perform(gfcrequest_t *gfr){
+    struct gfconn_t conn;
+    bool keepalive;
+    int result = 0;
+
+    if (gfr->session != NULL) {
+        return perform_session(gfr);
+    }
+
+    if ((conn.sockfd = connect_server(gfr)) < 0) {
+        gfc_cleanup(gfr);
+        gfc_global_cleanup();
+        exit(EXIT_FAILURE);
+    }
+    conn.len = 0;
+
+//    printf("Connected to the socket\n");
+
+    // send request to server
+    if (send_request(conn.sockfd, gfr, false) < 0) {
+        L(ERROR, "Error sending request: %s", strerror(errno));
+        result = -1;
+    } else if (receive_response(&conn, gfr, &keepalive) < 0) {
+        result = -1;
+    }
+
+    close(conn.sockfd);
+
+    return result;
+}
+
+int gfc_perform_many(gfcrequest_t **gfrs, size_t nrequests){
+    struct gfconn_t conn;
+    size_t next_send = 0, next_recv = 0, served = 0;
+    size_t depth = 1;
+    bool keepalive;
+
+    conn.sockfd = -1;
+
+    while (next_recv < nrequests) {
+        if (conn.sockfd < 0) {
+            // requests sent on the old connection but never answered are sent again
+            if ((conn.sockfd = connect_server(gfrs[0])) < 0) {
+                return -1;
+            }
+            conn.len = 0;
+            next_send = next_recv;
+            served = 0;
+            // do not pipeline until the server has agreed to keep-alive
+            depth = 1;
+        }
+
+        // every request but the last one asks to keep the connection open
+        while (next_send < nrequests && next_send - next_recv < depth) {
+            if (send_request(conn.sockfd, gfrs[next_send], next_send + 1 < nrequests) < 0) {
+                break;
+            }
+            next_send++;
+        }
+
+        if (receive_response(&conn, gfrs[next_recv], &keepalive) < 0) {
+            close(conn.sockfd);
+            conn.sockfd = -1;
+            if (served > 0 && conn.len == 0 && gfc_get_status(gfrs[next_recv]) == GF_INVALID) {
+                // the server closed a reused connection before answering, retry
+                continue;
+            }
+            return -1;
+        }
+        next_recv++;
+        served++;
+
+        if (keepalive) {
+            depth = PIPELINE_DEPTH;
+        } else {
+            close(conn.sockfd);
+            conn.sockfd = -1;
+        }
+    }
+
+    if (conn.sockfd >= 0) {
+        close(conn.sockfd);
+    }
+
+    return 0;
+}
+
+gfstatus_t gfc_get_status(gfcrequest_t *gfr){
+    return gfr->status;
+}
+
+char* gfc_strstatus(gfstatus_t status){
+    char *status_string;
+
+    switch (status) {
+        case GF_OK:
+            status_string = "OK";
+            break;
+        case GF_FILE_NOT_FOUND:
+            status_string = "FILE_NOT_FOUND";
+            break;
+        case GF_ERROR:
+            status_string = "ERROR";
+            break;
+        case GF_INVALID:
+        default:
+            status_string = "INVALID";
+            break;
+    }
+
+    return status_string;
+}
+
+size_t gfc_get_filelen(gfcrequest_t *gfr){
+    return gfr->filelen;
+}
+
+size_t gfc_get_bytesreceived(gfcrequest_t *gfr){
+    return gfr->bytesrecv;
+}
+
+void gfc_cleanup(gfcrequest_t *gfr){
+    if (gfr->sockfd >= 0) {
+        close(gfr->sockfd);
+    }
+    free(gfr);
+}
+
+void gfc_global_init(){
+    addr_hints = (struct addrinfo *)malloc(sizeof(struct addrinfo));
+    memset(addr_hints, 0, sizeof(struct addrinfo));
+    addr_hints->ai_family = AF_INET;
+    addr_hints->ai_socktype = SOCK_STREAM;
+    addr_hints->ai_protocol = 0;
+}
+
+void gfc_global_cleanup(){
+    free(addr_hints);
+}
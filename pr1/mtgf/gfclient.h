@@ -18,6 +18,9 @@ typedef enum{
 /*struct for a getfile request*/
 typedef struct gfcrequest_t gfcrequest_t;
 
+/*struct for the connections a client keeps to one server*/
+typedef struct gfcsession_t gfcsession_t;
+
 /*
  * Returns the string associated with the input status
  */
@@ -31,6 +34,36 @@ char* gfc_strstatus(gfstatus_t status);
  */
 gfcrequest_t *gfc_create();
 
+/*
+ * Clears the results of a performed request so that the handle can be
+ * performed again, e.g. after changing its path and write argument.  The
+ * server, port, callbacks and session are kept.
+ */
+void gfc_reset(gfcrequest_t *gfr);
+
+/*
+ * Creates a session with the given server.  The address is resolved once
+ * here, and connections on which the server agrees to keep-alive are kept
+ * open for the following requests of the session.  A session is not
+ * thread-safe; give each thread its own.  Returns NULL if the server
+ * cannot be resolved.  Must be called after gfc_global_init.
+ */
+gfcsession_t *gfc_session_create(char *server, unsigned short port);
+
+/*
+ * Closes the idle connections of the session and frees it.  No request
+ * may still be using it.
+ */
+void gfc_session_destroy(gfcsession_t *session);
+
+/*
+ * Makes gfc_perform and gfc_perform_many connect through the session
+ * instead of resolving the server and port of the request.  gfc_perform
+ * then asks the server to keep the connection open and reuses it for the
+ * next request of the session.
+ */
+void gfc_set_session(gfcrequest_t *gfr, gfcsession_t *session);
+
 /*
  * Sets the server to which the request will be sent.
  */
@@ -94,6 +127,19 @@ void gfc_set_writearg(gfcrequest_t *gfr, void *writearg);
  */
 int gfc_perform(gfcrequest_t *gfr);
 
+/*
+ * Performs the nrequests transfers in gfrs over a single connection to the
+ * server and port of gfrs[0], using the keep-alive extension of the
+ * protocol.  Once the server has confirmed keep-alive, up to 16 requests
+ * are pipelined ahead of the response being read.  If the server closes
+ * the connection (e.g. it does not support keep-alive), the remaining
+ * requests are sent again on a new one.  The callbacks and results of each
+ * request are the same as with gfc_perform.  Returns 0 if every transfer
+ * was successful, otherwise a negative integer; requests after the one
+ * that failed are left unperformed.
+ */
+int gfc_perform_many(gfcrequest_t **gfrs, size_t nrequests);
+
 /*
  * Returns the status of the response.
  */
@@ -7,9 +7,12 @@
 #include <unistd.h>
 #include <stdint.h>
 #include <pthread.h>
+#include <math.h>
+#include <time.h>
 
 #include "workload.h"
 #include "gfclient.h"
+#include "histogram.h"
 
 #define USAGE                                                                 \
 "usage:\n"                                                                    \
@@ -20,6 +23,11 @@
 "  -w [workload_path]  Path to workload file (Default: workload.txt)\n"       \
 "  -t [nthreads]       Number of threads (Default 1)\n"                       \
 "  -n [num_requests]   Requests download per thread (Default: 1)\n"           \
+"  -d [distribution]   Paths: seq, random, zipf or weighted (Default: seq)\n" \
+"  -z [exponent]       Exponent of the zipf distribution (Default: 1.0)\n"    \
+"  -l                  Generate load: discard bodies, report latencies\n"     \
+"  -r [rate]           Open loop at rate requests/sec, Poisson arrivals\n"    \
+"  -j [report_path]    Also write the load report as JSON (- for stdout)\n"   \
 "  -h                  Show this help message\n"                              \
 
 /* OPTIONS DESCRIPTOR ====================================================== */
@@ -29,6 +37,11 @@ static struct option gLongOptions[] = {
         {"workload-path", required_argument,      NULL,           'w'},
         {"nthreads",      required_argument,      NULL,           't'},
         {"nrequests",     required_argument,      NULL,           'n'},
+        {"distribution",  required_argument,      NULL,           'd'},
+        {"zipf",          required_argument,      NULL,           'z'},
+        {"load",          no_argument,            NULL,           'l'},
+        {"rate",          required_argument,      NULL,           'r'},
+        {"json",          required_argument,      NULL,           'j'},
         {"help",          no_argument,            NULL,           'h'},
         {NULL,            0,                      NULL,             0}
 };
@@ -37,9 +50,24 @@ typedef struct client_requests_t {
     int nrequests;
     char* server;
     unsigned short port;
+
+    // load generation, arrivals[i] is when request i is due in open loop
+    double rate;
+    double *arrivals;
+    long next_arrival;
+    long narrivals;
+    uint64_t start_ns;
 } client_requests_t;
 
-static pthread_mutex_t mutex_get_path = PTHREAD_MUTEX_INITIALIZER;
+/* What one load thread saw, merged into the report once it is done */
+typedef struct load_stats_t {
+    client_requests_t *req;
+    histogram_t latency;
+    uint64_t ok;
+    uint64_t not_found;
+    uint64_t errors;
+    uint64_t bytes;
+} load_stats_t;
 
 static void Usage() {
     fprintf(stdout, "%s", USAGE);
@@ -89,6 +117,7 @@ static void writecb(void* data, size_t data_len, void *arg){
 /* Thread func ======================================================= */
 static void* request_thread(void *arg) {
     int i;
+    gfcsession_t *session;
     gfcrequest_t *gfr;
     FILE *file;
     char *req_path;
@@ -99,11 +128,20 @@ static void* request_thread(void *arg) {
     // get the passed arguments
     req = (client_requests_t*) arg;
 
+    // one session and one request handle are reused for every download
+    if (NULL == (session = gfc_session_create(req->server, req->port))){
+        exit(EXIT_FAILURE);
+    }
+
+    gfr = gfc_create();
+    gfc_set_server(gfr, req->server);
+    gfc_set_port(gfr, req->port);
+    gfc_set_session(gfr, session);
+    gfc_set_writefunc(gfr, writecb);
+
     /*Making the requests...*/
     for(i = 0; i < req->nrequests; i++){
-        pthread_mutex_lock(&mutex_get_path);
         req_path = workload_get_path();
-        pthread_mutex_unlock(&mutex_get_path);
 
         if(strlen(req_path) > 256){
             fprintf(stderr, "Request path exceeded maximum of 256 characters\n.");
@@ -114,11 +152,8 @@ static void* request_thread(void *arg) {
 
         file = openFile(local_path);
 
-        gfr = gfc_create();
-        gfc_set_server(gfr, req->server);
+        gfc_reset(gfr);
         gfc_set_path(gfr, req_path);
-        gfc_set_port(gfr, req->port);
-        gfc_set_writefunc(gfr, writecb);
         gfc_set_writearg(gfr, file);
 
         fprintf(stdout, "Requesting %s%s\n", req->server, req_path);
@@ -140,14 +175,217 @@ static void* request_thread(void *arg) {
 
         fprintf(stdout, "Status: %s\n", gfc_strstatus(gfc_get_status(gfr)));
         fprintf(stdout, "Received %zu of %zu bytes\n", gfc_get_bytesreceived(gfr), gfc_get_filelen(gfr));
+    }
+
+    gfc_cleanup(gfr);
+    gfc_session_destroy(session);
+
+    pthread_exit(NULL);
+}
+
+/* Load generation =================================================== */
+static uint64_t now_ns(){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void sleep_until_ns(uint64_t deadline){
+    struct timespec ts;
+
+    ts.tv_sec = (time_t)(deadline / 1000000000ULL);
+    ts.tv_nsec = (long)(deadline % 1000000000ULL);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+/*
+ * Draws the due times of narrivals requests of a Poisson process with the
+ * given rate, in seconds from the start of the run.
+ */
+static double *poisson_arrivals(long narrivals, double rate){
+    unsigned short seed[3];
+    double *arrivals, t = 0.0;
+    uint64_t now = now_ns();
+    long i;
+
+    if (NULL == (arrivals = (double*) malloc(narrivals * sizeof(double)))){
+        perror("Unable to allocate memory");
+        exit(EXIT_FAILURE);
+    }
+
+    seed[0] = (unsigned short)now;
+    seed[1] = (unsigned short)(now >> 16);
+    seed[2] = (unsigned short)(now >> 32);
+
+    for (i = 0; i < narrivals; i++){
+        // exponential inter-arrival times
+        t += -log(1.0 - erand48(seed)) / rate;
+        arrivals[i] = t;
+    }
+
+    return arrivals;
+}
+
+/*
+ * Closed loop: nrequests back to back, latency from send to last byte.
+ * Open loop: takes the next due request of the shared schedule and waits
+ * for its time, latency from when it was due so that time spent waiting
+ * for a free thread counts against the server.
+ */
+static void* load_thread(void *arg) {
+    load_stats_t *stats = (load_stats_t*) arg;
+    client_requests_t *req = stats->req;
+    gfcsession_t *session;
+    gfcrequest_t *gfr;
+    char *req_path;
+    uint64_t start;
+    long i;
+
+    if (NULL == (session = gfc_session_create(req->server, req->port))){
+        exit(EXIT_FAILURE);
+    }
+
+    // bodies are counted, not stored
+    gfr = gfc_create();
+    gfc_set_server(gfr, req->server);
+    gfc_set_port(gfr, req->port);
+    gfc_set_session(gfr, session);
+
+    for (i = 0; ; i++){
+        if (req->rate > 0){
+            if ((i = __atomic_fetch_add(&req->next_arrival, 1, __ATOMIC_RELAXED)) >= req->narrivals)
+                break;
+            start = req->start_ns + (uint64_t)(req->arrivals[i] * 1e9);
+            sleep_until_ns(start);
+        } else {
+            if (i >= req->nrequests)
+                break;
+            start = now_ns();
+        }
+
+        req_path = workload_get_path();
+
+        gfc_reset(gfr);
+        gfc_set_path(gfr, req_path);
 
-        gfc_cleanup(gfr);
+        if (0 > gfc_perform(gfr) || gfc_get_status(gfr) == GF_ERROR || gfc_get_status(gfr) == GF_INVALID){
+            stats->errors++;
+        } else if (gfc_get_status(gfr) == GF_FILE_NOT_FOUND){
+            stats->not_found++;
+        } else {
+            stats->ok++;
+        }
+        stats->bytes += gfc_get_bytesreceived(gfr);
 
+        // microseconds
+        histogram_record(&stats->latency, (now_ns() - start) / 1000);
     }
 
+    gfc_cleanup(gfr);
+    gfc_session_destroy(session);
+
     pthread_exit(NULL);
 }
 
+static void report_text(FILE *out, load_stats_t *total, int nthreads, double rate, double seconds){
+    histogram_t *h = &total->latency;
+
+    fprintf(out, "mode: %s, threads: %d", rate > 0 ? "open" : "closed", nthreads);
+    if (rate > 0)
+        fprintf(out, ", target: %.1f req/s", rate);
+    fprintf(out, "\n");
+    fprintf(out, "requests: %lu ok, %lu not found, %lu errors\n",
+            (unsigned long)total->ok, (unsigned long)total->not_found, (unsigned long)total->errors);
+    fprintf(out, "duration: %.3f s, throughput: %.1f req/s, %.2f MB/s\n",
+            seconds, h->total / seconds, total->bytes / seconds / 1e6);
+    fprintf(out, "latency (us): min %lu, mean %.1f, p50 %lu, p90 %lu, p99 %lu, p999 %lu, max %lu\n",
+            (unsigned long)(h->total ? h->min : 0), histogram_mean(h),
+            (unsigned long)histogram_percentile(h, 50.0), (unsigned long)histogram_percentile(h, 90.0),
+            (unsigned long)histogram_percentile(h, 99.0), (unsigned long)histogram_percentile(h, 99.9),
+            (unsigned long)h->max);
+}
+
+static void report_json(FILE *out, load_stats_t *total, int nthreads, double rate, double seconds){
+    histogram_t *h = &total->latency;
+
+    fprintf(out, "{\"mode\": \"%s\", \"threads\": %d, \"target_rps\": %.1f, ",
+            rate > 0 ? "open" : "closed", nthreads, rate);
+    fprintf(out, "\"requests\": %lu, \"ok\": %lu, \"not_found\": %lu, \"errors\": %lu, ",
+            (unsigned long)h->total, (unsigned long)total->ok, (unsigned long)total->not_found, (unsigned long)total->errors);
+    fprintf(out, "\"duration_s\": %.6f, \"throughput_rps\": %.3f, \"bytes\": %lu, ",
+            seconds, h->total / seconds, (unsigned long)total->bytes);
+    fprintf(out, "\"latency_us\": {\"min\": %lu, \"mean\": %.1f, \"p50\": %lu, \"p90\": %lu, \"p99\": %lu, \"p999\": %lu, \"max\": %lu}}\n",
+            (unsigned long)(h->total ? h->min : 0), histogram_mean(h),
+            (unsigned long)histogram_percentile(h, 50.0), (unsigned long)histogram_percentile(h, 90.0),
+            (unsigned long)histogram_percentile(h, 99.0), (unsigned long)histogram_percentile(h, 99.9),
+            (unsigned long)h->max);
+}
+
+/* Runs the load threads and prints what they measured */
+static int generate_load(client_requests_t *req, int nthreads, char *json_path){
+    pthread_t *client_workers;
+    load_stats_t *stats, total;
+    double seconds;
+    FILE *json;
+    int i;
+
+    client_workers = (pthread_t*) malloc(nthreads * sizeof(pthread_t));
+    stats = (load_stats_t*) malloc(nthreads * sizeof(load_stats_t));
+    if (client_workers == NULL || stats == NULL){
+        perror("Unable to allocate memory");
+        exit(EXIT_FAILURE);
+    }
+
+    if (req->rate > 0){
+        req->narrivals = (long)req->nrequests * nthreads;
+        req->arrivals = poisson_arrivals(req->narrivals, req->rate);
+        req->next_arrival = 0;
+    }
+
+    req->start_ns = now_ns();
+    for (i = 0; i < nthreads; i++){
+        memset(&stats[i], 0, sizeof(load_stats_t));
+        stats[i].req = req;
+        histogram_init(&stats[i].latency);
+        if (pthread_create(&client_workers[i], NULL, load_thread, &stats[i]) != 0){
+            fprintf(stderr, "Error creating thread");
+            exit(1);
+        }
+    }
+
+    memset(&total, 0, sizeof(load_stats_t));
+    histogram_init(&total.latency);
+    for (i = 0; i < nthreads; i++){
+        pthread_join(client_workers[i], NULL);
+        histogram_merge(&total.latency, &stats[i].latency);
+        total.ok += stats[i].ok;
+        total.not_found += stats[i].not_found;
+        total.errors += stats[i].errors;
+        total.bytes += stats[i].bytes;
+    }
+    seconds = (now_ns() - req->start_ns) / 1e9;
+
+    report_text(stdout, &total, nthreads, req->rate, seconds);
+
+    if (json_path != NULL){
+        if (strcmp(json_path, "-") == 0){
+            report_json(stdout, &total, nthreads, req->rate, seconds);
+        } else if (NULL == (json = fopen(json_path, "w"))){
+            perror("Unable to open the report");
+        } else {
+            report_json(json, &total, nthreads, req->rate, seconds);
+            fclose(json);
+        }
+    }
+
+    free(req->arrivals);
+    free(stats);
+    free(client_workers);
+
+    return total.errors > 0 ? 1 : 0;
+}
+
 /* Main ========================================================= */
 int main(int argc, char **argv) {
 /* COMMAND LINE OPTIONS ============================================= */
@@ -161,10 +399,16 @@ int main(int argc, char **argv) {
     int option_char = 0;
     int nrequests = 1;
     int nthreads = 1;
+    int load = 0;
+    int distribution = WORKLOAD_SEQ;
+    double zipf_exponent = WORKLOAD_ZIPF_EXPONENT;
+    double rate = 0;
+    char *json_path = NULL;
+    int returncode = 0;
     void *rc;
 
     // Parse and set command line arguments
-    while ((option_char = getopt_long(argc, argv, "s:p:w:n:t:h", gLongOptions, NULL)) != -1) {
+    while ((option_char = getopt_long(argc, argv, "s:p:w:n:t:d:z:lr:j:h", gLongOptions, NULL)) != -1) {
         switch (option_char) {
             case 's': // server
                 server = optarg;
@@ -181,6 +425,34 @@ int main(int argc, char **argv) {
             case 't': // nthreads
                 nthreads = atoi(optarg);
                 break;
+            case 'd': // distribution
+                if (strcmp(optarg, "seq") == 0) {
+                    distribution = WORKLOAD_SEQ;
+                } else if (strcmp(optarg, "random") == 0) {
+                    distribution = WORKLOAD_RND;
+                } else if (strcmp(optarg, "zipf") == 0) {
+                    distribution = WORKLOAD_ZIPF;
+                } else if (strcmp(optarg, "weighted") == 0) {
+                    distribution = WORKLOAD_WEIGHTED;
+                } else {
+                    fprintf(stderr, "Unknown distribution %s.\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'z': // zipf
+                zipf_exponent = atof(optarg);
+                break;
+            case 'l': // load
+                load = 1;
+                break;
+            case 'r': // rate
+                rate = atof(optarg);
+                load = 1;
+                break;
+            case 'j': // json
+                json_path = optarg;
+                load = 1;
+                break;
             case 'h': // help
                 Usage();
                 exit(0);
@@ -196,12 +468,25 @@ int main(int argc, char **argv) {
         exit(EXIT_FAILURE);
     }
 
+    if ( 0 > (distribution == WORKLOAD_ZIPF ? workload_set_zipf(zipf_exponent) : workload_set_mode(distribution))){
+        fprintf(stderr, "Unable to set up the workload distribution.\n");
+        exit(EXIT_FAILURE);
+    }
+
     gfc_global_init();
 
     // variables to be used in request_thread
     req.nrequests = nrequests;
     req.server = server;
     req.port = port;
+    req.rate = rate;
+    req.arrivals = NULL;
+
+    if (load){
+        returncode = generate_load(&req, nthreads, json_path);
+        gfc_global_cleanup();
+        return returncode;
+    }
 
     client_workers = (pthread_t*) malloc(nthreads * sizeof(pthread_t));
 
@@ -0,0 +1,546 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <ctype.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/epoll.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <signal.h>
+
+#include "gfserver.h"
+#include "metrics.h"
+#include "log.h"
+#include "topology.h"
+
+/*
+ * Server side of the GETFILE protocol for the multithreaded server.
+ *
+ * The handler does not have to finish the response before it returns: it
+ * may hand the gfcontext_t to another thread, which keeps calling the
+ * gfs_* functions.  The connection is closed and the context released once
+ * the whole body announced by gfs_sendheader has been sent, once a non-OK
+ * header has been sent, or when gfs_abort is called.
+ *
+ * With keep-alive enabled, a connection whose response completed is not
+ * closed but parked in an epoll set until its next request arrives; the
+ * accept loop serves those requests just like new connections.
+ *
+ * With several listeners, every listener is a copy of the gfserver_t
+ * with its own SO_REUSEPORT socket, epoll set and accept loop thread.  A
+ * connection stays with the listener that accepted it, keep-alive
+ * requests included.
+ */
+
+#define SCHEME "GETFILE"
+#define METHOD_GET "GET"
+#define HEADER_RESPONSE "GETFILE %s %zu\r\n\r\n"
+#define HEADER_RESPONSE_KEEPALIVE "GETFILE %s %zu KEEPALIVE\r\n\r\n"
+#define OPTION_KEEPALIVE "KEEPALIVE"
+#define END_OF_REQUEST "\r\n\r\n"
+#define COPY_BUFFER_SIZE 4096
+#define MAX_EVENTS 64
+
+#define true 1
+#define false 0
+typedef int bool;
+
+struct gfserver_t {
+    int listenfd;
+    unsigned short port;
+    int max_npending;
+    int epollfd;
+    bool keepalive;
+    ssize_t (*handler)(gfcontext_t *, char *, void *);
+    void* args;
+    // number of sharded listeners, and which one this is
+    int nlisteners;
+    int listener;
+    // TOPOLOGY_PIN_* policy for the listener threads
+    int placement;
+};
+
+struct gfcontext_t {
+    int connfd;
+    gfserver_t *gfs;
+    struct sockaddr_in client_addr;
+    size_t file_len;
+    size_t bytes_transferred;
+    // the client asked to keep the connection open after this response
+    bool keepalive;
+    // the connection is in the epoll set of the server
+    bool registered;
+    char request[BUFSIZ];
+    // bytes received past the end of the current request
+    char pending[BUFSIZ];
+    size_t npending;
+};
+
+static void close_context(gfcontext_t *ctx) {
+    // closing the descriptor also removes it from the epoll set
+    close(ctx->connfd);
+    free(ctx);
+}
+
+/*
+ * Ends a complete response.  A keep-alive connection goes back to the
+ * epoll set to wait for its next request, any other one is closed.  ctx
+ * must not be used after this call, the accept loop may already own it.
+ */
+static void finish_response(gfcontext_t *ctx) {
+    struct epoll_event ev;
+    bool registered = ctx->registered;
+
+    if (!ctx->keepalive) {
+        close_context(ctx);
+        return;
+    }
+
+    ctx->file_len = 0;
+    ctx->bytes_transferred = 0;
+    ctx->registered = true;
+
+    // a request pipelined behind this one is already buffered, so wait
+    // for writability instead, which reports the connection right away
+    ev.events = (strstr(ctx->pending, END_OF_REQUEST) != NULL ? EPOLLOUT : EPOLLIN) | EPOLLONESHOT;
+    ev.data.ptr = ctx;
+    if (epoll_ctl(ctx->gfs->epollfd, registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, ctx->connfd, &ev) < 0) {
+        close_context(ctx);
+    }
+}
+
+/*
+ * Sends the whole buffer, retrying on partial writes.
+ */
+static ssize_t send_all(int connfd, const char *data, size_t len) {
+    size_t sent = 0;
+    ssize_t n;
+
+    while (sent < len) {
+        if ((n = send(connfd, data + sent, len - sent, MSG_NOSIGNAL)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        sent += n;
+    }
+
+    return (ssize_t)sent;
+}
+
+/*
+ * Accounts for body bytes and closes the connection once the body is complete.
+ */
+static void body_sent(gfcontext_t *ctx, size_t len) {
+    metrics_bytes(len);
+    ctx->bytes_transferred += len;
+    if (ctx->bytes_transferred >= ctx->file_len) {
+        finish_response(ctx);
+    }
+}
+
+ssize_t gfs_sendheader(gfcontext_t *ctx, gfstatus_t status, size_t file_len){
+    char header[BUFSIZ];
+    // tell the client whether the connection stays open after the body
+    char *format = ctx->keepalive ? HEADER_RESPONSE_KEEPALIVE : HEADER_RESPONSE;
+    ssize_t n;
+
+    switch (status) {
+        case GF_OK:
+            snprintf(header, sizeof(header), format, "OK", file_len);
+            break;
+        case GF_FILE_NOT_FOUND:
+            snprintf(header, sizeof(header), format, "FILE_NOT_FOUND", (size_t)0);
+            break;
+        case GF_ERROR:
+        default:
+            snprintf(header, sizeof(header), format, "ERROR", (size_t)0);
+            break;
+    }
+
+    n = send_all(ctx->connfd, header, strlen(header));
+    metrics_status(status);
+
+    if (n < 0) {
+        close_context(ctx);
+    } else if (status != GF_OK || file_len == 0) {
+        // nothing follows a non-OK header
+        finish_response(ctx);
+    } else {
+        ctx->file_len = file_len;
+        ctx->bytes_transferred = 0;
+    }
+
+    return n;
+}
+
+ssize_t gfs_send(gfcontext_t *ctx, void *data, size_t len){
+    ssize_t n;
+
+    if ((n = send_all(ctx->connfd, data, len)) < 0) {
+        close_context(ctx);
+        return -1;
+    }
+    body_sent(ctx, (size_t)n);
+
+    return n;
+}
+
+ssize_t gfs_sendfile(gfcontext_t *ctx, int fildes, off_t offset, size_t len){
+    char buffer[COPY_BUFFER_SIZE];
+    size_t bytes_transferred = 0;
+    size_t remaining;
+    bool use_copy = false;
+    ssize_t n;
+
+    // body_sent may release ctx on the last chunk, so track it locally
+    while (bytes_transferred < len) {
+        remaining = len - bytes_transferred;
+
+        if (!use_copy) {
+            n = sendfile(ctx->connfd, fildes, &offset, remaining);
+            if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                // sendfile is not supported for this descriptor
+                use_copy = true;
+                continue;
+            }
+        } else {
+            n = pread(fildes, buffer, remaining < COPY_BUFFER_SIZE ? remaining : COPY_BUFFER_SIZE, offset);
+            if (n > 0 && send_all(ctx->connfd, buffer, (size_t)n) < 0) {
+                n = -1;
+            }
+            if (n > 0) {
+                offset += n;
+            }
+        }
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            close_context(ctx);
+            return -1;
+        }
+
+        bytes_transferred += n;
+        body_sent(ctx, (size_t)n);
+    }
+
+    return (ssize_t)bytes_transferred;
+}
+
+void gfs_abort(gfcontext_t *ctx){
+    close_context(ctx);
+}
+
+gfserver_t* gfserver_create(){
+    gfserver_t *gfs;
+
+    if ((gfs = (gfserver_t *)calloc(1, sizeof(gfserver_t))) == NULL) {
+        perror("Unable to allocate memory");
+        exit(EXIT_FAILURE);
+    }
+
+    if ((gfs->listenfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        perror("Unable to create the socket");
+        exit(EXIT_FAILURE);
+    }
+    gfs->nlisteners = 1;
+
+    return gfs;
+}
+
+void gfserver_set_port(gfserver_t *gfs, unsigned short port){
+    gfs->port = port;
+}
+
+void gfserver_set_maxpending(gfserver_t *gfs, int max_npending){
+    gfs->max_npending = max_npending;
+}
+
+void gfserver_set_keepalive(gfserver_t *gfs, int enabled){
+    gfs->keepalive = enabled ? true : false;
+}
+
+void gfserver_set_listeners(gfserver_t *gfs, int nlisteners){
+    gfs->nlisteners = nlisteners < 1 ? 1 : nlisteners;
+}
+
+void gfserver_set_placement(gfserver_t *gfs, int placement){
+    gfs->placement = placement;
+}
+
+int gfs_listener(gfcontext_t *ctx){
+    return ctx->gfs->listener;
+}
+
+void gfserver_set_handler(gfserver_t *gfs, ssize_t (*handler)(gfcontext_t *, char *, void*)){
+    gfs->handler = handler;
+}
+
+void gfserver_set_handlerarg(gfserver_t *gfs, void* arg){
+    gfs->args = arg;
+}
+
+/*
+ * Reads until the end of the request header and moves the request into
+ * ctx->request.  Bytes a client pipelined behind it stay in ctx->pending.
+ * Returns the request length or -1 if the client went away first.
+ */
+static int get_request(gfcontext_t *ctx) {
+    size_t request_size;
+    char *end;
+    ssize_t n;
+
+    while ((end = strstr(ctx->pending, END_OF_REQUEST)) == NULL && ctx->npending < sizeof(ctx->pending) - 1) {
+        n = recv(ctx->connfd, ctx->pending + ctx->npending, sizeof(ctx->pending) - 1 - ctx->npending, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+
+        ctx->npending += n;
+        ctx->pending[ctx->npending] = '\0';
+    }
+
+    request_size = end != NULL ? (size_t)(end - ctx->pending) + strlen(END_OF_REQUEST) : ctx->npending;
+    memcpy(ctx->request, ctx->pending, request_size);
+    ctx->request[request_size] = '\0';
+
+    // keep the terminating '\0' behind the remaining bytes
+    ctx->npending -= request_size;
+    memmove(ctx->pending, ctx->pending + request_size, ctx->npending + 1);
+
+    return (int)request_size;
+}
+
+/*
+ * Validates <scheme> <method> <path> [KEEPALIVE]\r\n\r\n in place and
+ * returns the path.
+ */
+static char *parse_request(char *request, bool *keepalive) {
+    char *saveptr;
+    char *scheme, *method, *path, *option;
+
+    *keepalive = false;
+
+    scheme = strtok_r(request, " \t", &saveptr);
+    if (scheme == NULL || strcmp(scheme, SCHEME) != 0) {
+        return NULL;
+    }
+
+    method = strtok_r(NULL, " \t", &saveptr);
+    if (method == NULL || strcmp(method, METHOD_GET) != 0) {
+        return NULL;
+    }
+
+    path = strtok_r(NULL, " \t\r\n", &saveptr);
+    if (path == NULL || path[0] != '/') {
+        return NULL;
+    }
+
+    option = strtok_r(NULL, " \t\r\n", &saveptr);
+    *keepalive = option != NULL && strcmp(option, OPTION_KEEPALIVE) == 0;
+
+    return path;
+}
+
+static gfcontext_t *accept_connection(gfserver_t *gfs) {
+    gfcontext_t *ctx;
+    socklen_t client_size;
+
+    if ((ctx = (gfcontext_t *)malloc(sizeof(gfcontext_t))) == NULL) {
+        perror("Unable to allocate memory");
+        exit(EXIT_FAILURE);
+    }
+    ctx->gfs = gfs;
+    ctx->file_len = 0;
+    ctx->bytes_transferred = 0;
+    ctx->keepalive = false;
+    ctx->registered = false;
+    ctx->pending[0] = '\0';
+    ctx->npending = 0;
+    client_size = sizeof(ctx->client_addr);
+
+    // accept connection from an incoming client
+    if ((ctx->connfd = accept(gfs->listenfd, (struct sockaddr *)&(ctx->client_addr), &client_size)) < 0) {
+        L(ERROR, "Error accepting client: %s", strerror(errno));
+        free(ctx);
+        return NULL;
+    }
+    metrics_accepted();
+
+    return ctx;
+}
+
+/*
+ * Reads the next request of the connection and hands it to the handler.
+ */
+static void serve_request(gfserver_t *gfs, gfcontext_t *ctx) {
+    char *path;
+    bool keepalive;
+
+    if (get_request(ctx) < 0) {
+        close_context(ctx);
+        return;
+    }
+
+    path = parse_request(ctx->request, &keepalive);
+    ctx->keepalive = gfs->keepalive && keepalive;
+
+    if (path == NULL) {
+        ctx->keepalive = false;
+        gfs_sendheader(ctx, GF_FILE_NOT_FOUND, 0);
+        return;
+    }
+
+    L(DEBUG, "request for '%s'", path);
+
+    // the handler owns ctx from here on unless it reports an error
+    if (gfs->handler(ctx, path, gfs->args) < 0) {
+        L(ERROR, "handler reported an error for '%s'", path);
+        ctx->keepalive = false;
+        gfs_sendheader(ctx, GF_ERROR, 0);
+    }
+}
+
+/*
+ * Binds the socket of the listener and registers it with a new epoll set.
+ */
+static void open_listener(gfserver_t *gfs) {
+    struct sockaddr_in serv_addr;
+    struct epoll_event ev;
+    int optval = 1;
+
+    // prepare the sockaddr_in structure
+    memset(&serv_addr, 0, sizeof(serv_addr));
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    serv_addr.sin_port = htons(gfs->port);
+
+    setsockopt(gfs->listenfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+
+    // every sharded listener binds to the same port
+    if (gfs->nlisteners > 1 && setsockopt(gfs->listenfd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) < 0) {
+        perror("Unable to share the port between listeners");
+        exit(EXIT_FAILURE);
+    }
+
+    // bind the socket to the address
+    if (bind(gfs->listenfd, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) {
+        fprintf(stderr, "failed to bind; port = %d\n", gfs->port);
+        exit(EXIT_FAILURE);
+    }
+
+    // listen to maximum pending connections
+    if (listen(gfs->listenfd, gfs->max_npending) < 0) {
+        perror("Error listening to maximum pending connections");
+        exit(EXIT_FAILURE);
+    }
+
+    if ((gfs->epollfd = epoll_create1(0)) < 0) {
+        perror("Unable to create the epoll instance");
+        exit(EXIT_FAILURE);
+    }
+
+    // a NULL data pointer marks the listening socket
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(gfs->epollfd, EPOLL_CTL_ADD, gfs->listenfd, &ev) < 0) {
+        perror("Unable to register the socket");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Accept loop of one listener.
+ */
+static void *serve_listener(void *arg) {
+    gfserver_t *gfs = (gfserver_t *)arg;
+    struct epoll_event events[MAX_EVENTS];
+    int nready;
+    int i;
+
+    // infinite loop, serving new connections and idle keep-alive ones
+    for ( ; ; ) {
+        if ((nready = epoll_wait(gfs->epollfd, events, MAX_EVENTS, -1)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Error waiting for events");
+            exit(EXIT_FAILURE);
+        }
+
+        for (i = 0; i < nready; i++) {
+            gfcontext_t *ctx = (gfcontext_t *)events[i].data.ptr;
+
+            if (ctx == NULL && (ctx = accept_connection(gfs)) == NULL) {
+                continue;
+            }
+            serve_request(gfs, ctx);
+        }
+    }
+
+    return NULL;
+}
+
+void gfserver_serve(gfserver_t *gfs){
+    gfserver_t **listeners;
+    pthread_attr_t attr;
+    pthread_t thread;
+    cpu_set_t cpus;
+    int i;
+
+    // sendfile cannot pass MSG_NOSIGNAL, a client leaving mid-body must not end the server
+    signal(SIGPIPE, SIG_IGN);
+
+    if ((listeners = (gfserver_t **)malloc(gfs->nlisteners * sizeof(gfserver_t *))) == NULL) {
+        perror("Unable to allocate memory");
+        exit(EXIT_FAILURE);
+    }
+
+    // bind every listener before any of them accepts
+    listeners[0] = gfs;
+    open_listener(gfs);
+    for (i = 1; i < gfs->nlisteners; i++) {
+        if ((listeners[i] = (gfserver_t *)malloc(sizeof(gfserver_t))) == NULL) {
+            perror("Unable to allocate memory");
+            exit(EXIT_FAILURE);
+        }
+        *listeners[i] = *gfs;
+        listeners[i]->listener = i;
+        if ((listeners[i]->listenfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+            perror("Unable to create the socket");
+            exit(EXIT_FAILURE);
+        }
+        open_listener(listeners[i]);
+    }
+
+    for (i = 1; i < gfs->nlisteners; i++) {
+        pthread_attr_init(&attr);
+        if (gfs->placement != TOPOLOGY_PIN_NONE && topology_placement(TOPOLOGY_PIN_NODE, i, 0, &cpus) == 0) {
+            pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+        }
+        if (pthread_create(&thread, &attr, serve_listener, listeners[i]) != 0) {
+            fprintf(stderr, "Error creating thread\n");
+            exit(EXIT_FAILURE);
+        }
+        pthread_attr_destroy(&attr);
+        pthread_detach(thread);
+    }
+
+    // the calling thread runs the first listener
+    if (gfs->placement != TOPOLOGY_PIN_NONE && topology_placement(TOPOLOGY_PIN_NODE, 0, 0, &cpus) == 0) {
+        pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    }
+    serve_listener(gfs);
+}
@@ -1,6 +1,7 @@
 #ifndef __GF_SERVER_H__
 #define __GF_SERVER_H__
 
+#include <sys/types.h>
 
 /*
  * gfserver is a server library for transferring files using the GETFILE
@@ -39,6 +40,18 @@ void gfserver_set_port(gfserver_t *gfs, unsigned short port);
 void gfserver_set_maxpending(gfserver_t *gfs, int max_npending);
 
 
+/*
+ * Enables the keep-alive extension of the protocol.  A client that ends
+ * its request with an extra KEEPALIVE token, i.e.
+ *   GETFILE GET <path> KEEPALIVE\r\n\r\n
+ * then gets the same token back at the end of the response header, and
+ * the connection stays open for its next request, which may already be
+ * pipelined behind the first one.  Requests without the token, and every
+ * request while keep-alive is disabled (the default), close the connection
+ * after the response.
+ */
+void gfserver_set_keepalive(gfserver_t *gfs, int enabled);
+
 /*
  * Sets the handler callback, a function that will be called for each each
  * request.  As arguments, this function receives:
@@ -55,6 +68,23 @@ void gfserver_set_handler(gfserver_t *gfs, ssize_t (*handler)(gfcontext_t *, cha
  */
 void gfserver_set_handlerarg(gfserver_t *gfs, void* arg);
 
+/*
+ * Shards the listening socket.  gfserver_serve then binds nlisteners
+ * sockets to the port with SO_REUSEPORT, each served by an accept loop
+ * on a thread of its own, and the kernel spreads new connections across
+ * them.  The handler is called on the thread of the listener that
+ * accepted the connection.  The default is a single listener.
+ */
+void gfserver_set_listeners(gfserver_t *gfs, int nlisteners);
+
+/*
+ * Pins the thread of listener i to the CPUs of NUMA node i modulo the
+ * number of nodes, unless placement is TOPOLOGY_PIN_NONE (the default).
+ * This keeps a listener on the node of the workers it hands its
+ * connections to when worker set i is placed on the same node.
+ */
+void gfserver_set_placement(gfserver_t *gfs, int placement);
+
 /*
  * Starts the server.  Does not return.
  */
@@ -62,7 +92,8 @@ void gfserver_serve(gfserver_t *gfs);
 
 /*
  * Sends to the client the Getfile header containing the appropriate 
- * status and file length for the given inputs.  This function should
+ * status and file length for the given inputs.  On failure the
+ * connection is closed and ctx must not be used again.  This function should
  * only be called from within a callback registered gfserver_set_handler.
  */
 ssize_t gfs_sendheader(gfcontext_t *ctx, gfstatus_t status, size_t file_len);
@@ -71,14 +102,32 @@ ssize_t gfs_sendheader(gfcontext_t *ctx, gfstatus_t status, size_t file_len);
  * Sends size bytes starting at the pointer data to the client 
  * This function should only be called from within a callback registered 
  * with gfserver_set_handler.  It returns once the data has been
- * sent.
+ * sent.  On failure the connection is closed and ctx must not be used
+ * again.
  */
 ssize_t gfs_send(gfcontext_t *ctx, void *data, size_t size);
 
+/*
+ * Sends len bytes of the open file fildes, starting at offset, to the
+ * client.  The bytes go from the page cache to the socket with
+ * sendfile(2); a read/send copy loop is only used if sendfile fails.
+ * The file offset of fildes is left untouched, so a descriptor may be
+ * shared between worker threads.  On failure the connection is closed
+ * and ctx must not be used again.  This function should only be called
+ * from within a callback registered with gfserver_set_handler.
+ */
+ssize_t gfs_sendfile(gfcontext_t *ctx, int fildes, off_t offset, size_t len);
+
 /*
  * Aborts the connection to the client associated with the input
  * gfcontext_t.
  */
 void gfs_abort(gfcontext_t *ctx);
 
+/*
+ * Returns the index, from 0 to nlisteners - 1, of the listener that
+ * accepted the connection of ctx.
+ */
+int gfs_listener(gfcontext_t *ctx);
+
 #endif
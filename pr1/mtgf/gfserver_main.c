@@ -8,6 +8,8 @@
 
 #include "gfserver.h"
 #include "content.h"
+#include "metrics.h"
+#include "topology.h"
 
 #define USAGE                                                                 \
 "usage:\n"                                                                    \
@@ -16,6 +18,13 @@
 "  -p [listen_port]    Listen port (Default: 8888)\n"                         \
 "  -t [nthreads]       Number of threads (Default: 1)\n"                      \
 "  -c [content_file]   Content file mapping keys to content files\n"          \
+"  -q [queue]          Work queue: steque, mpmc, ws or ws-rr (Default: steque)\n" \
+"  -k                  Keep connections open for keep-alive clients\n"       \
+"  -m [lock_budget]    Serve from memory maps, mlock up to lock_budget bytes\n" \
+"  -a [admin_port]     Report metrics to connections on this loopback port\n" \
+"  -l [nlisteners]     Accept on this many SO_REUSEPORT listeners (Default: 1)\n" \
+"  -w                  Give each listener a worker set of its own\n"           \
+"  -A [placement]      Pin workers: none, core or node (Default: none)\n"    \
 "  -h                  Show this help message.\n"                              
 
 /* OPTIONS DESCRIPTOR ====================================================== */
@@ -23,13 +32,20 @@ static struct option gLongOptions[] = {
   {"port",          required_argument,      NULL,           'p'},
   {"content",       required_argument,      NULL,           'c'},
   {"nthreads",      required_argument,      NULL,           't'},
+  {"queue",         required_argument,      NULL,           'q'},
+  {"keepalive",     no_argument,            NULL,           'k'},
+  {"mmap",          required_argument,      NULL,           'm'},
+  {"admin",         required_argument,      NULL,           'a'},
+  {"listeners",     required_argument,      NULL,           'l'},
+  {"worker-sets",   no_argument,            NULL,           'w'},
+  {"affinity",      required_argument,      NULL,           'A'},
   {"help",          no_argument,            NULL,           'h'},
   {NULL,            0,                      NULL,             0}
 };
 
 
 extern ssize_t handler_get(gfcontext_t *ctx, char *path, void* arg);
-extern void worker_threads_init(int nthreads);
+extern void worker_threads_init(int nthreads, char *queue, int mapped, int nsets, int placement);
 
 static void _sig_handler(int signo){
   if (signo == SIGINT || signo == SIGTERM){
@@ -44,6 +60,15 @@ int main(int argc, char **argv) {
   char *content = "content.txt";
   gfserver_t *gfs;
   int nthreads = 1;
+  char *queue = "steque";
+  int keepalive = 0;
+  int mapped = 0;
+  size_t lock_budget = 0;
+  unsigned short admin_port = 0;
+  int nlisteners = 1;
+  int worker_sets = 0;
+  int placement = TOPOLOGY_PIN_NONE;
+  int nsets;
 
   if (signal(SIGINT, _sig_handler) == SIG_ERR){
     fprintf(stderr,"Can't catch SIGINT...exiting.\n");
@@ -56,7 +81,7 @@ int main(int argc, char **argv) {
   }
 
   // Parse and set command line arguments
-  while ((option_char = getopt_long(argc, argv, "p:t:c:h", gLongOptions, NULL)) != -1) {
+  while ((option_char = getopt_long(argc, argv, "p:t:c:q:km:a:l:wA:h", gLongOptions, NULL)) != -1) {
     switch (option_char) {
       case 'p': // listen-port
         port = atoi(optarg);
@@ -67,6 +92,31 @@ int main(int argc, char **argv) {
       case 'c': // file-path
         content = optarg;
         break;                                          
+      case 'q': // queue
+        queue = optarg;
+        break;
+      case 'k': // keep-alive
+        keepalive = 1;
+        break;
+      case 'm': // mmap
+        mapped = 1;
+        lock_budget = (size_t)atol(optarg);
+        break;
+      case 'a': // admin-port
+        admin_port = atoi(optarg);
+        break;
+      case 'l': // listeners
+        nlisteners = atoi(optarg);
+        break;
+      case 'w': // worker-sets
+        worker_sets = 1;
+        break;
+      case 'A': // affinity
+        if ((placement = topology_policy(optarg)) < 0) {
+          fprintf(stderr, "%s", USAGE);
+          exit(1);
+        }
+        break;
       case 'h': // help
         fprintf(stdout, "%s", USAGE);
         exit(0);
@@ -84,7 +134,18 @@ int main(int argc, char **argv) {
 
   content_init(content);
 
-  worker_threads_init(nthreads);
+  if (mapped && 0 > content_map(lock_budget)) {
+    exit(EXIT_FAILURE);
+  }
+
+  // before the workers start so that they record from the first request
+  if (admin_port != 0 && 0 > metrics_init(admin_port)) {
+    exit(EXIT_FAILURE);
+  }
+
+  // pinned workers are grouped with their queue per NUMA node
+  nsets = worker_sets ? nlisteners : placement != TOPOLOGY_PIN_NONE ? topology_nnodes() : 1;
+  worker_threads_init(nthreads, queue, mapped, nsets, placement);
 
   /*Initializing server*/
   gfs = gfserver_create();
@@ -92,6 +153,9 @@ int main(int argc, char **argv) {
   /*Setting options*/
   gfserver_set_port(gfs, port);
   gfserver_set_maxpending(gfs, 100);
+  gfserver_set_keepalive(gfs, keepalive);
+  gfserver_set_listeners(gfs, nlisteners);
+  gfserver_set_placement(gfs, placement);
   gfserver_set_handler(gfs, handler_get);
   gfserver_set_handlerarg(gfs, NULL);
 
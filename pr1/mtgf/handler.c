@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <fcntl.h>
 #include <curl/curl.h>
@@ -5,65 +7,147 @@
 #include <unistd.h>
 #include <errno.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
 
 #include "gfserver.h"
 #include "content.h"
 #include "steque.h"
+#include "mpmcq.h"
+#include "wsched.h"
+#include "metrics.h"
+#include "log.h"
+#include "topology.h"
 
-#define BUFFER_SIZE 4096
+#define QUEUE_STEQUE "steque"
+#define QUEUE_MPMC "mpmc"
+#define QUEUE_WS "ws"
+#define QUEUE_WS_RR "ws-rr"
+#define MPMC_CAPACITY 4096
 
 typedef struct request_item_t {
     gfcontext_t *ctx;
+    // metrics_clock timestamp of the hand-off to the queue
+    uint64_t queued_at;
     char path[BUFSIZ];
 } request_item_t;
 
+// one work queue backend and the workers taking from it
+typedef struct work_set_t {
+    steque_t *queue;
+    mpmcq_t *mpmc_queue;
+    wsched_t *sched;
+    pthread_mutex_t mutex_queue;
+    pthread_cond_t cond_remove;
+} work_set_t;
+
+typedef struct worker_arg_t {
+    work_set_t *set;
+    // index of the worker within its set
+    int worker;
+} worker_arg_t;
+
 /**
  * global variables
  */
 static int g_num_threads;
-static steque_t *g_queue;
+// serve from the mappings of content_map instead of the descriptors
+static int g_mapped;
+static int g_num_sets;
+static work_set_t *g_sets;
 static pthread_t *g_workers;
-static pthread_mutex_t g_mutex_queue = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t g_cond_remove = PTHREAD_COND_INITIALIZER;
+static worker_arg_t *g_worker_args;
 
 /**
  * function to add item to the bottom of the queue
  */
-static void add_item (request_item_t *req) {
-    pthread_mutex_lock(&g_mutex_queue);
-    steque_enqueue(g_queue, (steque_item)req);
-    pthread_mutex_unlock(&g_mutex_queue);
+static void add_item (work_set_t *set, request_item_t *req) {
+    metrics_enqueued();
+
+    if (set->sched != NULL) {
+        wsched_submit(set->sched, (steque_item)req);
+        return;
+    }
+
+    if (set->mpmc_queue != NULL) {
+        // bounded ring: hold back the boss while the workers catch up
+        while (mpmcq_enqueue(set->mpmc_queue, (steque_item)req) < 0) {
+            sched_yield();
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&set->mutex_queue);
+    steque_enqueue(set->queue, (steque_item)req);
+    pthread_mutex_unlock(&set->mutex_queue);
 
-    pthread_cond_signal(&g_cond_remove);
+    pthread_cond_signal(&set->cond_remove);
 }
 
 /**
  * function to remove item from the top of the queue and return the removed item
+ * worker is the index of the calling worker thread within set
  */
-static request_item_t* remove_item () {
+static request_item_t* remove_item (work_set_t *set, int worker) {
     steque_item item;
 
-    pthread_mutex_lock(&g_mutex_queue);
+    if (set->sched != NULL) {
+        return (request_item_t*) wsched_next(set->sched, worker);
+    }
+
+    if (set->mpmc_queue != NULL) {
+        return (request_item_t*) mpmcq_pop(set->mpmc_queue);
+    }
+
+    pthread_mutex_lock(&set->mutex_queue);
 
     // wait until there is content to remove
-    while (steque_isempty(g_queue)) {
-		pthread_cond_wait(&g_cond_remove, &g_mutex_queue);
+    while (steque_isempty(set->queue)) {
+		pthread_cond_wait(&set->cond_remove, &set->mutex_queue);
 	}
 
-    item = steque_pop(g_queue);
-    pthread_mutex_unlock(&g_mutex_queue);
+    item = steque_pop(set->queue);
+    pthread_mutex_unlock(&set->mutex_queue);
 
     return (request_item_t*) item;
 }
 
+/**
+ * serves the file from its mapping, a hit makes no file system call
+ */
+static ssize_t execute_mapped (gfcontext_t *ctx, char *path){
+    void *addr;
+    size_t len;
+    ssize_t bytes_transferred;
+
+    if( 0 > content_get_mapped(path, &addr, &len))
+        return gfs_sendheader(ctx, GF_FILE_NOT_FOUND, 0);
+
+    // a failed send has already released ctx
+    if (gfs_sendheader(ctx, GF_OK, len) < 0)
+        return -1;
+
+    if (len == 0)
+        return 0;
+
+    bytes_transferred = gfs_send(ctx, addr, len);
+    if (bytes_transferred != (ssize_t)len){
+        L(ERROR, "handle_with_file send error, %zd, %zu", bytes_transferred, len);
+        return -1;
+    }
+
+    return bytes_transferred;
+}
+
 /**
  * function to be executed when a thread is available
  */
 static ssize_t execute_thread (gfcontext_t *ctx, char *path){
     int fildes;
     ssize_t file_len, bytes_transferred;
-    ssize_t read_len, write_len;
-    char buffer[BUFFER_SIZE];
+
+    if (g_mapped)
+        return execute_mapped(ctx, path);
 
     if( 0 > (fildes = content_get(path)))
         return gfs_sendheader(ctx, GF_FILE_NOT_FOUND, 0);
@@ -71,61 +155,129 @@ static ssize_t execute_thread (gfcontext_t *ctx, char *path){
     /* Calculating the file size */
     file_len = lseek(fildes, 0, SEEK_END);
 
-    gfs_sendheader(ctx, GF_OK, (size_t)file_len);
+    // a failed send has already released ctx
+    if (gfs_sendheader(ctx, GF_OK, (size_t)file_len) < 0)
+        return -1;
 
-    /* Sending the file contents chunk by chunk. */
-    bytes_transferred = 0;
-    while(bytes_transferred < file_len){
-        read_len = pread(fildes, buffer, BUFFER_SIZE, bytes_transferred);
-        if (read_len <= 0){
-            fprintf(stderr, "handle_with_file read error, %zd, %zu, %zu", read_len, bytes_transferred, file_len );
-            gfs_abort(ctx);
-            return -1;
-        }
-        write_len = gfs_send(ctx, buffer, (size_t)read_len);
-        if (write_len != read_len){
-            fprintf(stderr, "handle_with_file write error");
-            gfs_abort(ctx);
-            return -1;
-        }
-        bytes_transferred += write_len;
+    /* Sending the file contents straight from the page cache. */
+    bytes_transferred = gfs_sendfile(ctx, fildes, 0, (size_t)file_len);
+    if (bytes_transferred != file_len){
+        L(ERROR, "handle_with_file sendfile error, %zd, %zd", bytes_transferred, file_len);
+        return -1;
     }
 
     return bytes_transferred;
 }
 
 static void *worker_thread (void *arg) {
+    worker_arg_t *worker_arg = (worker_arg_t *)arg;
+    int worker = worker_arg->worker;
+
     // endless loop to process work in the queue
     for ( ; ; ) {
-        request_item_t *item = remove_item();
-        execute_thread(item->ctx, item->path);
+        request_item_t *item = remove_item(worker_arg->set, worker);
+        uint64_t started;
+        ssize_t transfer_size;
+
+        metrics_dequeued();
+        metrics_stage(METRICS_QUEUE_WAIT, item->queued_at);
+
+        started = metrics_clock();
+        transfer_size = execute_thread(item->ctx, item->path);
+        metrics_stage(METRICS_HANDLER, started);
+        L(DEBUG, "worker %d: '%s', %zd bytes", worker, item->path, transfer_size);
         free(item);
     }
 
     pthread_exit(NULL);
 }
 
+/**
+ * function to set up the work queue of a set of nworkers workers
+ */
+static void work_set_init (work_set_t *set, int nworkers, char *queue) {
+    memset(set, 0, sizeof(work_set_t));
+    pthread_mutex_init(&set->mutex_queue, NULL);
+    pthread_cond_init(&set->cond_remove, NULL);
+
+    // the queue is used to pass work items to the worker thread
+    if (strcmp(queue, QUEUE_MPMC) == 0) {
+        if (posix_memalign((void **)&set->mpmc_queue, MPMCQ_CACHELINE, sizeof(mpmcq_t)) != 0) {
+            fprintf(stderr, "Error allocating the work queue");
+            exit(1);
+        }
+        mpmcq_init(set->mpmc_queue, MPMC_CAPACITY);
+    } else if (strcmp(queue, QUEUE_WS) == 0 || strcmp(queue, QUEUE_WS_RR) == 0) {
+        set->sched = (wsched_t*) malloc(sizeof(wsched_t));
+        wsched_init(set->sched, nworkers, strcmp(queue, QUEUE_WS) == 0 ? WSCHED_LEAST_LOADED : WSCHED_ROUND_ROBIN);
+    } else if (strcmp(queue, QUEUE_STEQUE) == 0) {
+        set->queue = (steque_t*) malloc(sizeof(steque_t));
+        steque_init(set->queue);
+    } else {
+        fprintf(stderr, "Unknown work queue '%s'\n", queue);
+        exit(1);
+    }
+}
+
 /**
  * function to initialize the worker thread pool
+ * queue selects the work queue backend: "steque" (mutex/condvar), "mpmc" (lock-free ring),
+ * "ws" (work stealing, least loaded placement) or "ws-rr" (work stealing, round robin placement)
+ * mapped makes the workers send from the mappings set up by content_map
+ * nsets splits the pool into that many sets with a queue each; the
+ * connections of listener i go to set i modulo nsets
+ * placement, a TOPOLOGY_PIN_* policy, pins the workers of set i to NUMA
+ * node i modulo the number of nodes, and the queue of the set is allocated
+ * on that node
  */
-void worker_threads_init (int nthreads) {
-    int i;
+void worker_threads_init (int nthreads, char *queue, int mapped, int nsets, int placement) {
+    int i, set, first, node;
+    int *node_next;
+    pthread_attr_t attr;
+    cpu_set_t cpus, saved;
 
     g_num_threads = nthreads;
+    g_mapped = mapped;
+    // every set needs a worker
+    g_num_sets = nsets < 1 ? 1 : nsets > nthreads ? nthreads : nsets;
+    g_sets = (work_set_t*) malloc(g_num_sets * sizeof(work_set_t));
     g_workers = (pthread_t*) malloc(g_num_threads * sizeof(pthread_t));
+    g_worker_args = (worker_arg_t*) malloc(g_num_threads * sizeof(worker_arg_t));
 
-    // initialize
-    // g_queue is used to pass work items to the worker thread
-    g_queue = (steque_t*) malloc(sizeof(steque_t));
-    steque_init(g_queue);
+    // workers already pinned to each node, so that sets sharing a node get different cores
+    node_next = (int*) calloc(topology_nnodes(), sizeof(int));
+    pthread_getaffinity_np(pthread_self(), sizeof(saved), &saved);
 
-    // create the worker thread pool
-    for (i = 0; i < g_num_threads; i++) {
-        if (pthread_create(&g_workers[i], NULL, worker_thread, NULL) != 0) {
-            fprintf(stderr, "Error creating thread");
-            exit(1);
+    // set i gets workers [i * nthreads / nsets, (i + 1) * nthreads / nsets)
+    for (set = 0; set < g_num_sets; set++) {
+        first = set * g_num_threads / g_num_sets;
+        node = set % topology_nnodes();
+
+        // memory is placed on the node of the thread touching it first
+        if (placement != TOPOLOGY_PIN_NONE && topology_placement(TOPOLOGY_PIN_NODE, node, 0, &cpus) == 0) {
+            pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        }
+        work_set_init(&g_sets[set], (set + 1) * g_num_threads / g_num_sets - first, queue);
+        pthread_setaffinity_np(pthread_self(), sizeof(saved), &saved);
+
+        // create the worker thread pool, the stacks are first touched by the workers
+        for (i = first; i < (set + 1) * g_num_threads / g_num_sets; i++) {
+            g_worker_args[i].set = &g_sets[set];
+            g_worker_args[i].worker = i - first;
+
+            pthread_attr_init(&attr);
+            if (topology_placement(placement, node, node_next[node]++, &cpus) == 0) {
+                pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+            }
+            if (pthread_create(&g_workers[i], &attr, worker_thread, &g_worker_args[i]) != 0) {
+                fprintf(stderr, "Error creating thread");
+                exit(1);
+            }
+            pthread_attr_destroy(&attr);
         }
     }
+
+    free(node_next);
 }
 
 /**
@@ -136,9 +288,11 @@ ssize_t handler_get (gfcontext_t *ctx, char *path, void* arg){
     req = malloc(sizeof(request_item_t));
 
     req->ctx = ctx;
-    memcpy(req->path, path, strlen(path));
+    req->queued_at = metrics_clock();
+    strncpy(req->path, path, sizeof(req->path) - 1);
+    req->path[sizeof(req->path) - 1] = '\0';
 
-    add_item(req);
+    add_item(&g_sets[gfs_listener(ctx) % g_num_sets], req);
 
     return 0;
 }
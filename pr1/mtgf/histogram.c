@@ -0,0 +1,98 @@
+#include <string.h>
+#include "histogram.h"
+
+/* Values below 2 * HISTOGRAM_SUB_COUNT have a sub-bucket of their own */
+static int bucket_index(uint64_t value){
+  int shift;
+
+  if(value < 2 * HISTOGRAM_SUB_COUNT)
+    return (int) value;
+
+  shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+  return (shift + 1) * HISTOGRAM_SUB_COUNT + (int)(value >> shift) - HISTOGRAM_SUB_COUNT;
+}
+
+static uint64_t bucket_highest(int index){
+  int shift;
+
+  if(index < 2 * HISTOGRAM_SUB_COUNT)
+    return (uint64_t) index;
+
+  shift = index / HISTOGRAM_SUB_COUNT - 1;
+  return (((uint64_t)(index - shift * HISTOGRAM_SUB_COUNT) + 1) << shift) - 1;
+}
+
+void histogram_init(histogram_t* this){
+  memset(this, 0, sizeof(histogram_t));
+  this->min = UINT64_MAX;
+}
+
+/*
+ * The single writer publishes with relaxed stores so that a merge running
+ * in another thread reads whole values; it may miss the latest record.
+ */
+#define STORE(field, value) __atomic_store_n(&(field), (value), __ATOMIC_RELAXED)
+#define LOAD(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+void histogram_record(histogram_t* this, uint64_t value){
+  int index = bucket_index(value);
+  double sum = this->sum + (double) value;
+
+  STORE(this->counts[index], this->counts[index] + 1);
+  STORE(this->total, this->total + 1);
+  __atomic_store(&this->sum, &sum, __ATOMIC_RELAXED);
+  if(value < this->min)
+    STORE(this->min, value);
+  if(value > this->max)
+    STORE(this->max, value);
+}
+
+void histogram_merge(histogram_t* this, histogram_t* other){
+  uint64_t min, max;
+  double sum;
+  int i;
+
+  for(i = 0; i < HISTOGRAM_BUCKETS; i++)
+    this->counts[i] += LOAD(other->counts[i]);
+
+  /* recount rather than trust total, the buckets may be ahead of it */
+  this->total = 0;
+  for(i = 0; i < HISTOGRAM_BUCKETS; i++)
+    this->total += this->counts[i];
+
+  __atomic_load(&other->sum, &sum, __ATOMIC_RELAXED);
+  this->sum += sum;
+  min = LOAD(other->min);
+  max = LOAD(other->max);
+  if(min < this->min)
+    this->min = min;
+  if(max > this->max)
+    this->max = max;
+}
+
+uint64_t histogram_percentile(histogram_t* this, double percentile){
+  uint64_t rank, seen = 0;
+  int i;
+
+  if(this->total == 0)
+    return 0;
+
+  rank = (uint64_t)(percentile / 100.0 * this->total + 0.5);
+  if(rank < 1)
+    rank = 1;
+  if(rank > this->total)
+    rank = this->total;
+
+  for(i = 0; i < HISTOGRAM_BUCKETS; i++){
+    seen += this->counts[i];
+    if(seen >= rank)
+      break;
+  }
+
+  /* never report past the largest value actually seen */
+  return bucket_highest(i) < this->max ? bucket_highest(i) : this->max;
+}
+
+double histogram_mean(histogram_t* this){
+  return this->total == 0 ? 0.0 : this->sum / this->total;
+}
@@ -0,0 +1,319 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "log.h"
+
+#define CACHELINE 64
+#define RING_SIZE 1024
+#define STRINGS_SIZE 128
+#define SPEC_SIZE 32
+#define OUTPUT_SIZE 65536
+#define FLUSH_INTERVAL_NS 10000000
+
+/* How an argument was read off the va_list, and how to format it again */
+typedef enum{
+  ARG_INT,
+  ARG_LONG,
+  ARG_DOUBLE,
+  ARG_POINTER,
+  ARG_STRING  /* value is the offset of the copy in strings */
+}arg_type_t;
+
+/* One call to L, with its arguments in binary */
+typedef struct{
+  struct timespec time;
+  const char* format;
+  int priority;
+  int nargs;
+  uint64_t args[LOG_MAX_ARGS];
+  char strings[STRINGS_SIZE];
+}record_t;
+
+/*
+ * Single producer, single consumer ring of one thread.  head is written
+ * by the thread logging, tail by whoever flushes.
+ */
+typedef struct ring_t{
+  uint64_t head;
+  char pad0[CACHELINE - sizeof(uint64_t)];
+  uint64_t tail;
+  uint64_t dropped;
+  char pad1[CACHELINE - 2 * sizeof(uint64_t)];
+  struct ring_t* next;
+  record_t records[RING_SIZE];
+}ring_t;
+
+static const char* g_names[] = {"", "ERROR", "WARN", "INFO", "DEBUG", "TRACE"};
+
+/* every ring ever handed out, pushed at the head */
+static ring_t* g_rings;
+static __thread ring_t* t_ring;
+static pthread_once_t g_once = PTHREAD_ONCE_INIT;
+/* only one flush may consume at a time */
+static pthread_mutex_t g_flush_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Walks the conversion starting at the '%' of spec.  Returns the number
+ * of characters it spans, 0 for "%%", and sets type from its length
+ * modifier and conversion character.
+ */
+static size_t parse_spec(const char* spec, arg_type_t* type){
+  const char* c = spec + 1;
+  int wide = 0;
+
+  if(*c == '%')
+    return 0;
+
+  while(*c != '\0' && strchr("-+ #0123456789.", *c) != NULL)
+    c++;
+  while(*c != '\0' && strchr("hlLqjzt", *c) != NULL){
+    if(*c != 'h')
+      wide = 1;
+    c++;
+  }
+
+  switch(*c){
+    case 's':
+      *type = ARG_STRING;
+      break;
+    case 'p':
+      *type = ARG_POINTER;
+      break;
+    case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+      *type = ARG_DOUBLE;
+      break;
+    default:
+      *type = wide ? ARG_LONG : ARG_INT;
+      break;
+  }
+
+  return *c == '\0' ? (size_t)(c - spec) : (size_t)(c - spec) + 1;
+}
+
+static void start_flusher(void);
+
+static ring_t* ring(void){
+  ring_t* r;
+
+  if(t_ring != NULL)
+    return t_ring;
+
+  pthread_once(&g_once, start_flusher);
+
+  if(posix_memalign((void**) &r, CACHELINE, sizeof(ring_t)) != 0)
+    return NULL;
+  memset(r, 0, sizeof(ring_t));
+
+  r->next = __atomic_load_n(&g_rings, __ATOMIC_RELAXED);
+  while(!__atomic_compare_exchange_n(&g_rings, &r->next, r, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    ;
+
+  t_ring = r;
+  return r;
+}
+
+void log_write(int priority, const char* format, ...){
+  ring_t* r = ring();
+  record_t* record;
+  const char* c;
+  arg_type_t type;
+  size_t len, nstrings = 0;
+  uint64_t head;
+  va_list ap;
+
+  if(r == NULL)
+    return;
+
+  head = r->head;
+  if(head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == RING_SIZE){
+    __atomic_fetch_add(&r->dropped, 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  record = &r->records[head % RING_SIZE];
+  clock_gettime(CLOCK_REALTIME, &record->time);
+  record->format = format;
+  record->priority = priority;
+  record->nargs = 0;
+
+  /* only read the arguments, the flusher does the formatting */
+  va_start(ap, format);
+  for(c = strchr(format, '%'); c != NULL && record->nargs < LOG_MAX_ARGS; c = strchr(c, '%')){
+    if((len = parse_spec(c, &type)) == 0){
+      c += 2;
+      continue;
+    }
+    c += len;
+
+    switch(type){
+      case ARG_INT:
+        record->args[record->nargs] = (uint64_t) va_arg(ap, int);
+        break;
+      case ARG_LONG:
+        record->args[record->nargs] = (uint64_t) va_arg(ap, long long);
+        break;
+      case ARG_DOUBLE:{
+        double value = va_arg(ap, double);
+        memcpy(&record->args[record->nargs], &value, sizeof(value));
+        break;
+      }
+      case ARG_POINTER:
+        record->args[record->nargs] = (uint64_t)(uintptr_t) va_arg(ap, void*);
+        break;
+      case ARG_STRING:{
+        const char* s = va_arg(ap, const char*);
+
+        /* strings that do not fit are cut short */
+        s = s == NULL ? "(null)" : s;
+        len = nstrings < STRINGS_SIZE ? strnlen(s, STRINGS_SIZE - nstrings - 1) : 0;
+        record->args[record->nargs] = nstrings < STRINGS_SIZE ? nstrings : STRINGS_SIZE - 1;
+        if(nstrings < STRINGS_SIZE){
+          memcpy(record->strings + nstrings, s, len);
+          record->strings[nstrings + len] = '\0';
+          nstrings += len + 1;
+        }
+        break;
+      }
+    }
+    record->nargs++;
+  }
+  va_end(ap);
+
+  __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/* Formats record at the end of output, returns the new length */
+static size_t format_record(record_t* record, char* output, size_t len, size_t size){
+  char spec[SPEC_SIZE];
+  const char* c = record->format;
+  const char* next;
+  struct tm tm;
+  arg_type_t type;
+  size_t speclen, n;
+  int arg = 0;
+
+#define OUT(call) do { int w = (call); if(w > 0) len = len + (size_t) w < size ? len + (size_t) w : size - 1; } while(0)
+
+  localtime_r(&record->time.tv_sec, &tm);
+  OUT(snprintf(output + len, size - len, "%02d:%02d:%02d.%06ld %s ", tm.tm_hour, tm.tm_min, tm.tm_sec,
+               record->time.tv_nsec / 1000, g_names[record->priority >= 1 && record->priority <= 5 ? record->priority : 0]));
+
+  while(*c != '\0'){
+    if((next = strchr(c, '%')) == NULL)
+      next = c + strlen(c);
+    OUT(snprintf(output + len, size - len, "%.*s", (int)(next - c), c));
+    if(*next == '\0')
+      break;
+
+    if((speclen = parse_spec(next, &type)) == 0){
+      OUT(snprintf(output + len, size - len, "%%"));
+      c = next + 2;
+      continue;
+    }
+    c = next + speclen;
+    if(arg >= record->nargs || speclen >= SPEC_SIZE - 3)
+      continue;
+
+    /* the flags, width and precision as given, the length as stored */
+    n = speclen - 1;
+    while(n > 1 && strchr("hlLqjzt", next[n - 1]) != NULL)
+      n--;
+    memcpy(spec, next, n);
+    if(type == ARG_LONG){
+      memcpy(spec + n, "ll", 2);
+      n += 2;
+    }
+    spec[n] = next[speclen - 1];
+    spec[n + 1] = '\0';
+
+    switch(type){
+      case ARG_INT:
+        OUT(snprintf(output + len, size - len, spec, (int) record->args[arg]));
+        break;
+      case ARG_LONG:
+        OUT(snprintf(output + len, size - len, spec, (long long) record->args[arg]));
+        break;
+      case ARG_DOUBLE:{
+        double value;
+        memcpy(&value, &record->args[arg], sizeof(value));
+        OUT(snprintf(output + len, size - len, spec, value));
+        break;
+      }
+      case ARG_POINTER:
+        OUT(snprintf(output + len, size - len, spec, (void*)(uintptr_t) record->args[arg]));
+        break;
+      case ARG_STRING:
+        OUT(snprintf(output + len, size - len, spec, record->strings + record->args[arg]));
+        break;
+    }
+    arg++;
+  }
+
+  OUT(snprintf(output + len, size - len, "\n"));
+
+#undef OUT
+
+  return len;
+}
+
+static void write_all(const char* data, size_t len){
+  ssize_t n;
+
+  while(len > 0 && (n = write(fileno(MYLOG_FILE), data, len)) > 0){
+    data += n;
+    len -= (size_t) n;
+  }
+}
+
+void log_flush(void){
+  static char output[OUTPUT_SIZE];
+  uint64_t head, tail, dropped;
+  size_t len = 0;
+  ring_t* r;
+
+  pthread_mutex_lock(&g_flush_lock);
+
+  for(r = __atomic_load_n(&g_rings, __ATOMIC_ACQUIRE); r != NULL; r = r->next){
+    head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    for(tail = r->tail; tail != head; tail++){
+      /* leave room for a whole record */
+      if(len > OUTPUT_SIZE / 2){
+        write_all(output, len);
+        len = 0;
+      }
+      len = format_record(&r->records[tail % RING_SIZE], output, len, OUTPUT_SIZE);
+    }
+    __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+
+    if((dropped = __atomic_exchange_n(&r->dropped, 0, __ATOMIC_RELAXED)) > 0)
+      len += snprintf(output + len, OUTPUT_SIZE - len, "log: %lu records dropped\n", (unsigned long) dropped);
+  }
+
+  write_all(output, len);
+  pthread_mutex_unlock(&g_flush_lock);
+}
+
+static void* flusher_thread(void* arg){
+  struct timespec interval = {0, FLUSH_INTERVAL_NS};
+
+  for( ; ; ){
+    nanosleep(&interval, NULL);
+    log_flush();
+  }
+
+  return NULL;
+}
+
+static void start_flusher(void){
+  pthread_t thread;
+
+  atexit(log_flush);
+  if(pthread_create(&thread, NULL, flusher_thread, NULL) == 0)
+    pthread_detach(thread);
+}
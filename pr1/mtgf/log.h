@@ -9,12 +9,29 @@
 #define DEBUG 4
 #define TRACE 5
 
+/* levels above MYLOG_PRIORITY are compiled out, arguments and all */
 #ifndef MYLOG_PRIORITY
 #define MYLOG_PRIORITY 1
-#endif 
+#endif
 
 #define MYLOG_FILE stderr
 
-#define L(priority,format,a...) if(priority <= MYLOG_PRIORITY) fprintf(MYLOG_FILE, format "\n", ## a);
+/*
+ * L(priority, format, ...) copies its arguments into a ring buffer of the
+ * calling thread and returns; a background thread formats and writes them
+ * to MYLOG_FILE.  The calling thread takes no lock and makes no system
+ * call.  format must be a string literal, is terminated by a newline and
+ * takes at most LOG_MAX_ARGS conversions without '*' widths.  %s
+ * arguments are copied, so they may be freed as soon as L returns.  A
+ * record that finds the ring full is dropped and counted.
+ */
+#define L(priority,format,a...) do { if ((priority) <= MYLOG_PRIORITY) log_write((priority), format, ## a); } while (0)
 
-#endif 
+#define LOG_MAX_ARGS 8
+
+void log_write(int priority, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+/* Writes every record logged so far; it runs at exit as well */
+void log_flush(void);
+
+#endif
@@ -0,0 +1,243 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+
+#include "gfserver.h"
+#include "histogram.h"
+#include "metrics.h"
+
+#define CACHELINE 64
+#define REPORT_SIZE 4096
+#define NSTATUS 3
+
+/* The counters of one thread, only ever written by that thread */
+typedef struct slot_t{
+  uint64_t accepted;
+  uint64_t enqueued;
+  uint64_t dequeued;
+  uint64_t bytes;
+  uint64_t status[NSTATUS];
+  histogram_t stages[METRICS_NSTAGES];
+  struct slot_t* next;
+}slot_t;
+
+static const char* g_stage_names[METRICS_NSTAGES] = {"queue_wait_usec", "handler_usec"};
+static const char* g_status_names[NSTATUS] = {"ok", "file_not_found", "error"};
+
+static int g_enabled;
+static int g_listenfd;
+static uint64_t g_started;
+/* every slot ever handed out, pushed at the head */
+static slot_t* g_slots;
+static __thread slot_t* t_slot;
+
+/* A single writer needs no read-modify-write, only a whole store */
+#define ADD(field, n) __atomic_store_n(&(field), (field) + (n), __ATOMIC_RELAXED)
+#define LOAD(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+static uint64_t now_usec(void){
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000;
+}
+
+/* Returns the slot of the calling thread, NULL while disabled */
+static slot_t* slot(void){
+  slot_t* s;
+  int i;
+
+  if(t_slot != NULL)
+    return t_slot;
+  if(!LOAD(g_enabled))
+    return NULL;
+
+  if(posix_memalign((void**) &s, CACHELINE, sizeof(slot_t)) != 0)
+    return NULL;
+  memset(s, 0, sizeof(slot_t));
+  for(i = 0; i < METRICS_NSTAGES; i++)
+    histogram_init(&s->stages[i]);
+
+  s->next = __atomic_load_n(&g_slots, __ATOMIC_RELAXED);
+  while(!__atomic_compare_exchange_n(&g_slots, &s->next, s, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    ;
+
+  t_slot = s;
+  return s;
+}
+
+uint64_t metrics_clock(void){
+  return LOAD(g_enabled) ? now_usec() : 0;
+}
+
+void metrics_accepted(void){
+  slot_t* s = slot();
+
+  if(s != NULL)
+    ADD(s->accepted, 1);
+}
+
+void metrics_enqueued(void){
+  slot_t* s = slot();
+
+  if(s != NULL)
+    ADD(s->enqueued, 1);
+}
+
+void metrics_dequeued(void){
+  slot_t* s = slot();
+
+  if(s != NULL)
+    ADD(s->dequeued, 1);
+}
+
+void metrics_status(int status){
+  slot_t* s = slot();
+  int index = status == GF_OK ? 0 : status == GF_FILE_NOT_FOUND ? 1 : 2;
+
+  if(s != NULL)
+    ADD(s->status[index], 1);
+}
+
+void metrics_bytes(size_t len){
+  slot_t* s = slot();
+
+  if(s != NULL)
+    ADD(s->bytes, len);
+}
+
+void metrics_stage(metrics_stage_t stage, uint64_t start){
+  slot_t* s;
+  uint64_t now;
+
+  /* a start taken while disabled is 0 */
+  if(start == 0 || (s = slot()) == NULL)
+    return;
+
+  now = now_usec();
+  histogram_record(&s->stages[stage], now > start ? now - start : 0);
+}
+
+/*
+ * Merges every slot into one report.  Only the admin thread calls this,
+ * so the previous sample for the accept rate is kept in statics.
+ */
+static size_t report(char* buffer, size_t size){
+  static histogram_t stages[METRICS_NSTAGES];
+  static uint64_t last_accepted, last_time;
+  uint64_t accepted = 0, enqueued = 0, dequeued = 0, bytes = 0, status[NSTATUS] = {0};
+  uint64_t now = now_usec();
+  slot_t* s;
+  size_t len = 0;
+  int i;
+
+  for(i = 0; i < METRICS_NSTAGES; i++)
+    histogram_init(&stages[i]);
+
+  for(s = __atomic_load_n(&g_slots, __ATOMIC_ACQUIRE); s != NULL; s = s->next){
+    accepted += LOAD(s->accepted);
+    enqueued += LOAD(s->enqueued);
+    dequeued += LOAD(s->dequeued);
+    bytes += LOAD(s->bytes);
+    for(i = 0; i < NSTATUS; i++)
+      status[i] += LOAD(s->status[i]);
+    for(i = 0; i < METRICS_NSTAGES; i++)
+      histogram_merge(&stages[i], &s->stages[i]);
+  }
+
+  if(last_time == 0)
+    last_time = g_started;
+
+#define LINE(format, ...) \
+  if(len < size) len += snprintf(buffer + len, size - len, format "\n", __VA_ARGS__)
+
+  LINE("uptime_seconds %.1f", (now - g_started) / 1e6);
+  LINE("accepted_total %lu", (unsigned long) accepted);
+  /* the rate since the previous report, or since startup */
+  LINE("accept_rate %.1f", now > last_time ? (accepted - last_accepted) * 1e6 / (now - last_time) : 0.0);
+  LINE("queue_enqueued_total %lu", (unsigned long) enqueued);
+  /* both sums are read at slightly different times, never go negative */
+  LINE("queue_depth %lu", (unsigned long) (enqueued > dequeued ? enqueued - dequeued : 0));
+  LINE("bytes_sent_total %lu", (unsigned long) bytes);
+  for(i = 0; i < NSTATUS; i++)
+    LINE("responses_%s_total %lu", g_status_names[i], (unsigned long) status[i]);
+  for(i = 0; i < METRICS_NSTAGES; i++){
+    LINE("%s_count %lu", g_stage_names[i], (unsigned long) stages[i].total);
+    LINE("%s_mean %.1f", g_stage_names[i], histogram_mean(&stages[i]));
+    LINE("%s_p50 %lu", g_stage_names[i], (unsigned long) histogram_percentile(&stages[i], 50));
+    LINE("%s_p90 %lu", g_stage_names[i], (unsigned long) histogram_percentile(&stages[i], 90));
+    LINE("%s_p99 %lu", g_stage_names[i], (unsigned long) histogram_percentile(&stages[i], 99));
+    LINE("%s_max %lu", g_stage_names[i], (unsigned long) stages[i].max);
+  }
+
+#undef LINE
+
+  last_accepted = accepted;
+  last_time = now;
+  return len < size ? len : size - 1;
+}
+
+static void* admin_thread(void* arg){
+  char buffer[REPORT_SIZE];
+  struct timeval timeout = {1, 0};
+  size_t len;
+  int connfd;
+
+  for( ; ; ){
+    if((connfd = accept(g_listenfd, NULL, NULL)) < 0)
+      continue;
+
+    len = report(buffer, sizeof(buffer));
+    send(connfd, buffer, len, MSG_NOSIGNAL);
+
+    /* drain whatever the client sent so that closing does not reset the report */
+    shutdown(connfd, SHUT_WR);
+    setsockopt(connfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    while(recv(connfd, buffer, sizeof(buffer), 0) > 0)
+      ;
+    close(connfd);
+  }
+
+  return NULL;
+}
+
+int metrics_init(unsigned short port){
+  struct sockaddr_in addr;
+  pthread_t thread;
+  int optval = 1;
+
+  if((g_listenfd = socket(AF_INET, SOCK_STREAM, 0)) < 0){
+    perror("Unable to create the admin socket");
+    return -1;
+  }
+  setsockopt(g_listenfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+
+  /* the report is for operators on the host, not for clients */
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(port);
+
+  if(bind(g_listenfd, (struct sockaddr*) &addr, sizeof(addr)) < 0 || listen(g_listenfd, 16) < 0){
+    fprintf(stderr, "failed to bind the admin port; port = %d\n", port);
+    close(g_listenfd);
+    return -1;
+  }
+
+  g_started = now_usec();
+  __atomic_store_n(&g_enabled, 1, __ATOMIC_RELAXED);
+
+  if(pthread_create(&thread, NULL, admin_thread, NULL) != 0){
+    fprintf(stderr, "Error creating the admin thread\n");
+    return -1;
+  }
+  pthread_detach(thread);
+
+  return 0;
+}
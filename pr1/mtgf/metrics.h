@@ -0,0 +1,51 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Server metrics.  Every thread counts into a slot of its own, so
+ * recording takes no lock and shares no cache line; a report merges the
+ * slots as it reads them.  Nothing is recorded until metrics_init runs,
+ * which starts an admin thread answering each connection to its port
+ * with one "name value" line per metric:
+ *
+ *   accepted_total 1520
+ *   accept_rate 310.4
+ *   queue_depth 3
+ *   handler_usec_p99 820
+ */
+
+typedef enum{
+  METRICS_QUEUE_WAIT,  /* from handing the request to a queue to a worker taking it */
+  METRICS_HANDLER,     /* from a worker taking the request to the handler returning */
+  METRICS_NSTAGES
+}metrics_stage_t;
+
+/*
+ * Enables recording and serves reports on the loopback admin port.
+ * Returns -1 if the port cannot be bound
+ */
+int metrics_init(unsigned short port);
+
+/* Returns a timestamp in microseconds for metrics_stage, 0 while disabled */
+uint64_t metrics_clock(void);
+
+/* Counts one accepted connection */
+void metrics_accepted(void);
+
+/* Counts one request put on or taken off the work queue */
+void metrics_enqueued(void);
+void metrics_dequeued(void);
+
+/* Counts one response header sent with status, a gfstatus_t */
+void metrics_status(int status);
+
+/* Counts len bytes of response body sent */
+void metrics_bytes(size_t len);
+
+/* Records the time from start, a metrics_clock timestamp, to now in stage */
+void metrics_stage(metrics_stage_t stage, uint64_t start);
+
+#endif
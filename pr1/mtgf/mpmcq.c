@@ -0,0 +1,162 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sched.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include "mpmcq.h"
+
+/* Looks at an empty queue this many times before parking on the futex */
+#define MPMCQ_SPINS 64
+/* the last looks give the CPU away instead of pausing */
+#define MPMCQ_YIELDS 4
+/* most pause instructions between two looks */
+#define MPMCQ_MAX_PAUSES 64
+
+/* Tells the core we are spinning, so a sibling hyperthread gets the pipeline */
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define cpu_relax() __asm__ __volatile__("yield" ::: "memory")
+#else
+#define cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
+static void futex_wait(uint32_t* addr, uint32_t val){
+  syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void futex_wake(uint32_t* addr, int n){
+  syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+void mpmcq_init(mpmcq_t* this, size_t capacity){
+  size_t i, size = 2;
+
+  while(size < capacity)
+    size <<= 1;
+
+  if(posix_memalign((void**) &this->buffer, MPMCQ_CACHELINE, size * sizeof(mpmcq_cell_t)) != 0){
+    fprintf(stderr, "Error: unable to allocate mpmcq.\n");
+    fflush(stderr);
+    exit(EXIT_FAILURE);
+  }
+
+  for(i = 0; i < size; i++)
+    this->buffer[i].sequence = i;
+
+  this->mask = size - 1;
+  this->enqueue_pos = 0;
+  this->dequeue_pos = 0;
+  this->futex_seq = 0;
+  this->nwaiters = 0;
+}
+
+int mpmcq_size(mpmcq_t* this){
+  size_t tail = __atomic_load_n(&this->enqueue_pos, __ATOMIC_RELAXED);
+  size_t head = __atomic_load_n(&this->dequeue_pos, __ATOMIC_RELAXED);
+
+  return tail > head ? (int)(tail - head) : 0;
+}
+
+int mpmcq_isempty(mpmcq_t* this){
+  return mpmcq_size(this) == 0;
+}
+
+int mpmcq_enqueue(mpmcq_t* this, steque_item item){
+  mpmcq_cell_t* cell;
+  size_t pos, seq;
+  intptr_t dif;
+
+  pos = __atomic_load_n(&this->enqueue_pos, __ATOMIC_RELAXED);
+  for(;;){
+    cell = &this->buffer[pos & this->mask];
+    seq = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+    dif = (intptr_t) seq - (intptr_t) pos;
+
+    if(dif == 0){
+      if(__atomic_compare_exchange_n(&this->enqueue_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    }
+    else if(dif < 0)
+      return -1; /* full */
+    else
+      pos = __atomic_load_n(&this->enqueue_pos, __ATOMIC_RELAXED);
+  }
+
+  cell->item = item;
+  __atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+
+  /* Pairs with the increment of nwaiters in mpmcq_pop */
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if(__atomic_load_n(&this->nwaiters, __ATOMIC_RELAXED) > 0){
+    __atomic_fetch_add(&this->futex_seq, 1, __ATOMIC_SEQ_CST);
+    futex_wake(&this->futex_seq, 1);
+  }
+
+  return 0;
+}
+
+int mpmcq_trypop(mpmcq_t* this, steque_item* item){
+  mpmcq_cell_t* cell;
+  size_t pos, seq;
+  intptr_t dif;
+
+  pos = __atomic_load_n(&this->dequeue_pos, __ATOMIC_RELAXED);
+  for(;;){
+    cell = &this->buffer[pos & this->mask];
+    seq = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+    dif = (intptr_t) seq - (intptr_t) (pos + 1);
+
+    if(dif == 0){
+      if(__atomic_compare_exchange_n(&this->dequeue_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    }
+    else if(dif < 0)
+      return -1; /* empty */
+    else
+      pos = __atomic_load_n(&this->dequeue_pos, __ATOMIC_RELAXED);
+  }
+
+  *item = cell->item;
+  __atomic_store_n(&cell->sequence, pos + this->mask + 1, __ATOMIC_RELEASE);
+
+  return 0;
+}
+
+steque_item mpmcq_pop(mpmcq_t* this){
+  steque_item item;
+  uint32_t seq;
+  int i, j, pauses;
+
+  for(;;){
+    /* pause with exponential backoff, a system call per look costs more than the wait */
+    for(i = 0, pauses = 1; i < MPMCQ_SPINS; i++){
+      if(mpmcq_trypop(this, &item) == 0)
+        return item;
+      if(i >= MPMCQ_SPINS - MPMCQ_YIELDS){
+        sched_yield();
+        continue;
+      }
+      for(j = 0; j < pauses; j++)
+        cpu_relax();
+      if(pauses < MPMCQ_MAX_PAUSES)
+        pauses <<= 1;
+    }
+
+    /* Announce ourselves, then re-check so a concurrent enqueue cannot be missed */
+    seq = __atomic_load_n(&this->futex_seq, __ATOMIC_SEQ_CST);
+    __atomic_fetch_add(&this->nwaiters, 1, __ATOMIC_SEQ_CST);
+    if(mpmcq_trypop(this, &item) == 0){
+      __atomic_fetch_sub(&this->nwaiters, 1, __ATOMIC_SEQ_CST);
+      return item;
+    }
+    futex_wait(&this->futex_seq, seq);
+    __atomic_fetch_sub(&this->nwaiters, 1, __ATOMIC_SEQ_CST);
+  }
+}
+
+void mpmcq_destroy(mpmcq_t* this){
+  free(this->buffer);
+  this->buffer = NULL;
+}
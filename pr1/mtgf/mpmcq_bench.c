@@ -0,0 +1,187 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "steque.h"
+#include "mpmcq.h"
+
+/*
+ * Moves items from producer to consumer threads through the boss/worker
+ * queue of the server, a steque_t behind a mutex and condition variable,
+ * and through the lock-free mpmcq_t, at 1 to max_threads threads of each.
+ *
+ *   mpmcq_bench [max_threads] [items]
+ */
+
+#define DEFAULT_MAX_THREADS 256
+#define DEFAULT_ITEMS 1000000
+/* the capacity handler.c gives the mpmc queue */
+#define MPMC_CAPACITY 4096
+/* item a consumer stops at, real items start at 1 */
+#define STOP ((steque_item) 0)
+
+typedef struct{
+  steque_t queue;
+  pthread_mutex_t lock;
+  pthread_cond_t nonempty;
+}locked_queue_t;
+
+typedef struct{
+  int mpmc;
+  locked_queue_t locked;
+  mpmcq_t ring;
+  long items;
+}bench_t;
+
+typedef struct{
+  bench_t* bench;
+  long first;
+  long count;
+  long sum;
+}bench_thread_t;
+
+static void put(bench_t* b, steque_item item){
+  if(b->mpmc){
+    while(mpmcq_enqueue(&b->ring, item) < 0)
+      sched_yield();
+    return;
+  }
+
+  pthread_mutex_lock(&b->locked.lock);
+  steque_enqueue(&b->locked.queue, item);
+  pthread_mutex_unlock(&b->locked.lock);
+  pthread_cond_signal(&b->locked.nonempty);
+}
+
+static steque_item get(bench_t* b){
+  steque_item item;
+
+  if(b->mpmc)
+    return mpmcq_pop(&b->ring);
+
+  pthread_mutex_lock(&b->locked.lock);
+  while(steque_isempty(&b->locked.queue))
+    pthread_cond_wait(&b->locked.nonempty, &b->locked.lock);
+  item = steque_pop(&b->locked.queue);
+  pthread_mutex_unlock(&b->locked.lock);
+
+  return item;
+}
+
+static void* producer(void* arg){
+  bench_thread_t* t = arg;
+  long i;
+
+  for(i = 0; i < t->count; i++)
+    put(t->bench, (steque_item)(intptr_t)(t->first + i));
+
+  return NULL;
+}
+
+static void* consumer(void* arg){
+  bench_thread_t* t = arg;
+  steque_item item;
+
+  while((item = get(t->bench)) != STOP)
+    t->sum += (long)(intptr_t) item;
+
+  return NULL;
+}
+
+static double now(void){
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Runs nthreads producers and consumers, returns items per second or -1 if items went missing */
+static double run(bench_t* b, int nthreads){
+  pthread_t* producers = malloc(nthreads * sizeof(pthread_t));
+  pthread_t* consumers = malloc(nthreads * sizeof(pthread_t));
+  bench_thread_t* ptasks = calloc(nthreads, sizeof(bench_thread_t));
+  bench_thread_t* ctasks = calloc(nthreads, sizeof(bench_thread_t));
+  long per = b->items / nthreads, sum = 0;
+  double start, elapsed;
+  int i;
+
+  if(producers == NULL || consumers == NULL || ptasks == NULL || ctasks == NULL){
+    fprintf(stderr, "Error: unable to allocate threads.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  start = now();
+  for(i = 0; i < nthreads; i++){
+    ctasks[i].bench = b;
+    pthread_create(&consumers[i], NULL, consumer, &ctasks[i]);
+  }
+  for(i = 0; i < nthreads; i++){
+    ptasks[i].bench = b;
+    ptasks[i].first = 1 + i * per;
+    ptasks[i].count = per;
+    pthread_create(&producers[i], NULL, producer, &ptasks[i]);
+  }
+
+  for(i = 0; i < nthreads; i++)
+    pthread_join(producers[i], NULL);
+  /* every item is ahead of the stops in the FIFO */
+  for(i = 0; i < nthreads; i++)
+    put(b, STOP);
+  for(i = 0; i < nthreads; i++){
+    pthread_join(consumers[i], NULL);
+    sum += ctasks[i].sum;
+  }
+  elapsed = now() - start;
+
+  free(producers);
+  free(consumers);
+  free(ptasks);
+  free(ctasks);
+
+  /* items 1 .. per * nthreads, each taken exactly once */
+  if(sum != per * nthreads * (per * nthreads + 1) / 2)
+    return -1;
+  return per * nthreads / elapsed;
+}
+
+int main(int argc, char** argv){
+  int max_threads = argc > 1 ? atoi(argv[1]) : DEFAULT_MAX_THREADS;
+  long items = argc > 2 ? atol(argv[2]) : DEFAULT_ITEMS;
+  double locked, mpmc;
+  bench_t b;
+  int n;
+
+  if(max_threads < 1 || items < max_threads){
+    fprintf(stderr, "usage: mpmcq_bench [max_threads] [items]\n");
+    return EXIT_FAILURE;
+  }
+
+  memset(&b, 0, sizeof(b));
+  b.items = items;
+  steque_init(&b.locked.queue);
+  pthread_mutex_init(&b.locked.lock, NULL);
+  pthread_cond_init(&b.locked.nonempty, NULL);
+  mpmcq_init(&b.ring, MPMC_CAPACITY);
+
+  printf("%8s %16s %16s %8s\n", "threads", "steque items/s", "mpmcq items/s", "speedup");
+  for(n = 1; n <= max_threads; n *= 2){
+    b.mpmc = 0;
+    locked = run(&b, n);
+    b.mpmc = 1;
+    mpmc = run(&b, n);
+    if(locked < 0 || mpmc < 0){
+      fprintf(stderr, "Error: items lost at %d threads.\n", n);
+      return EXIT_FAILURE;
+    }
+    printf("%8d %16.0f %16.0f %7.2fx\n", n, locked, mpmc, mpmc / locked);
+  }
+
+  steque_destroy(&b.locked.queue);
+  mpmcq_destroy(&b.ring);
+
+  return 0;
+}
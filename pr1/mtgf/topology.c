@@ -0,0 +1,109 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "topology.h"
+
+#define NODE_CPULIST "/sys/devices/system/node/node%d/cpulist"
+#define MAX_NODES 64
+
+static pthread_once_t g_once = PTHREAD_ONCE_INIT;
+static int g_nnodes;
+static int g_ncpus[MAX_NODES];
+/* the CPUs of each node, in increasing order */
+static int* g_cpus[MAX_NODES];
+
+/* Adds every CPU of list, e.g. "0-3,8-11", that is also in allowed */
+static int parse_cpulist(char* list, cpu_set_t* allowed, int* cpus){
+  char* range;
+  char* saveptr;
+  int first, last, cpu, n = 0;
+
+  for(range = strtok_r(list, ",\n", &saveptr); range != NULL; range = strtok_r(NULL, ",\n", &saveptr)){
+    if(sscanf(range, "%d-%d", &first, &last) == 1)
+      last = first;
+    for(cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+      if(CPU_ISSET(cpu, allowed))
+        cpus[n++] = cpu;
+  }
+
+  return n;
+}
+
+static void discover(void){
+  cpu_set_t allowed;
+  char path[64], list[4096];
+  FILE* file;
+  int node, cpu, n;
+
+  if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0){
+    CPU_ZERO(&allowed);
+    CPU_SET(0, &allowed);
+  }
+
+  /* node numbers may have gaps, nodes without allowed CPUs are skipped */
+  for(node = 0; node < MAX_NODES * 4 && g_nnodes < MAX_NODES; node++){
+    snprintf(path, sizeof(path), NODE_CPULIST, node);
+    if((file = fopen(path, "r")) == NULL)
+      continue;
+    n = fgets(list, sizeof(list), file) != NULL;
+    fclose(file);
+    if(!n)
+      continue;
+
+    g_cpus[g_nnodes] = (int*) malloc(CPU_COUNT(&allowed) * sizeof(int));
+    if((g_ncpus[g_nnodes] = parse_cpulist(list, &allowed, g_cpus[g_nnodes])) > 0)
+      g_nnodes++;
+    else
+      free(g_cpus[g_nnodes]);
+  }
+
+  if(g_nnodes > 0)
+    return;
+
+  /* no NUMA listing: a single node */
+  g_cpus[0] = (int*) malloc(CPU_COUNT(&allowed) * sizeof(int));
+  for(cpu = 0, n = 0; cpu < CPU_SETSIZE; cpu++)
+    if(CPU_ISSET(cpu, &allowed))
+      g_cpus[0][n++] = cpu;
+  g_ncpus[0] = n;
+  g_nnodes = 1;
+}
+
+int topology_policy(const char* name){
+  if(strcmp(name, "none") == 0)
+    return TOPOLOGY_PIN_NONE;
+  if(strcmp(name, "core") == 0)
+    return TOPOLOGY_PIN_CORE;
+  if(strcmp(name, "node") == 0)
+    return TOPOLOGY_PIN_NODE;
+  return -1;
+}
+
+int topology_nnodes(void){
+  pthread_once(&g_once, discover);
+  return g_nnodes;
+}
+
+int topology_placement(int policy, int node, int index, cpu_set_t* set){
+  int i;
+
+  if(policy == TOPOLOGY_PIN_NONE)
+    return -1;
+
+  node %= topology_nnodes();
+  CPU_ZERO(set);
+
+  if(policy == TOPOLOGY_PIN_CORE){
+    CPU_SET(g_cpus[node][index % g_ncpus[node]], set);
+    return 0;
+  }
+
+  for(i = 0; i < g_ncpus[node]; i++)
+    CPU_SET(g_cpus[node][i], set);
+  return 0;
+}
@@ -1,20 +1,87 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <pthread.h>
+#include <stdint.h>
+#include <math.h>
 
 #include "workload.h"
 
-static char *gWorkloadPathArray[100];
-static unsigned short int gUniqueWorkloadPaths = 0;
+static char **gWorkloadPathArray = NULL;
+static double *gWorkloadWeightArray = NULL;
+static size_t gUniqueWorkloadPaths = 0;
 
-static pthread_mutex_t counter_mutex;
-static int counter = 0;
+/*
+ * Vose alias table over the paths for WORKLOAD_ZIPF and WORKLOAD_WEIGHTED:
+ * pick a slot uniformly, then keep it with probability gAliasProb[slot]
+ * or take gAliasIndex[slot] instead.
+ */
+static double *gAliasProb = NULL;
+static size_t *gAliasIndex = NULL;
+
+static size_t counter = 0;
 static int mode = WORKLOAD_SEQ;
 
+/* Each thread seeds its generator from the next value of rng_seed */
+static uint64_t rng_seed = 0;
+static __thread uint64_t rng_state = 0;
+
+static uint64_t splitmix64(uint64_t x){
+  x += 0x9E3779B97F4A7C15ULL;
+  x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+  return x ^ (x >> 31);
+}
+
+/* xorshift64* */
+static uint64_t next_random(){
+  uint64_t x = rng_state;
+
+  if(x == 0){
+    x = splitmix64(__atomic_fetch_add(&rng_seed, 1, __ATOMIC_RELAXED));
+    if(x == 0)
+      x = 1;
+  }
+
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  rng_state = x;
+
+  return x * 0x2545F4914F6CDD1DULL;
+}
+
+/* Uniform in [0, 1) */
+static double next_unit(){
+  return (next_random() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static int add_path(char *path, double weight, size_t *capacity){
+  char **paths;
+  double *weights;
+
+  if(gUniqueWorkloadPaths == *capacity){
+    *capacity = *capacity ? *capacity * 2 : 64;
+    paths = realloc(gWorkloadPathArray, *capacity * sizeof(char*));
+    weights = realloc(gWorkloadWeightArray, *capacity * sizeof(double));
+    if(paths != NULL)
+      gWorkloadPathArray = paths;
+    if(weights != NULL)
+      gWorkloadWeightArray = weights;
+    if(paths == NULL || weights == NULL)
+      return -1;
+  }
+
+  if(NULL == (gWorkloadPathArray[gUniqueWorkloadPaths] = strdup(path)))
+    return -1;
+  gWorkloadWeightArray[gUniqueWorkloadPaths++] = weight;
+
+  return 0;
+}
+
 int workload_init(char *workload_path) {
-  int i = 0;
-  char temp_buf[256];
+  char *line = NULL, *path, *token, *end, *saveptr;
+  size_t line_size = 0, capacity = 0;
+  double weight;
 
   FILE *file_handle;
 
@@ -24,30 +91,146 @@ int workload_init(char *workload_path) {
     return EXIT_FAILURE;
   }
 
-  while (fscanf(file_handle, "%s", temp_buf) != EOF)
-    gWorkloadPathArray[i++] = strdup(temp_buf);
-
-  gUniqueWorkloadPaths = i;
-
-  pthread_mutex_init(&counter_mutex, NULL);
+  while (getline(&line, &line_size, file_handle) != -1){
+    if (NULL == (path = strtok_r(line, " \t\r\n", &saveptr)))
+      continue;
+
+    weight = 1.0;
+    if (NULL != (token = strtok_r(NULL, " \t\r\n", &saveptr))){
+      weight = strtod(token, &end);
+      if (*end != '\0' || !(weight > 0)){
+        fprintf(stderr, "invalid weight %s for %s\n", token, path);
+        free(line);
+        fclose(file_handle);
+        return EXIT_FAILURE;
+      }
+    }
+
+    if (0 > add_path(path, weight, &capacity)){
+      perror("Unable to allocate memory");
+      free(line);
+      fclose(file_handle);
+      return EXIT_FAILURE;
+    }
+  }
 
+  free(line);
   fclose(file_handle);
 
+  if (gUniqueWorkloadPaths == 0){
+    fprintf(stderr, "workload file %s has no paths\n", workload_path);
+    return EXIT_FAILURE;
+  }
+
   return EXIT_SUCCESS;
 }
 
-unsigned short int workload_num_unique_paths(){
-  return gUniqueWorkloadPaths;
+/* Builds the alias table for a distribution proportional to weights */
+static int build_alias(double *weights){
+  size_t n = gUniqueWorkloadPaths;
+  size_t *small, *large;
+  size_t nsmall = 0, nlarge = 0, s, l, i;
+  double sum = 0;
+
+  free(gAliasProb);
+  free(gAliasIndex);
+  gAliasProb = malloc(n * sizeof(double));
+  gAliasIndex = malloc(n * sizeof(size_t));
+  small = malloc(n * sizeof(size_t));
+  large = malloc(n * sizeof(size_t));
+  if(gAliasProb == NULL || gAliasIndex == NULL || small == NULL || large == NULL){
+    free(small);
+    free(large);
+    return -1;
+  }
+
+  for(i = 0; i < n; i++)
+    sum += weights[i];
+
+  for(i = 0; i < n; i++){
+    gAliasProb[i] = weights[i] * n / sum;
+    gAliasIndex[i] = i;
+    if(gAliasProb[i] < 1.0)
+      small[nsmall++] = i;
+    else
+      large[nlarge++] = i;
+  }
+
+  while(nsmall > 0 && nlarge > 0){
+    s = small[--nsmall];
+    l = large[--nlarge];
+    gAliasIndex[s] = l;
+    gAliasProb[l] -= 1.0 - gAliasProb[s];
+    if(gAliasProb[l] < 1.0)
+      small[nsmall++] = l;
+    else
+      large[nlarge++] = l;
+  }
+
+  /* whatever is left is 1 up to rounding */
+  while(nlarge > 0)
+    gAliasProb[large[--nlarge]] = 1.0;
+  while(nsmall > 0)
+    gAliasProb[small[--nsmall]] = 1.0;
+
+  free(small);
+  free(large);
+
+  return 0;
 }
 
-char* workload_get_path(){
-  if(mode == WORKLOAD_RND)
-    return gWorkloadPathArray[(int)(1.0 * gUniqueWorkloadPaths * rand()/(RAND_MAX+1.0))];
+int workload_set_zipf(double s){
+  double *weights;
+  size_t i;
+  int result;
+
+  if(NULL == (weights = malloc(gUniqueWorkloadPaths * sizeof(double))))
+    return -1;
+
+  for(i = 0; i < gUniqueWorkloadPaths; i++)
+    weights[i] = 1.0 / pow((double)(i + 1), s);
 
-  pthread_mutex_lock(&counter_mutex);
-  counter++;
-  pthread_mutex_unlock(&counter_mutex);
+  if(0 == (result = build_alias(weights)))
+    mode = WORKLOAD_ZIPF;
 
-  return gWorkloadPathArray[counter % gUniqueWorkloadPaths];
+  free(weights);
 
-}
\ No newline at end of file
+  return result;
+}
+
+int workload_set_mode(int new_mode){
+  switch(new_mode){
+    case WORKLOAD_SEQ:
+    case WORKLOAD_RND:
+      mode = new_mode;
+      return 0;
+    case WORKLOAD_ZIPF:
+      return workload_set_zipf(WORKLOAD_ZIPF_EXPONENT);
+    case WORKLOAD_WEIGHTED:
+      if(0 > build_alias(gWorkloadWeightArray))
+        return -1;
+      mode = WORKLOAD_WEIGHTED;
+      return 0;
+    default:
+      return -1;
+  }
+}
+
+size_t workload_num_unique_paths(){
+  return gUniqueWorkloadPaths;
+}
+
+char* workload_get_path(){
+  size_t i;
+
+  switch(mode){
+    case WORKLOAD_RND:
+      return gWorkloadPathArray[(size_t)(next_unit() * gUniqueWorkloadPaths)];
+    case WORKLOAD_ZIPF:
+    case WORKLOAD_WEIGHTED:
+      i = (size_t)(next_unit() * gUniqueWorkloadPaths);
+      return gWorkloadPathArray[next_unit() < gAliasProb[i] ? i : gAliasIndex[i]];
+    default:
+      return gWorkloadPathArray[__atomic_add_fetch(&counter, 1, __ATOMIC_RELAXED) % gUniqueWorkloadPaths];
+  }
+}
@@ -1,12 +1,22 @@
 #ifndef __WORKLOAD_H__
 #define __WORKLOAD_H__
 
+#include <stddef.h>
+
 #define WORKLOAD_SEQ 0
 #define WORKLOAD_RND 1
+#define WORKLOAD_ZIPF 2
+#define WORKLOAD_WEIGHTED 3
+
+/* Exponent of the Zipf distribution unless set with workload_set_zipf */
+#define WORKLOAD_ZIPF_EXPONENT 1.0
 
 /* 
  * Opens the file associated with the input argument
- * and reads in a list of paths to request. 
+ * and reads in a list of paths to request, one per line.
+ * A path may be followed by a positive weight, used by
+ * WORKLOAD_WEIGHTED (Default: 1).  There is no limit on
+ * the number of paths.
  */
 int workload_init(char *workload_path);
 
@@ -14,19 +24,30 @@ int workload_init(char *workload_path);
  * Sets the mode.  If WORKLOAD_SEQ, then workload getpath will
  * return the paths in sequence.  If WORKLOAD_RND, then
  * the paths will be chosen uniformly at random with replacement.
+ * If WORKLOAD_ZIPF, the path on line i is chosen with a probability
+ * proportional to 1/i^s, and if WORKLOAD_WEIGHTED proportional to
+ * its weight.  Must be called after workload_init and before any
+ * thread calls workload_get_path.  Returns -1 for an unknown mode.
  */
 int workload_set_mode(int mode);
 
+/*
+ * Same as workload_set_mode(WORKLOAD_ZIPF) with the exponent s.
+ */
+int workload_set_zipf(double s);
+
 /*
  * Returns the number of unique paths in the workload
  */
-unsigned short int workload_num_unique_paths();
+size_t workload_num_unique_paths();
 
 /*
  * Returns a path from the workload.  Whether this is
  * done sequentially, randomly or by some other method
- * is not specified.
+ * is not specified.  Safe to call from several threads
+ * at once without locking: the sequence is an atomic
+ * cursor and each thread draws from its own generator.
  */
 char* workload_get_path();
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,53 @@
+#ifndef WSCHED_H
+#define WSCHED_H
+
+#include <stdint.h>
+
+#include "steque.h"
+#include "mpmcq.h"
+#include "wsdeque.h"
+
+/*
+ * Work-stealing scheduler for a fixed pool of workers.  The acceptor
+ * submits items into per-worker inboxes; each worker moves its inbox into
+ * its own Chase-Lev deque and runs from the bottom, while idle workers
+ * steal from the top of their peers' deques.  A worker with nothing to
+ * run or steal parks on its own futex.
+ */
+
+#define WSCHED_ROUND_ROBIN 0
+#define WSCHED_LEAST_LOADED 1
+
+typedef struct wsched_worker_t{
+  wsdeque_t deque;
+  mpmcq_t inbox;
+  /* items submitted to this worker and not yet picked up */
+  long load;
+  /* 1 while the worker runs an item, counted by the least-loaded policy */
+  long running;
+  uint32_t futex_seq;
+  int parked;
+  char pad[MPMCQ_CACHELINE - 2 * sizeof(long) - sizeof(uint32_t) - sizeof(int)];
+} wsched_worker_t;
+
+typedef struct{
+  int nworkers;
+  int policy;
+  unsigned long next;
+  wsched_worker_t* workers;
+}wsched_t;
+
+
+/* Initializes the scheduler for nworkers with the given placement policy */
+void wsched_init(wsched_t* this, int nworkers, int policy);
+
+/* Hands an item to a worker chosen by the placement policy */
+void wsched_submit(wsched_t* this, steque_item item);
+
+/* Returns the next item for worker, blocking until one is available */
+steque_item wsched_next(wsched_t* this, int worker);
+
+/* Frees all queues; the scheduler must no longer be in use */
+void wsched_destroy(wsched_t* this);
+
+#endif
@@ -0,0 +1,94 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include "wsdeque.h"
+
+/*
+ * Memory orderings follow Le, Pop, Cohen and Zappa Nardelli,
+ * "Correct and Efficient Work-Stealing for Weak Memory Models" (PPoPP'13).
+ */
+
+void wsdeque_init(wsdeque_t* this, long capacity){
+  long size = 2;
+
+  while(size < capacity)
+    size <<= 1;
+
+  if(NULL == (this->buffer = (steque_item*) calloc(size, sizeof(steque_item)))){
+    fprintf(stderr, "Error: unable to allocate wsdeque.\n");
+    fflush(stderr);
+    exit(EXIT_FAILURE);
+  }
+
+  this->mask = size - 1;
+  this->top = 0;
+  this->bottom = 0;
+}
+
+long wsdeque_size(wsdeque_t* this){
+  long b = __atomic_load_n(&this->bottom, __ATOMIC_RELAXED);
+  long t = __atomic_load_n(&this->top, __ATOMIC_RELAXED);
+
+  return b > t ? b - t : 0;
+}
+
+int wsdeque_push(wsdeque_t* this, steque_item item){
+  long b = __atomic_load_n(&this->bottom, __ATOMIC_RELAXED);
+  long t = __atomic_load_n(&this->top, __ATOMIC_ACQUIRE);
+
+  if(b - t > this->mask)
+    return -1; /* full */
+
+  __atomic_store_n(&this->buffer[b & this->mask], item, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&this->bottom, b + 1, __ATOMIC_RELAXED);
+
+  return 0;
+}
+
+int wsdeque_take(wsdeque_t* this, steque_item* item){
+  long b = __atomic_load_n(&this->bottom, __ATOMIC_RELAXED) - 1;
+  long t;
+  int ans = 0;
+
+  __atomic_store_n(&this->bottom, b, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  t = __atomic_load_n(&this->top, __ATOMIC_RELAXED);
+
+  if(t > b){
+    /* empty */
+    __atomic_store_n(&this->bottom, b + 1, __ATOMIC_RELAXED);
+    return -1;
+  }
+
+  *item = __atomic_load_n(&this->buffer[b & this->mask], __ATOMIC_RELAXED);
+  if(t == b){
+    /* last element: race against thieves for it */
+    if(!__atomic_compare_exchange_n(&this->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+      ans = -1;
+    __atomic_store_n(&this->bottom, b + 1, __ATOMIC_RELAXED);
+  }
+
+  return ans;
+}
+
+int wsdeque_steal(wsdeque_t* this, steque_item* item){
+  long t = __atomic_load_n(&this->top, __ATOMIC_ACQUIRE);
+  long b;
+
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  b = __atomic_load_n(&this->bottom, __ATOMIC_ACQUIRE);
+
+  if(t >= b)
+    return -1; /* empty */
+
+  *item = __atomic_load_n(&this->buffer[t & this->mask], __ATOMIC_RELAXED);
+  if(!__atomic_compare_exchange_n(&this->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+    return -1; /* lost the race */
+
+  return 0;
+}
+
+void wsdeque_destroy(wsdeque_t* this){
+  free(this->buffer);
+  this->buffer = NULL;
+}
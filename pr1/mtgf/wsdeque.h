@@ -0,0 +1,43 @@
+#ifndef WSDEQUE_H
+#define WSDEQUE_H
+
+#include "steque.h"
+
+/*
+ * Bounded Chase-Lev work-stealing deque.  Only the owning thread may call
+ * wsdeque_push and wsdeque_take, which work on the "bottom" end; any other
+ * thread may call wsdeque_steal, which takes from the "top" end.
+ */
+
+#define WSDEQUE_CACHELINE 64
+
+typedef struct{
+  long top;
+  char pad0[WSDEQUE_CACHELINE - sizeof(long)];
+  long bottom;
+  char pad1[WSDEQUE_CACHELINE - sizeof(long)];
+  steque_item* buffer;
+  long mask;
+}wsdeque_t;
+
+
+/* Initializes the deque; capacity is rounded up to a power of two */
+void wsdeque_init(wsdeque_t* this, long capacity);
+
+/* Returns the (approximate) number of elements in the deque */
+long wsdeque_size(wsdeque_t* this);
+
+/* Owner only: adds an element to the bottom. Returns -1 if it is full */
+int wsdeque_push(wsdeque_t* this, steque_item item);
+
+/* Owner only: removes the bottom element into item. Returns -1 if it is empty */
+int wsdeque_take(wsdeque_t* this, steque_item* item);
+
+/* Any thread: removes the top element into item. Returns -1 if it is
+   empty or another thread won the race for it */
+int wsdeque_steal(wsdeque_t* this, steque_item* item);
+
+/* Frees the buffer; the deque must no longer be in use */
+void wsdeque_destroy(wsdeque_t* this);
+
+#endif
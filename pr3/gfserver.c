@@ -0,0 +1,744 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <signal.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include "gfserver.h"
+#include "topology.h"
+
+/*
+ * Boss-worker implementation of the interface in gfserver.h.  The boss
+ * accepts connections and queues their descriptors in req_queue, or in
+ * the work-stealing scheduler when GFS_SCHEDULER asks for it; each worker
+ * owns one entry of contexts and serves one request at a time.  With
+ * several listeners there is one boss per listening socket; they all
+ * queue into the same workers.
+ */
+
+#define SCHEME "GETFILE"
+#define METHOD_GET "GET"
+#define HEADER_RESPONSE "GETFILE %s %zu\r\n\r\n"
+#define END_OF_REQUEST "\r\n\r\n"
+#define COPY_BUFFER_SIZE 4096
+#define HEADER_MAX_LEN 64
+#define CODEL_INTERVAL 100000
+// how long a rejected connection is drained before it is closed, in microseconds
+#define REJECT_LINGER 10000
+#define REAPER_EVENTS 64
+
+/* A rejected connection the reaper closes once its client does, or at deadline */
+typedef struct {
+    int socket;
+    uint64_t deadline;
+} lingering_t;
+
+/* One listening socket and its accept loop */
+struct _gflistener_t {
+    gfserver_t *gfs;
+    int fd;
+};
+
+/*
+ * Sends the whole buffer, retrying on partial writes.
+ */
+static ssize_t send_all(int socket, const char *data, size_t len) {
+    size_t sent = 0;
+    ssize_t n;
+
+    while (sent < len) {
+        if ((n = send(socket, data + sent, len - sent, MSG_NOSIGNAL)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return SERVER_FAILURE;
+        }
+        sent += n;
+    }
+
+    return (ssize_t)sent;
+}
+
+int gfs_format_header(char *buffer, size_t size, gfstatus_t status, size_t file_len) {
+    switch (status) {
+        case GF_OK:
+            return snprintf(buffer, size, HEADER_RESPONSE, "OK", file_len);
+        case GF_FILE_NOT_FOUND:
+            return snprintf(buffer, size, HEADER_RESPONSE, "FILE_NOT_FOUND", (size_t)0);
+        case GF_ERROR:
+        default:
+            return snprintf(buffer, size, HEADER_RESPONSE, "ERROR", (size_t)0);
+    }
+}
+
+ssize_t gfs_sendheader(gfcontext_t *ctx, gfstatus_t status, size_t file_len) {
+    char header[MAX_REQUEST_LEN];
+    int len;
+
+    len = gfs_format_header(header, sizeof(header), status, file_len);
+    if (status == GF_OK) {
+        ctx->file_len = file_len;
+    }
+    ctx->header_sent = 1;
+
+    return send_all(ctx->socket, header, len);
+}
+
+int gfs_detach(gfcontext_t *ctx) {
+    int socket = ctx->socket;
+
+    ctx->socket = -1;
+    return socket;
+}
+
+ssize_t gfs_send(gfcontext_t *ctx, void *data, size_t size) {
+    ssize_t n;
+
+    if ((n = send_all(ctx->socket, data, size)) > 0) {
+        ctx->bytes_transferred += n;
+    }
+
+    return n;
+}
+
+/*
+ * Sends the file with a read/send copy loop.
+ */
+static ssize_t copy_file(gfcontext_t *ctx, int fildes, off_t offset, size_t len) {
+    char buffer[COPY_BUFFER_SIZE];
+    size_t bytes_transferred = 0;
+    ssize_t read_len, write_len;
+
+    while (bytes_transferred < len) {
+        read_len = pread(fildes, buffer, len - bytes_transferred < COPY_BUFFER_SIZE ? len - bytes_transferred : COPY_BUFFER_SIZE, offset + (off_t)bytes_transferred);
+        if (read_len <= 0) {
+            return SERVER_FAILURE;
+        }
+        write_len = gfs_send(ctx, buffer, (size_t)read_len);
+        if (write_len != read_len) {
+            return SERVER_FAILURE;
+        }
+        bytes_transferred += write_len;
+    }
+
+    return (ssize_t)bytes_transferred;
+}
+
+ssize_t gfs_sendfile(gfcontext_t *ctx, int fildes, off_t offset, size_t len) {
+    size_t bytes_transferred = 0;
+    ssize_t n;
+
+    while (bytes_transferred < len) {
+        n = sendfile(ctx->socket, fildes, &offset, len - bytes_transferred);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EINVAL || errno == ENOSYS) {
+                // sendfile is not supported for this descriptor
+                if ((n = copy_file(ctx, fildes, offset, len - bytes_transferred)) < 0) {
+                    return SERVER_FAILURE;
+                }
+                return (ssize_t)(bytes_transferred + n);
+            }
+            return SERVER_FAILURE;
+        }
+        if (n == 0) {
+            // file is shorter than requested
+            return SERVER_FAILURE;
+        }
+        bytes_transferred += n;
+        ctx->bytes_transferred += n;
+    }
+
+    return (ssize_t)bytes_transferred;
+}
+
+void gfserver_init(gfserver_t *gfs, int nthreads) {
+    int i;
+
+    steque_init(&gfs->req_queue);
+    gfs->port = 8888;
+    gfs->max_npending = 10;
+    gfs->nthreads = nthreads;
+    gfs->socket_fd = -1;
+    gfs->nlisteners = 1;
+    gfs->listeners = NULL;
+    gfs->placement = TOPOLOGY_PIN_NONE;
+    gfs->npending = 0;
+    gfs->drop_factor = 0;
+    gfs->codel_target = 0;
+    gfs->queued_at = NULL;
+    gfs->nqueued_at = 0;
+    gfs->codel_first_above = 0;
+    gfs->codel_drop_next = 0;
+    gfs->codel_count = 0;
+    gfs->codel_dropping = 0;
+    gfs->reaper_epollfd = -1;
+    gfs->reaper_wakefd = -1;
+    steque_init(&gfs->lingering);
+    gfs->worker_func = NULL;
+    gfs->scheduler = GFS_SCHED_FIFO;
+
+    if ((gfs->contexts = (gfcontext_t *)calloc(nthreads, sizeof(gfcontext_t))) == NULL) {
+        perror("Unable to allocate memory");
+        exit(SERVER_FAILURE);
+    }
+    for (i = 0; i < nthreads; i++) {
+        gfs->contexts[i].gfs = gfs;
+        gfs->contexts[i].socket = -1;
+    }
+
+    pthread_mutex_init(&gfs->queue_lock, NULL);
+    pthread_mutex_init(&gfs->codel_lock, NULL);
+    pthread_mutex_init(&gfs->reaper_lock, NULL);
+    pthread_cond_init(&gfs->req_inserted, NULL);
+}
+
+void gfserver_setopt(gfserver_t *gfs, gfserver_option_t option, ...) {
+    va_list ap;
+    int index;
+
+    va_start(ap, option);
+
+    switch (option) {
+        case GFS_PORT:
+            gfs->port = (unsigned short)va_arg(ap, int);
+            break;
+        case GFS_MAXNPENDING:
+            gfs->max_npending = va_arg(ap, int);
+            break;
+        case GFS_WORKER_FUNC:
+            gfs->worker_func = va_arg(ap, ssize_t (*)(gfcontext_t *, char *, void *));
+            break;
+        case GFS_WORKER_ARG:
+            index = va_arg(ap, int);
+            if (index >= 0 && index < gfs->nthreads) {
+                gfs->contexts[index].arg = va_arg(ap, void *);
+            }
+            break;
+        case GFS_SCHEDULER:
+            gfs->scheduler = va_arg(ap, int);
+            break;
+        case GFS_DROP_FACTOR:
+            gfs->drop_factor = va_arg(ap, int);
+            break;
+        case GFS_CODEL_TARGET:
+            gfs->codel_target = va_arg(ap, long);
+            break;
+        case GFS_PLACEMENT:
+            gfs->placement = va_arg(ap, int);
+            break;
+        case GFS_LISTENERS:
+            gfs->nlisteners = va_arg(ap, int);
+            if (gfs->nlisteners < 1) {
+                gfs->nlisteners = 1;
+            }
+            break;
+    }
+
+    va_end(ap);
+}
+
+/*
+ * Reads until the end of the request header.  Returns the request length
+ * or -1 if the client went away first.
+ */
+static int get_request(gfcontext_t *ctx) {
+    size_t request_size = 0;
+    ssize_t n;
+
+    while (request_size < MAX_REQUEST_LEN - 1) {
+        n = recv(ctx->socket, ctx->request + request_size, MAX_REQUEST_LEN - 1 - request_size, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+
+        request_size += n;
+        ctx->request[request_size] = '\0';
+        if (strstr(ctx->request, END_OF_REQUEST) != NULL) {
+            return (int)request_size;
+        }
+    }
+
+    return (int)request_size;
+}
+
+/*
+ * Splits <scheme> <method> <path>\r\n\r\n into the context.  Returns 0
+ * if the request is valid.
+ */
+static int parse_request(gfcontext_t *ctx) {
+    char *saveptr;
+
+    ctx->protocol = strtok_r(ctx->request, " \t", &saveptr);
+    if (ctx->protocol == NULL || strcmp(ctx->protocol, SCHEME) != 0) {
+        return -1;
+    }
+
+    ctx->method = strtok_r(NULL, " \t", &saveptr);
+    if (ctx->method == NULL || strcmp(ctx->method, METHOD_GET) != 0) {
+        return -1;
+    }
+
+    ctx->path = strtok_r(NULL, " \t\r\n", &saveptr);
+    if (ctx->path == NULL || ctx->path[0] != '/') {
+        return -1;
+    }
+
+    return 0;
+}
+
+static void serve_connection(gfcontext_t *ctx) {
+    gfserver_t *gfs = ctx->gfs;
+
+    ctx->header_sent = 0;
+    ctx->file_len = 0;
+    ctx->bytes_transferred = 0;
+
+    if (get_request(ctx) < 0) {
+        return;
+    }
+
+    if (parse_request(ctx) < 0) {
+        gfs_sendheader(ctx, GF_FILE_NOT_FOUND, 0);
+        return;
+    }
+
+    if (gfs->worker_func(ctx, ctx->path, ctx->arg) < 0 && ctx->socket >= 0) {
+        fprintf(stderr, "handler reported an error.\n");
+        // after a header, an ERROR would read as part of the body, the caller closes instead
+        if (!ctx->header_sent) {
+            gfs_sendheader(ctx, GF_ERROR, 0);
+        }
+    }
+}
+
+static uint64_t now_usec(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+/*
+ * Answers a connection that is not admitted with GETFILE ERROR and hands
+ * it to the reaper.  Closing with unread data resets the connection, which
+ * can discard the header before the client reads it, so the request is
+ * drained there, not here, until the client closes or REJECT_LINGER passes.
+ */
+static void reject_connection(gfserver_t *gfs, int socket) {
+    char header[HEADER_MAX_LEN];
+    int len = gfs_format_header(header, sizeof(header), GF_ERROR, 0);
+    struct epoll_event ev;
+    lingering_t *linger;
+    uint64_t one = 1;
+    int was_empty;
+
+    send(socket, header, (size_t)len, MSG_NOSIGNAL | MSG_DONTWAIT);
+    shutdown(socket, SHUT_WR);
+
+    if (gfs->reaper_epollfd < 0 || (linger = (lingering_t *)malloc(sizeof(lingering_t))) == NULL) {
+        close(socket);
+        return;
+    }
+    linger->socket = socket;
+    linger->deadline = now_usec() + REJECT_LINGER;
+
+    pthread_mutex_lock(&gfs->reaper_lock);
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.ptr = linger;
+    if (epoll_ctl(gfs->reaper_epollfd, EPOLL_CTL_ADD, socket, &ev) < 0) {
+        pthread_mutex_unlock(&gfs->reaper_lock);
+        close(socket);
+        free(linger);
+        return;
+    }
+    // every connection lingers as long, so the queue is in deadline order
+    was_empty = steque_isempty(&gfs->lingering);
+    steque_enqueue(&gfs->lingering, (steque_item)linger);
+    pthread_mutex_unlock(&gfs->reaper_lock);
+
+    // a reaper without deadlines sleeps until something happens
+    if (was_empty && write(gfs->reaper_wakefd, &one, sizeof(one)) < 0) {
+        perror("Unable to wake the reaper");
+    }
+}
+
+/*
+ * Drains rejected connections and closes each once its client closes,
+ * or once its deadline passes.
+ */
+static void *reaper_main(void *arg) {
+    gfserver_t *gfs = (gfserver_t *)arg;
+    struct epoll_event events[REAPER_EVENTS];
+    char discard[MAX_REQUEST_LEN];
+    lingering_t *linger;
+    uint64_t now, wakeups;
+    int timeout, nready, i;
+    ssize_t n;
+
+    for ( ; ; ) {
+        timeout = -1;
+        now = now_usec();
+        pthread_mutex_lock(&gfs->reaper_lock);
+        while (!steque_isempty(&gfs->lingering)) {
+            linger = (lingering_t *)steque_front(&gfs->lingering);
+            if (linger->deadline > now) {
+                timeout = (int)((linger->deadline - now + 999) / 1000);
+                break;
+            }
+            steque_pop(&gfs->lingering);
+            if (linger->socket >= 0) {
+                close(linger->socket);
+            }
+            free(linger);
+        }
+        pthread_mutex_unlock(&gfs->reaper_lock);
+
+        if ((nready = epoll_wait(gfs->reaper_epollfd, events, REAPER_EVENTS, timeout)) < 0) {
+            continue;
+        }
+
+        for (i = 0; i < nready; i++) {
+            // a NULL data pointer marks the wakeup descriptor
+            if (events[i].data.ptr == NULL) {
+                if (read(gfs->reaper_wakefd, &wakeups, sizeof(wakeups)) < 0 && errno != EAGAIN) {
+                    perror("Unable to read the reaper wakeup");
+                }
+                continue;
+            }
+
+            linger = (lingering_t *)events[i].data.ptr;
+            while ((n = recv(linger->socket, discard, sizeof(discard), MSG_DONTWAIT)) > 0);
+            // the client closed or the connection broke, there is nothing left to reset
+            if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+                close(linger->socket);
+                // the entry leaves the queue at its deadline
+                linger->socket = -1;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Starts the reaper of rejected connections.
+ */
+static void start_reaper(gfserver_t *gfs) {
+    struct epoll_event ev;
+    pthread_t thread;
+
+    if ((gfs->reaper_epollfd = epoll_create1(0)) < 0 || (gfs->reaper_wakefd = eventfd(0, EFD_NONBLOCK)) < 0) {
+        perror("Unable to create the reaper");
+        exit(SERVER_FAILURE);
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(gfs->reaper_epollfd, EPOLL_CTL_ADD, gfs->reaper_wakefd, &ev) < 0 || pthread_create(&thread, NULL, reaper_main, gfs) != 0) {
+        perror("Unable to start the reaper");
+        exit(SERVER_FAILURE);
+    }
+    pthread_detach(thread);
+}
+
+/* Integer square root, for the CoDel control law */
+static uint64_t isqrt(uint64_t value) {
+    uint64_t root = value, next;
+
+    if (value < 2) {
+        return value;
+    }
+    while ((next = (root + value / root) / 2) < root) {
+        root = next;
+    }
+    return root;
+}
+
+/*
+ * CoDel on the connections leaving the queue.  Returns 1 if the
+ * connection, which waited sojourn microseconds, should be shed.
+ */
+static int codel_should_drop(gfserver_t *gfs, uint64_t sojourn, uint64_t now) {
+    int ok_to_drop = 0, drop = 0;
+
+    pthread_mutex_lock(&gfs->codel_lock);
+
+    // the delay has to stay above the target for a whole interval
+    if (sojourn < (uint64_t)gfs->codel_target) {
+        gfs->codel_first_above = 0;
+    } else if (gfs->codel_first_above == 0) {
+        gfs->codel_first_above = now + CODEL_INTERVAL;
+    } else if (now >= gfs->codel_first_above) {
+        ok_to_drop = 1;
+    }
+
+    if (gfs->codel_dropping) {
+        if (!ok_to_drop) {
+            gfs->codel_dropping = 0;
+        } else if (now >= gfs->codel_drop_next) {
+            // shed faster the longer the queue stays too slow
+            drop = 1;
+            gfs->codel_count++;
+            gfs->codel_drop_next += CODEL_INTERVAL / isqrt(gfs->codel_count);
+        }
+    } else if (ok_to_drop) {
+        drop = 1;
+        gfs->codel_dropping = 1;
+        // resume near the previous rate if the last dropping state was recent
+        gfs->codel_count = gfs->codel_count > 2 && now - gfs->codel_drop_next < 8 * CODEL_INTERVAL ? gfs->codel_count - 2 : 1;
+        gfs->codel_drop_next = now + CODEL_INTERVAL / isqrt(gfs->codel_count);
+    }
+
+    pthread_mutex_unlock(&gfs->codel_lock);
+
+    return drop;
+}
+
+/*
+ * Accounts for a connection a worker took off the queue.  Returns 0 if
+ * the worker should serve it, or -1 if it was shed.
+ */
+static int admit_connection(gfserver_t *gfs, int socket) {
+    uint64_t now;
+
+    __atomic_fetch_sub(&gfs->npending, 1, __ATOMIC_RELAXED);
+
+    if (gfs->codel_target <= 0 || socket >= gfs->nqueued_at) {
+        return 0;
+    }
+
+    now = now_usec();
+    if (codel_should_drop(gfs, now - gfs->queued_at[socket], now)) {
+        reject_connection(gfs, socket);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void *worker_main(void *arg) {
+    gfcontext_t *ctx = (gfcontext_t *)arg;
+    gfserver_t *gfs = ctx->gfs;
+    int index = (int)(ctx - gfs->contexts);
+    gfcontext_t *local;
+
+    // a pinned worker touches a copy of its context first, which puts it on its node
+    if (gfs->placement != TOPOLOGY_PIN_NONE && posix_memalign((void **)&local, MPMCQ_CACHELINE, sizeof(gfcontext_t)) == 0) {
+        memcpy(local, ctx, sizeof(gfcontext_t));
+        local->thread = pthread_self();
+        ctx = local;
+    }
+
+    for ( ; ; ) {
+        if (gfs->scheduler != GFS_SCHED_FIFO) {
+            ctx->socket = (int)(intptr_t)wsched_next(&gfs->sched, index);
+        } else {
+            pthread_mutex_lock(&gfs->queue_lock);
+            while (steque_isempty(&gfs->req_queue)) {
+                pthread_cond_wait(&gfs->req_inserted, &gfs->queue_lock);
+            }
+            ctx->socket = (int)(intptr_t)steque_pop(&gfs->req_queue);
+            pthread_mutex_unlock(&gfs->queue_lock);
+        }
+
+        if (admit_connection(gfs, ctx->socket) < 0) {
+            ctx->socket = -1;
+            continue;
+        }
+
+        serve_connection(ctx);
+
+        // the handler may have taken the connection with gfs_detach
+        if (ctx->socket >= 0) {
+            close(ctx->socket);
+            ctx->socket = -1;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Creates, binds and listens on the socket of a listener.
+ */
+static void open_listener(gfserver_t *gfs, gflistener_t *listener) {
+    struct sockaddr_in serv_addr;
+    int optval = 1;
+
+    listener->gfs = gfs;
+    if ((listener->fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        perror("Unable to create the socket");
+        exit(SERVER_FAILURE);
+    }
+
+    setsockopt(listener->fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+
+    // every listener binds to the same port
+    if (gfs->nlisteners > 1 && setsockopt(listener->fd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) < 0) {
+        perror("Unable to share the port between listeners");
+        exit(SERVER_FAILURE);
+    }
+
+    memset(&serv_addr, 0, sizeof(serv_addr));
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    serv_addr.sin_port = htons(gfs->port);
+
+    if (bind(listener->fd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
+        fprintf(stderr, "failed to bind; port = %d\n", gfs->port);
+        exit(SERVER_FAILURE);
+    }
+
+    if (listen(listener->fd, gfs->max_npending) < 0) {
+        perror("Error listening to maximum pending connections");
+        exit(SERVER_FAILURE);
+    }
+}
+
+/*
+ * Boss of one listener: queues every connection it accepts until
+ * gfserver_stop closes its socket.
+ */
+static void *accept_loop(void *arg) {
+    gflistener_t *listener = (gflistener_t *)arg;
+    gfserver_t *gfs = listener->gfs;
+    int client_fd;
+
+    for ( ; ; ) {
+        if ((client_fd = accept(listener->fd, NULL, NULL)) < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            // gfserver_stop closed the listening socket
+            break;
+        }
+
+        // shed load at the door while the workers are too far behind
+        if (gfs->drop_factor > 0 && __atomic_load_n(&gfs->npending, __ATOMIC_RELAXED) >= (long)gfs->drop_factor * gfs->nthreads) {
+            reject_connection(gfs, client_fd);
+            continue;
+        }
+
+        if (client_fd < gfs->nqueued_at) {
+            gfs->queued_at[client_fd] = now_usec();
+        }
+        __atomic_fetch_add(&gfs->npending, 1, __ATOMIC_RELAXED);
+
+        if (gfs->scheduler != GFS_SCHED_FIFO) {
+            wsched_submit(&gfs->sched, (steque_item)(intptr_t)client_fd);
+            continue;
+        }
+
+        pthread_mutex_lock(&gfs->queue_lock);
+        steque_enqueue(&gfs->req_queue, (steque_item)(intptr_t)client_fd);
+        pthread_mutex_unlock(&gfs->queue_lock);
+
+        pthread_cond_signal(&gfs->req_inserted);
+    }
+
+    return NULL;
+}
+
+void gfserver_serve(gfserver_t *gfs) {
+    pthread_attr_t attr;
+    pthread_t thread;
+    cpu_set_t cpus;
+    int i;
+
+    // sendfile cannot pass MSG_NOSIGNAL, a client leaving mid-body must not end the server
+    signal(SIGPIPE, SIG_IGN);
+
+    if ((gfs->listeners = (gflistener_t *)calloc(gfs->nlisteners, sizeof(gflistener_t))) == NULL) {
+        perror("Unable to allocate memory");
+        exit(SERVER_FAILURE);
+    }
+
+    for (i = 0; i < gfs->nlisteners; i++) {
+        open_listener(gfs, &gfs->listeners[i]);
+    }
+
+    // any descriptor may be queued, so size the timestamps by the limit
+    if (gfs->codel_target > 0) {
+        struct rlimit limit;
+
+        gfs->nqueued_at = getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY ? (int)limit.rlim_cur : 65536;
+        if ((gfs->queued_at = (uint64_t *)calloc(gfs->nqueued_at, sizeof(uint64_t))) == NULL) {
+            perror("Unable to allocate memory");
+            exit(SERVER_FAILURE);
+        }
+    }
+    gfs->socket_fd = gfs->listeners[0].fd;
+
+    // shed connections are drained off the accept and worker threads
+    if (gfs->drop_factor > 0 || gfs->codel_target > 0) {
+        start_reaper(gfs);
+    }
+
+    if (gfs->scheduler != GFS_SCHED_FIFO) {
+        wsched_init(&gfs->sched, gfs->nthreads, gfs->scheduler == GFS_SCHED_WS_LEAST_LOADED ? WSCHED_LEAST_LOADED : WSCHED_ROUND_ROBIN);
+    }
+
+    // worker i goes to node i modulo the number of nodes
+    for (i = 0; i < gfs->nthreads; i++) {
+        pthread_attr_init(&attr);
+        if (topology_placement(gfs->placement, i % topology_nnodes(), i / topology_nnodes(), &cpus) == 0) {
+            pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+        }
+        if (pthread_create(&gfs->contexts[i].thread, &attr, worker_main, &gfs->contexts[i]) != 0) {
+            fprintf(stderr, "Error creating thread\n");
+            exit(SERVER_FAILURE);
+        }
+        pthread_attr_destroy(&attr);
+    }
+
+    for (i = 1; i < gfs->nlisteners; i++) {
+        pthread_attr_init(&attr);
+        if (gfs->placement != TOPOLOGY_PIN_NONE && topology_placement(TOPOLOGY_PIN_NODE, i, 0, &cpus) == 0) {
+            pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+        }
+        if (pthread_create(&thread, &attr, accept_loop, &gfs->listeners[i]) != 0) {
+            fprintf(stderr, "Error creating thread\n");
+            exit(SERVER_FAILURE);
+        }
+        pthread_attr_destroy(&attr);
+        pthread_detach(thread);
+    }
+
+    // the calling thread is the boss of the first listener
+    if (gfs->placement != TOPOLOGY_PIN_NONE && topology_placement(TOPOLOGY_PIN_NODE, 0, 0, &cpus) == 0) {
+        pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    }
+    accept_loop(&gfs->listeners[0]);
+}
+
+void gfserver_stop(gfserver_t *gfs) {
+    int i;
+
+    if (gfs->listeners != NULL) {
+        for (i = 0; i < gfs->nlisteners; i++) {
+            if (gfs->listeners[i].fd >= 0) {
+                close(gfs->listeners[i].fd);
+                gfs->listeners[i].fd = -1;
+            }
+        }
+    }
+    gfs->socket_fd = -1;
+}
@@ -2,7 +2,10 @@
 #define __GETFILE_SERVER_H__
 
 #include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
 #include "steque.h"
+#include "wsched.h"
 
 #define MAX_REQUEST_LEN 128
 
@@ -18,6 +21,7 @@ typedef int gfstatus_t;
 
 typedef struct _gfserver_t gfserver_t;
 typedef struct _gfcontext_t gfcontext_t;
+typedef struct _gflistener_t gflistener_t;
 
 struct _gfserver_t{
 	steque_t req_queue;
@@ -25,12 +29,36 @@ struct _gfserver_t{
 	int max_npending;
 	int nthreads;
 	int socket_fd;
+	int nlisteners;
+	gflistener_t *listeners;
+	int placement;
+
+	/* admission control, see GFS_DROP_FACTOR and GFS_CODEL_TARGET */
+	long npending;
+	int drop_factor;
+	long codel_target;
+	/* when each connection was queued, indexed by descriptor */
+	uint64_t *queued_at;
+	int nqueued_at;
+	pthread_mutex_t codel_lock;
+	uint64_t codel_first_above;
+	uint64_t codel_drop_next;
+	unsigned int codel_count;
+	int codel_dropping;
+	/* rejected connections waiting for their client to close, -1 if unused */
+	int reaper_epollfd;
+	int reaper_wakefd;
+	pthread_mutex_t reaper_lock;
+	steque_t lingering;
 
 	ssize_t (*worker_func)(gfcontext_t *, char *, void*);
 
 	gfcontext_t *contexts;
 	pthread_mutex_t queue_lock;
 	pthread_cond_t req_inserted;
+
+	int scheduler;
+	wsched_t sched;
 };
 
 struct _gfcontext_t{
@@ -39,6 +67,8 @@ struct _gfcontext_t{
 	gfserver_t *gfs;
 
 	int socket;
+	/* a response header went out, an error can only close the connection */
+	int header_sent;
 	size_t file_len;
 	size_t bytes_transferred;
 
@@ -52,9 +82,19 @@ typedef enum{
   GFS_PORT,
   GFS_MAXNPENDING,
   GFS_WORKER_FUNC,
-  GFS_WORKER_ARG
+  GFS_WORKER_ARG,
+  GFS_SCHEDULER,
+  GFS_LISTENERS,
+  GFS_PLACEMENT,
+  GFS_DROP_FACTOR,
+  GFS_CODEL_TARGET
 } gfserver_option_t;
 
+/* Values for the GFS_SCHEDULER option */
+#define GFS_SCHED_FIFO 0
+#define GFS_SCHED_WS_ROUND_ROBIN 1
+#define GFS_SCHED_WS_LEAST_LOADED 2
+
 /* 
  * Initializes the input gfserver_t object to use nthreads.
  */
@@ -87,9 +127,10 @@ void gfserver_init(gfserver_t *gfh, int nthreads);
  *
  *						Returning a negative number will cause the 
  *						gfserver library to send an error message to the
- *						client.  Otherwise, gfserver will assume that
- *						this function has performed all the necessary 
- *						communication.
+ *						client, or to close the connection if a header
+ *						was sent already.  Otherwise, gfserver will
+ *						assume that this function has performed all the
+ *						necessary communication.
  *
  *
  * GFS_WORKER_ARG		This option is followed by two arguments, an int
@@ -97,6 +138,47 @@ void gfserver_init(gfserver_t *gfh, int nthreads);
  * 						a pointer which will be passed into the callback
  * 						registered via the GFS_WORKER_FUNC option on this 
  *						thread.
+ *
+ * GFS_SCHEDULER		int selecting how accepted connections reach the
+ *						workers. GFS_SCHED_FIFO (the default) shares
+ *						req_queue between all workers. The work-stealing
+ *						schedulers give each worker its own deque and
+ *						place connections round robin
+ *						(GFS_SCHED_WS_ROUND_ROBIN) or on the least loaded
+ *						worker (GFS_SCHED_WS_LEAST_LOADED); idle workers
+ *						steal from their peers.
+ *
+ * GFS_LISTENERS		int indicating the number of listening sockets.
+ *						With more than one (the default is 1), every socket
+ *						is bound to GFS_PORT with SO_REUSEPORT and has
+ *						an accept loop on a thread of its own, so the
+ *						kernel spreads new connections across them.
+ *						All of them feed the same workers.
+ *
+ * GFS_PLACEMENT		int, one of the TOPOLOGY_PIN_* policies of
+ *						topology.h.  Worker i is then pinned to NUMA
+ *						node i modulo the number of nodes, to a core of
+ *						its own (TOPOLOGY_PIN_CORE) or to any CPU of the
+ *						node (TOPOLOGY_PIN_NODE), and moves its context
+ *						into memory of that node.  Listener i is pinned
+ *						to node i the same way.  The default,
+ *						TOPOLOGY_PIN_NONE, lets every thread float.
+ *
+ * GFS_DROP_FACTOR		int f.  While f * nthreads accepted connections
+ *						wait for a worker, new connections are answered
+ *						with GETFILE ERROR by the acceptor and handed
+ *						to a reaper thread, which closes them once the
+ *						client does or after 10 ms, without reaching a
+ *						worker.  0 (the default) admits every
+ *						connection.
+ *
+ * GFS_CODEL_TARGET		long, a queueing delay in microseconds.  Once
+ *						connections have waited longer than this for a
+ *						worker for a whole interval (100 ms), workers
+ *						answer queued connections with GETFILE ERROR
+ *						at the increasing rate of CoDel until the delay
+ *						falls below the target again.  0 (the default)
+ *						disables it.
  *						
  */
 void gfserver_setopt(gfserver_t *gfh, gfserver_option_t option, ...);
@@ -128,4 +210,31 @@ ssize_t gfs_sendheader(gfcontext_t *ctx, gfstatus_t status, size_t file_len);
  */
 ssize_t gfs_send(gfcontext_t *ctx, void *data, size_t size);
 
+/*
+ * Sends len bytes of the open file fildes, starting at offset, to the
+ * client.  The bytes go from the page cache to the socket with
+ * sendfile(2); a read/send copy loop is only used if sendfile fails.
+ * The file offset of fildes is left untouched.  This function should
+ * only be called from within a callback registered with the
+ * GFS_WORKER_FUNC option.  It returns once the data has been written
+ * to the socket.
+ */
+ssize_t gfs_sendfile(gfcontext_t *ctx, int fildes, off_t offset, size_t len);
+
+/*
+ * Formats into buffer the Getfile header gfs_sendheader would send for
+ * status and file_len.  Returns the length of the header, as snprintf.
+ */
+int gfs_format_header(char *buffer, size_t size, gfstatus_t status, size_t file_len);
+
+/*
+ * Takes the client connection away from gfserver and returns its socket.
+ * The worker then moves on to the next connection without closing it,
+ * and the caller is responsible for sending the whole response and for
+ * closing the socket.  ctx can no longer be used to send.  This function
+ * should only be called from within a callback registered with the
+ * GFS_WORKER_FUNC option.
+ */
+int gfs_detach(gfcontext_t *ctx);
+
 #endif
@@ -6,51 +6,77 @@
 #include <errno.h>
 
 #include "gfserver.h"
+#include "shm_channel.h"
 
-//Replace with an implementation of handle_with_cache and any other
-//functions you may need.
-
+/*
+ * Fetches path from simplecached through a segment of the channel passed
+ * as arg, sending every chunk to the client straight from shared memory.
+ */
 ssize_t handle_with_cache(gfcontext_t *ctx, char *path, void* arg){
-	int fildes;
-	size_t file_len, bytes_transferred;
-	ssize_t read_len, write_len;
-	char buffer[4096];
-	char *data_dir = arg;
-
-	strcpy(buffer,data_dir);
-	strcat(buffer,path);
-
-	if( 0 > (fildes = open(buffer, O_RDONLY))){
-		if (errno == ENOENT)
-			/* If the file just wasn't found, then send FILE_NOT_FOUND code*/ 
-			return gfs_sendheader(ctx, GF_FILE_NOT_FOUND, 0);
-		else
-			/* Otherwise, it must have been a server error. gfserver library will handle*/ 
-			return SERVER_FAILURE;
+	shm_channel_t *channel = arg;
+	shm_segment_t *seg;
+	size_t file_len, bytes_transferred = 0;
+	int segment;
+
+	segment = shm_channel_acquire(channel);
+	seg = channel->segments[segment];
+
+	if (0 > shm_channel_request(channel, segment, path)){
+		shm_channel_release(channel, segment);
+		return SERVER_FAILURE;
 	}
 
-	/* Calculating the file size */
-	file_len = lseek(fildes, 0, SEEK_END);
-	lseek(fildes, 0, SEEK_SET);
+	/*
+	 * If the cache does not answer in time it may still write into the
+	 * segment later, so a segment that timed out waits in quarantine.
+	 */
+	if (0 > shm_segment_wait(&seg->ready)){
+		fprintf(stderr, "handle_with_cache: no answer from the cache for %s\n", path);
+		shm_channel_quarantine(channel, segment);
+		return SERVER_FAILURE;
+	}
+
+	if (seg->status == SHM_STATUS_NOT_FOUND){
+		shm_channel_release(channel, segment);
+		return gfs_sendheader(ctx, GF_FILE_NOT_FOUND, 0);
+	}
+	if (seg->status != SHM_STATUS_OK){
+		shm_channel_release(channel, segment);
+		return SERVER_FAILURE;
+	}
 
+	file_len = seg->file_len;
 	gfs_sendheader(ctx, GF_OK, file_len);
 
-	/* Sending the file contents chunk by chunk. */
-	bytes_transferred = 0;
-	while(bytes_transferred < file_len){
-		read_len = read(fildes, buffer, 4096);
-		if (read_len <= 0){
-			fprintf(stderr, "handle_with_file read error, %zd, %zu, %zu", read_len, bytes_transferred, file_len );
+	for ( ; ; ){
+		if (gfs_send(ctx, seg->data, seg->len) != seg->len){
+			fprintf(stderr, "handle_with_cache write error\n");
+			/* the last chunk is the end of the exchange, otherwise stop the cache */
+			if (bytes_transferred + seg->len < file_len)
+				shm_channel_quarantine(channel, segment);
+			else
+				shm_channel_release(channel, segment);
 			return SERVER_FAILURE;
 		}
-		write_len = gfs_send(ctx, buffer, read_len);
-		if (write_len != read_len){
-			fprintf(stderr, "handle_with_file write error");
+
+		bytes_transferred += seg->len;
+		if (bytes_transferred >= file_len)
+			break;
+
+		/* hand the segment back for the next chunk */
+		sem_post(&seg->consumed);
+		if (0 > shm_segment_wait(&seg->ready)){
+			fprintf(stderr, "handle_with_cache: the cache stopped sending %s\n", path);
+			shm_channel_quarantine(channel, segment);
+			return SERVER_FAILURE;
+		}
+		if (seg->status != SHM_STATUS_OK){
+			shm_channel_release(channel, segment);
 			return SERVER_FAILURE;
 		}
-		bytes_transferred += write_len;
 	}
 
+	shm_channel_release(channel, segment);
+
 	return bytes_transferred;
 }
-
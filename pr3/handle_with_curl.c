@@ -4,99 +4,296 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include "gfserver.h"
-
-//Replace with an implementation of handle_with_curl and any other
-//functions you may need.
+#include "handle_with_curl.h"
 
 typedef struct memory_struct_t {
     char *memory;
     size_t size;
+    size_t capacity;
 } memory_struct_t;
 
-static size_t write_memory_callback(void *contents, size_t size, size_t nmemb, void *userp) {
-    size_t realsize = size * nmemb;
-    memory_struct_t *mem = (memory_struct_t *)userp;
+/* State of one upstream transfer, shared with the write callback */
+typedef struct transfer_t {
+    CURL *curl;
+    gfcontext_t *ctx;
+    /* set by the first chunk */
+    int started;
+    /* the response is not a 200, its body is dropped */
+    int discard;
+    /* the GETFILE header went out and chunks are forwarded as they come */
+    int streaming;
+    size_t length;
+    size_t sent;
+    /* the body is also kept in memory */
+    int keep;
+    /* largest body kept for the caller, 0 when it wants none */
+    size_t keep_limit;
+    memory_struct_t body;
+} transfer_t;
+
+static size_t write_callback(void *contents, size_t size, size_t nmemb, void *userp);
+
+/* One lock per kind of data in the share object */
+static pthread_mutex_t share_locks[CURL_LOCK_DATA_LAST];
+
+static void share_lock(CURL *handle, curl_lock_data data, curl_lock_access access, void *userp) {
+    pthread_mutex_lock(&share_locks[data]);
+}
+
+static void share_unlock(CURL *handle, curl_lock_data data, void *userp) {
+    pthread_mutex_unlock(&share_locks[data]);
+}
+
+CURLSH *curl_arg_share_init() {
+    CURLSH *share;
+    int i;
+
+    if ((share = curl_share_init()) == NULL)
+        return NULL;
+
+    for (i = 0; i < CURL_LOCK_DATA_LAST; i++)
+        pthread_mutex_init(&share_locks[i], NULL);
+
+    curl_share_setopt(share, CURLSHOPT_LOCKFUNC, share_lock);
+    curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, share_unlock);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+
+    return share;
+}
+
+void curl_arg_share_cleanup(CURLSH *share) {
+    int i;
+
+    curl_share_cleanup(share);
+    for (i = 0; i < CURL_LOCK_DATA_LAST; i++)
+        pthread_mutex_destroy(&share_locks[i]);
+}
+
+void curl_arg_init(curl_arg_t *curl_arg, char *server, objcache_t *cache, CURLSH *share, int nworkers) {
+    curl_arg->server = server;
+    curl_arg->cache = cache;
 
-    mem->memory = realloc(mem->memory, mem->size + realsize + 1);
+    if ((curl_arg->curl = curl_easy_init()) == NULL) {
+        fprintf(stderr, "curl_easy_init() failed\n");
+        exit(SERVER_FAILURE);
+    }
+
+    // follow redirect
+    curl_easy_setopt(curl_arg->curl, CURLOPT_FOLLOWLOCATION, 1L);
+    // provide callback function
+    curl_easy_setopt(curl_arg->curl, CURLOPT_WRITEFUNCTION, write_callback);
+    if (share) {
+        curl_easy_setopt(curl_arg->curl, CURLOPT_SHARE, share);
+        // the pool is pruned to this size, below one per worker it churns
+        curl_easy_setopt(curl_arg->curl, CURLOPT_MAXCONNECTS, (long)nworkers);
+    }
+}
+
+void curl_arg_cleanup(curl_arg_t *curl_arg) {
+    curl_easy_cleanup(curl_arg->curl);
+    curl_arg->curl = NULL;
+}
+
+static int append_memory(memory_struct_t *mem, void *contents, size_t realsize) {
+    size_t capacity = mem->capacity ? mem->capacity : 4096;
+    char *memory;
 
-    if (mem->memory == NULL) {
-        // out of memory!
-        printf("not enough memory (realloc returned NULL)\n");
-        return SERVER_FAILURE;
+    if (mem->size + realsize > mem->capacity) {
+        while (capacity < mem->size + realsize)
+            capacity *= 2;
+        if ((memory = realloc(mem->memory, capacity)) == NULL) {
+            // out of memory!
+            printf("not enough memory (realloc returned NULL)\n");
+            return -1;
+        }
+        mem->memory = memory;
+        mem->capacity = capacity;
     }
 
     memcpy(&(mem->memory[mem->size]), contents, realsize);
     mem->size += realsize;
-    mem->memory[mem->size] = 0;
+
+    return 0;
+}
+
+static size_t write_callback(void *contents, size_t size, size_t nmemb, void *userp) {
+    size_t realsize = size * nmemb;
+    transfer_t *transfer = (transfer_t *)userp;
+    long http_code = 0;
+    curl_off_t length = -1;
+
+    if (!transfer->started) {
+        transfer->started = 1;
+
+        curl_easy_getinfo(transfer->curl, CURLINFO_RESPONSE_CODE, &http_code);
+        if (http_code != 200) {
+            transfer->discard = 1;
+        } else {
+            curl_easy_getinfo(transfer->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+            if (length >= 0) {
+                // the length is known up front, no need to wait for the body
+                transfer->length = (size_t)length;
+                transfer->streaming = 1;
+                gfs_sendheader(transfer->ctx, GF_OK, transfer->length);
+                if (transfer->length > 0 && transfer->length <= transfer->keep_limit) {
+                    if ((transfer->body.memory = malloc(transfer->length)) == NULL)
+                        return 0;
+                    transfer->body.capacity = transfer->length;
+                    transfer->keep = 1;
+                }
+            } else {
+                // no Content-Length, the body has to be buffered to learn it
+                transfer->keep = 1;
+            }
+        }
+    }
+
+    if (transfer->discard)
+        return realsize;
+
+    if (transfer->streaming) {
+        if (transfer->sent + realsize > transfer->length) {
+            fprintf(stderr, "handle_with_curl: server sent more than its Content-Length\n");
+            return 0;
+        }
+        if (gfs_send(transfer->ctx, contents, realsize) != realsize) {
+            fprintf(stderr, "handle_with_curl write error\n");
+            return 0;
+        }
+        transfer->sent += realsize;
+    }
+
+    if (transfer->keep && append_memory(&transfer->body, contents, realsize) < 0)
+        return 0;
 
     return realsize;
 }
 
-ssize_t handle_with_curl(gfcontext_t *ctx, char *path, void* arg){
+static ssize_t send_response(gfcontext_t *ctx, char *data, size_t size) {
     size_t bytes_transferred = 0;
     ssize_t write_len;
-    char buffer[4096];
-    char *data_dir = arg;
-    CURL *curl;
+
+    // sending the header
+    gfs_sendheader(ctx, GF_OK, size);
+
+    /* Sending the file contents chunk by chunk. */
+    while (bytes_transferred < size) {
+        write_len = gfs_send(ctx, data + bytes_transferred, size - bytes_transferred);
+        if (write_len <= 0) {
+            fprintf(stderr, "handle_with_curl write error\n");
+            return SERVER_FAILURE;
+        }
+        bytes_transferred += write_len;
+    }
+
+    return bytes_transferred;
+}
+
+/*
+ * Fetches url and forwards the response to ctx.  A body whose length the
+ * server announces is streamed to the client chunk by chunk as curl
+ * receives it; otherwise it is buffered first.
+ *
+ * If copy is not NULL and the body is at most keep_limit bytes, it is
+ * also returned there in memory from malloc.  status is set to what a
+ * cache should record for url, OBJCACHE_ERROR when there is nothing to
+ * share with other requests.
+ */
+static ssize_t proxy_url(gfcontext_t *ctx, CURL *curl, char *url, memory_struct_t *copy, size_t keep_limit, int *status) {
+    transfer_t transfer;
     CURLcode res;
     long http_code = 0;
+    ssize_t bytes_transferred;
 
-    memory_struct_t response;
-    response.memory = NULL;
-    response.size = 0;
-
-    strcpy(buffer,data_dir);
-    strcat(buffer,path);
+    memset(&transfer, 0, sizeof(transfer));
+    transfer.curl = curl;
+    transfer.ctx = ctx;
+    transfer.keep_limit = copy ? keep_limit : 0;
+    if (copy) {
+        copy->memory = NULL;
+        copy->size = 0;
+    }
 
-    curl = curl_easy_init();
+    curl_easy_setopt(curl, CURLOPT_URL, url);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&transfer);
+    // Perform the request, res will get the return code
+    res = curl_easy_perform(curl);
 
-    if (curl) {
-        curl_easy_setopt(curl, CURLOPT_URL, buffer);
-        // follow redirect
-        curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
-        // provide callback function
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_memory_callback);
-        // write to variable response
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&response);
+    // check for errors
+    if (res != CURLE_OK) {
+        fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
+    }
 
-        // Perform the request, res will get the return code
-        res = curl_easy_perform(curl);
+    // get http_code
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
 
-        // check for errors
-        if (res != CURLE_OK) {
-            fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
+    if (transfer.streaming) {
+        if (res != CURLE_OK || transfer.sent != transfer.length) {
+            // the header is gone already, gfserver closes the connection short of the length
+            free(transfer.body.memory);
+            *status = OBJCACHE_ERROR;
+            return SERVER_FAILURE;
         }
+        bytes_transferred = transfer.sent;
+    } else if (res != CURLE_OK || http_code != 200) {
+        // if http_code is not 200, then send FILE_NOT_FOUND
+        free(transfer.body.memory);
+        *status = http_code != 0 && http_code != 200 ? OBJCACHE_NOT_FOUND : OBJCACHE_ERROR;
+        return gfs_sendheader(ctx, GF_FILE_NOT_FOUND, 0);
+    } else {
+        // buffered, or a 200 without a body
+        bytes_transferred = send_response(ctx, transfer.body.memory, transfer.body.size);
+    }
 
-        // get http_code
-        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+    if (copy && (transfer.keep || !transfer.streaming) && transfer.body.size <= keep_limit) {
+        copy->memory = transfer.body.memory;
+        copy->size = transfer.body.size;
+        *status = OBJCACHE_OK;
+    } else {
+        free(transfer.body.memory);
+        *status = OBJCACHE_ERROR;
+    }
 
-        if (http_code != 200) {
-            // if http_code is not 200, then send FILE_NOT_FOUND
-            return gfs_sendheader(ctx, GF_FILE_NOT_FOUND, 0);
-        }
+    return bytes_transferred;
+}
 
-        // sending the header
-        gfs_sendheader(ctx, GF_OK, response.size);
+ssize_t handle_with_curl(gfcontext_t *ctx, char *path, void* arg){
+    curl_arg_t *curl_arg = arg;
+    objcache_entry_t *entry;
+    char buffer[4096];
+    ssize_t bytes_transferred;
+    int status, fetch;
 
-        /* Sending the file contents chunk by chunk. */
-        bytes_transferred = 0;
-        while (bytes_transferred < response.size) {
-            write_len = gfs_send(ctx, response.memory, response.size);
-            if (write_len != response.size) {
-                fprintf(stderr, "handle_with_curl write error");
-                return SERVER_FAILURE;
-            }
-            bytes_transferred += write_len;
-        }
+    memory_struct_t response;
 
-        // clean up curl
-        curl_easy_cleanup(curl);
+    strcpy(buffer, curl_arg->server);
+    strcat(buffer, path);
 
-        free(response.memory);
+    if (curl_arg->cache == NULL)
+        return proxy_url(ctx, curl_arg->curl, buffer, NULL, 0, &status);
+
+    /* Only the first of concurrent misses for a URL goes to the server */
+    entry = objcache_get(curl_arg->cache, buffer, &fetch);
+    if (fetch) {
+        bytes_transferred = proxy_url(ctx, curl_arg->curl, buffer, &response, curl_arg->cache->budget, &status);
+        objcache_fill(curl_arg->cache, entry, status, response.memory, response.size);
+        objcache_release(curl_arg->cache, entry);
+        return bytes_transferred;
     }
 
+    if (entry->status == OBJCACHE_OK)
+        bytes_transferred = send_response(ctx, entry->data, entry->len);
+    else if (entry->status == OBJCACHE_NOT_FOUND)
+        bytes_transferred = gfs_sendheader(ctx, GF_FILE_NOT_FOUND, 0);
+    else // too large to keep or failed, fetch it again
+        bytes_transferred = proxy_url(ctx, curl_arg->curl, buffer, NULL, 0, &status);
+
+    objcache_release(curl_arg->cache, entry);
+
     return bytes_transferred;
 }
-
@@ -0,0 +1,36 @@
+#ifndef __HANDLE_WITH_CURL_H__
+#define __HANDLE_WITH_CURL_H__
+
+#include <curl/curl.h>
+
+#include "gfserver.h"
+#include "objcache.h"
+
+/* Worker argument of handle_with_curl, one per worker thread */
+typedef struct curl_arg_t {
+    char *server;
+    /* easy handle kept across the requests of this worker */
+    CURL *curl;
+    /* responses cache, NULL to always fetch from the server */
+    objcache_t *cache;
+} curl_arg_t;
+
+ssize_t handle_with_curl(gfcontext_t *ctx, char *path, void* arg);
+
+/*
+ * Creates the share object through which the workers' handles pool their
+ * DNS cache, connection cache and TLS sessions.
+ */
+CURLSH *curl_arg_share_init();
+
+void curl_arg_share_cleanup(CURLSH *share);
+
+/*
+ * Sets up a worker argument and its easy handle.  share may be NULL,
+ * otherwise nworkers sizes the connection cache the workers share.
+ */
+void curl_arg_init(curl_arg_t *curl_arg, char *server, objcache_t *cache, CURLSH *share, int nworkers);
+
+void curl_arg_cleanup(curl_arg_t *curl_arg);
+
+#endif
@@ -9,8 +9,8 @@
 
 ssize_t handle_with_file(gfcontext_t *ctx, char *path, void* arg){
 	int fildes;
-	size_t file_len, bytes_transferred;
-	ssize_t read_len, write_len;
+	size_t file_len;
+	ssize_t bytes_transferred;
 	char buffer[4096];
 	char *data_dir = arg;
 
@@ -28,24 +28,15 @@ ssize_t handle_with_file(gfcontext_t *ctx, char *path, void* arg){
 
 	/* Calculating the file size */
 	file_len = lseek(fildes, 0, SEEK_END);
-	lseek(fildes, 0, SEEK_SET);
 
 	gfs_sendheader(ctx, GF_OK, file_len);
 
-	/* Sending the file contents chunk by chunk. */
-	bytes_transferred = 0;
-	while(bytes_transferred < file_len){
-		read_len = read(fildes, buffer, 4096);
-		if (read_len <= 0){
-			fprintf(stderr, "handle_with_file read error, %zd, %zu, %zu", read_len, bytes_transferred, file_len );
-			return SERVER_FAILURE;
-		}
-		write_len = gfs_send(ctx, buffer, read_len);
-		if (write_len != read_len){
-			fprintf(stderr, "handle_with_file write error");
-			return SERVER_FAILURE;
-		}
-		bytes_transferred += write_len;
+	/* Sending the file contents straight from the page cache. */
+	bytes_transferred = gfs_sendfile(ctx, fildes, 0, file_len);
+	close(fildes);
+	if (bytes_transferred != file_len){
+		fprintf(stderr, "handle_with_file sendfile error, %zd, %zu", bytes_transferred, file_len);
+		return SERVER_FAILURE;
 	}
 
 	return bytes_transferred;
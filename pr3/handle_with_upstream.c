@@ -0,0 +1,22 @@
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "gfserver.h"
+#include "upstream.h"
+
+/*
+ * Hands the connection over to the upstream engine passed as arg, so the
+ * worker is free again as soon as the request is parsed.
+ */
+ssize_t handle_with_upstream(gfcontext_t *ctx, char *path, void* arg){
+	upstream_t *upstream = arg;
+	int client;
+
+	client = gfs_detach(ctx);
+	if (0 > upstream_fetch(upstream, client, path)){
+		close(client);
+		return SERVER_FAILURE;
+	}
+
+	return 0;
+}
@@ -0,0 +1,58 @@
+#ifndef MPMCQ_H
+#define MPMCQ_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "steque.h"
+
+/*
+ * Bounded lock-free multi-producer/multi-consumer queue (Vyukov's ring).
+ * Items are steque_item values, so it can stand in for a steque_t used as
+ * a FIFO.  Enqueue never allocates.  Consumers that find the queue empty
+ * park on a futex instead of a mutex/condition variable pair.
+ */
+
+#define MPMCQ_CACHELINE 64
+
+typedef struct mpmcq_cell_t{
+  size_t sequence;
+  steque_item item;
+} mpmcq_cell_t;
+
+typedef struct{
+  /* producers, consumers and parked workers each get their own line */
+  size_t enqueue_pos;
+  char pad0[MPMCQ_CACHELINE - sizeof(size_t)];
+  size_t dequeue_pos;
+  char pad1[MPMCQ_CACHELINE - sizeof(size_t)];
+  uint32_t futex_seq;
+  int nwaiters;
+  char pad2[MPMCQ_CACHELINE - sizeof(uint32_t) - sizeof(int)];
+  mpmcq_cell_t* buffer;
+  size_t mask;
+}mpmcq_t;
+
+
+/* Initializes the queue; capacity is rounded up to a power of two */
+void mpmcq_init(mpmcq_t* this, size_t capacity);
+
+/* Return 1 if empty, 0 otherwise */
+int mpmcq_isempty(mpmcq_t* this);
+
+/* Returns the (approximate) number of elements in the queue */
+int mpmcq_size(mpmcq_t* this);
+
+/* Adds an element to the "back" of the queue. Returns -1 if it is full */
+int mpmcq_enqueue(mpmcq_t* this, steque_item item);
+
+/* Removes the element at the "front" into item. Returns -1 if it is empty */
+int mpmcq_trypop(mpmcq_t* this, steque_item* item);
+
+/* Removes the element at the "front", parking until one is available */
+steque_item mpmcq_pop(mpmcq_t* this);
+
+/* Frees the ring; the queue must no longer be in use */
+void mpmcq_destroy(mpmcq_t* this);
+
+#endif
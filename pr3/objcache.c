@@ -0,0 +1,189 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "objcache.h"
+
+/* 64-bit FNV-1a */
+static uint64_t hash_key(const char *key){
+	uint64_t h = 14695981039346656037ULL;
+
+	while (*key){
+		h ^= (unsigned char) *key++;
+		h *= 1099511628211ULL;
+	}
+
+	return h;
+}
+
+void objcache_init(objcache_t *cache, size_t budget){
+	cache->budget = budget;
+	cache->used = 0;
+	cache->hand = NULL;
+	cache->hits = 0;
+	cache->misses = 0;
+	cache->evictions = 0;
+
+	if (NULL == (cache->buckets = (objcache_entry_t **) calloc(OBJCACHE_BUCKETS, sizeof(objcache_entry_t *)))){
+		fprintf(stderr, "Error: unable to allocate objcache.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	pthread_mutex_init(&cache->lock, NULL);
+	pthread_cond_init(&cache->filled, NULL);
+}
+
+static void free_entry(objcache_entry_t *entry){
+	free(entry->key);
+	free(entry->data);
+	free(entry);
+}
+
+static void ring_insert(objcache_t *cache, objcache_entry_t *entry){
+	if (cache->hand == NULL){
+		entry->clock_prev = entry->clock_next = entry;
+		cache->hand = entry;
+		return;
+	}
+
+	/* just behind the hand, so it is the last one looked at */
+	entry->clock_next = cache->hand;
+	entry->clock_prev = cache->hand->clock_prev;
+	entry->clock_prev->clock_next = entry;
+	cache->hand->clock_prev = entry;
+}
+
+static void ring_remove(objcache_t *cache, objcache_entry_t *entry){
+	if (entry->clock_next == entry){
+		cache->hand = NULL;
+	} else {
+		entry->clock_prev->clock_next = entry->clock_next;
+		entry->clock_next->clock_prev = entry->clock_prev;
+		if (cache->hand == entry)
+			cache->hand = entry->clock_next;
+	}
+	entry->clock_prev = entry->clock_next = NULL;
+}
+
+/* Makes the entry unreachable; it is freed with its last reference */
+static void unlink_entry(objcache_t *cache, objcache_entry_t *entry){
+	objcache_entry_t **p = &cache->buckets[entry->hash & (OBJCACHE_BUCKETS - 1)];
+
+	while (*p != entry)
+		p = &(*p)->next;
+	*p = entry->next;
+
+	if (entry->clock_next != NULL){
+		ring_remove(cache, entry);
+		cache->used -= entry->len;
+	}
+
+	entry->linked = 0;
+	if (entry->refs == 0)
+		free_entry(entry);
+}
+
+/* Evicts objects until len more bytes fit in the budget */
+static void make_room(objcache_t *cache, size_t len){
+	objcache_entry_t *victim;
+
+	while (cache->hand != NULL && cache->used + len > cache->budget){
+		victim = cache->hand;
+		cache->hand = victim->clock_next;
+		if (victim->referenced){
+			/* second chance */
+			victim->referenced = 0;
+			continue;
+		}
+		unlink_entry(cache, victim);
+		cache->evictions++;
+	}
+}
+
+objcache_entry_t *objcache_get(objcache_t *cache, const char *key, int *fetch){
+	uint64_t h = hash_key(key);
+	objcache_entry_t *entry;
+
+	pthread_mutex_lock(&cache->lock);
+
+	for (entry = cache->buckets[h & (OBJCACHE_BUCKETS - 1)]; entry != NULL; entry = entry->next){
+		if (entry->hash == h && strcmp(entry->key, key) == 0)
+			break;
+	}
+
+	if (entry != NULL){
+		entry->refs++;
+		entry->referenced = 1;
+		cache->hits++;
+		/* coalesce with the fetch already in progress */
+		while (entry->status == OBJCACHE_PENDING)
+			pthread_cond_wait(&cache->filled, &cache->lock);
+		pthread_mutex_unlock(&cache->lock);
+		*fetch = 0;
+		return entry;
+	}
+
+	if (NULL == (entry = (objcache_entry_t *) calloc(1, sizeof(objcache_entry_t))) || NULL == (entry->key = strdup(key))){
+		fprintf(stderr, "Error: unable to allocate objcache entry.\n");
+		exit(EXIT_FAILURE);
+	}
+	entry->hash = h;
+	entry->status = OBJCACHE_PENDING;
+	entry->refs = 1;
+	entry->linked = 1;
+	entry->next = cache->buckets[h & (OBJCACHE_BUCKETS - 1)];
+	cache->buckets[h & (OBJCACHE_BUCKETS - 1)] = entry;
+	cache->misses++;
+
+	pthread_mutex_unlock(&cache->lock);
+
+	*fetch = 1;
+	return entry;
+}
+
+void objcache_fill(objcache_t *cache, objcache_entry_t *entry, int status, char *data, size_t len){
+	pthread_mutex_lock(&cache->lock);
+
+	entry->data = data;
+	entry->len = len;
+	entry->status = status;
+
+	if (status == OBJCACHE_OK && len <= cache->budget){
+		make_room(cache, len);
+		ring_insert(cache, entry);
+		cache->used += len;
+	} else {
+		/* waiters still get this answer, later callers fetch again */
+		unlink_entry(cache, entry);
+	}
+
+	pthread_cond_broadcast(&cache->filled);
+	pthread_mutex_unlock(&cache->lock);
+}
+
+void objcache_release(objcache_t *cache, objcache_entry_t *entry){
+	pthread_mutex_lock(&cache->lock);
+	if (--entry->refs == 0 && !entry->linked)
+		free_entry(entry);
+	pthread_mutex_unlock(&cache->lock);
+}
+
+void objcache_destroy(objcache_t *cache){
+	objcache_entry_t *entry, *next;
+	int i;
+
+	for (i = 0; i < OBJCACHE_BUCKETS; i++){
+		for (entry = cache->buckets[i]; entry != NULL; entry = next){
+			next = entry->next;
+			free_entry(entry);
+		}
+	}
+
+	free(cache->buckets);
+	cache->buckets = NULL;
+	cache->hand = NULL;
+	cache->used = 0;
+
+	pthread_mutex_destroy(&cache->lock);
+	pthread_cond_destroy(&cache->filled);
+}
@@ -0,0 +1,85 @@
+#ifndef _OBJCACHE_H_
+#define _OBJCACHE_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+/*
+ * Bounded in-memory object cache shared by the proxy workers.
+ *
+ * Objects are keyed by URL and charged by size against a byte budget;
+ * when a new object does not fit, CLOCK eviction drops objects that were
+ * not hit since the hand last passed them.  Entries are reference counted,
+ * so an evicted object stays valid until the last worker sending it lets
+ * go.  Concurrent misses for the same key are coalesced: the first caller
+ * fetches the object and the others wait until it is filled in.
+ */
+
+#define OBJCACHE_BUCKETS 4096
+
+/* Values for objcache_entry_t.status */
+#define OBJCACHE_PENDING 0
+#define OBJCACHE_OK 1
+#define OBJCACHE_NOT_FOUND 2
+#define OBJCACHE_ERROR 3
+
+typedef struct objcache_entry_t{
+	char *key;
+	uint64_t hash;
+	int status;
+	char *data;
+	size_t len;
+
+	int refs;
+	/* CLOCK bit, set on every hit */
+	int referenced;
+	/* still reachable from the table */
+	int linked;
+
+	struct objcache_entry_t *next;
+	struct objcache_entry_t *clock_prev;
+	struct objcache_entry_t *clock_next;
+} objcache_entry_t;
+
+typedef struct{
+	size_t budget;
+	size_t used;
+	objcache_entry_t **buckets;
+	/* ring of the cached objects, the hand points at the next candidate */
+	objcache_entry_t *hand;
+	pthread_mutex_t lock;
+	pthread_cond_t filled;
+
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+} objcache_t;
+
+
+/* Initializes the cache to hold at most budget bytes of objects */
+void objcache_init(objcache_t *cache, size_t budget);
+
+/*
+ * Returns the entry for key with a reference held.  If the object is not
+ * cached and no one is fetching it, fetch is set to 1 and the caller must
+ * fetch it and call objcache_fill.  Otherwise fetch is set to 0 and the
+ * call waits until the entry is filled, so its status is never
+ * OBJCACHE_PENDING.
+ */
+objcache_entry_t *objcache_get(objcache_t *cache, const char *key, int *fetch);
+
+/*
+ * Completes an entry returned with fetch set and wakes the callers waiting
+ * for it.  The cache takes ownership of data, which must come from malloc.
+ * Only OBJCACHE_OK objects that fit in the budget stay cached.
+ */
+void objcache_fill(objcache_t *cache, objcache_entry_t *entry, int status, char *data, size_t len);
+
+/* Drops the reference returned by objcache_get */
+void objcache_release(objcache_t *cache, objcache_entry_t *entry);
+
+/* Frees every object; no entry may still be referenced */
+void objcache_destroy(objcache_t *cache);
+
+#endif
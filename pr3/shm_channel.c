@@ -1 +1,433 @@
-//In case you want to implement the shared memory IPC as a library...
\ No newline at end of file
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "shm_channel.h"
+
+/* Requests the queue holds before mq_send blocks, the default limit */
+#define QUEUE_MAXMSG 10
+/* how often a proxy out of segments looks at the quarantined ones */
+#define RECLAIM_INTERVAL_NS 100000000
+
+static void deadline(struct timespec *ts){
+	clock_gettime(CLOCK_REALTIME, ts);
+	ts->tv_sec += SHM_CHANNEL_TIMEOUT;
+}
+
+int shm_segment_wait(sem_t *sem){
+	struct timespec ts;
+
+	deadline(&ts);
+	while (sem_timedwait(sem, &ts) < 0){
+		if (errno != EINTR)
+			return -1;
+	}
+
+	return 0;
+}
+
+static void segment_name(char *name, size_t size, pid_t owner, int segment){
+	snprintf(name, size, SHM_CHANNEL_SEGMENT, (int) owner, segment);
+}
+
+int shm_channel_create(shm_channel_t *channel, int nsegments, size_t segsize){
+	struct mq_attr attr;
+	char name[64];
+	int i, fd;
+
+	if (nsegments < 1 || segsize <= sizeof(shm_segment_t)){
+		fprintf(stderr, "Invalid segment count or size.\n");
+		return -1;
+	}
+
+	memset(&attr, 0, sizeof(attr));
+	attr.mq_maxmsg = QUEUE_MAXMSG;
+	attr.mq_msgsize = sizeof(shm_request_t);
+
+	/*
+	 * Requests left by a previous proxy name segments that no longer
+	 * exist, start from an empty queue; the cache moves over on its own
+	 */
+	mq_unlink(SHM_CHANNEL_QUEUE);
+	if ((mqd_t) -1 == (channel->queue = mq_open(SHM_CHANNEL_QUEUE, O_CREAT | O_EXCL | O_WRONLY, 0600, &attr))){
+		perror("Unable to create the request queue");
+		return -1;
+	}
+
+	channel->nsegments = nsegments;
+	channel->segsize = segsize;
+	channel->segments = (shm_segment_t **) calloc(nsegments, sizeof(shm_segment_t *));
+	if (channel->segments == NULL){
+		perror("Unable to allocate memory");
+		exit(EXIT_FAILURE);
+	}
+	steque_init(&channel->free_list);
+	steque_init(&channel->quarantine);
+	pthread_mutex_init(&channel->lock, NULL);
+	pthread_cond_init(&channel->released, NULL);
+	channel->mappings = NULL;
+
+	for (i = 0; i < nsegments; i++){
+		segment_name(name, sizeof(name), getpid(), i);
+		shm_unlink(name);
+		if (0 > (fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600)) || 0 > ftruncate(fd, segsize)){
+			perror("Unable to create a segment");
+			if (fd >= 0)
+				close(fd);
+			shm_channel_destroy(channel);
+			return -1;
+		}
+
+		channel->segments[i] = (shm_segment_t *) mmap(NULL, segsize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if (channel->segments[i] == MAP_FAILED){
+			perror("Unable to map a segment");
+			channel->segments[i] = NULL;
+			shm_channel_destroy(channel);
+			return -1;
+		}
+
+		sem_init(&channel->segments[i]->ready, 1, 0);
+		sem_init(&channel->segments[i]->consumed, 1, 0);
+		steque_enqueue(&channel->free_list, (steque_item)(intptr_t) i);
+	}
+
+	return 0;
+}
+
+size_t shm_channel_capacity(shm_channel_t *channel){
+	return channel->segsize - sizeof(shm_segment_t);
+}
+
+/* Frees the quarantined segments the cache is done with, lock held */
+static void reclaim(shm_channel_t *channel){
+	shm_segment_t *seg;
+	int i, n, segment;
+
+	n = steque_size(&channel->quarantine);
+	for (i = 0; i < n; i++){
+		segment = (int)(intptr_t) steque_pop(&channel->quarantine);
+		seg = channel->segments[segment];
+		if (__atomic_load_n(&seg->done, __ATOMIC_ACQUIRE) == seg->generation)
+			steque_push(&channel->free_list, (steque_item)(intptr_t) segment);
+		else
+			steque_enqueue(&channel->quarantine, (steque_item)(intptr_t) segment);
+	}
+}
+
+int shm_channel_acquire(shm_channel_t *channel){
+	struct timespec ts;
+	int segment;
+
+	pthread_mutex_lock(&channel->lock);
+	reclaim(channel);
+	while (steque_isempty(&channel->free_list)){
+		if (steque_isempty(&channel->quarantine)){
+			pthread_cond_wait(&channel->released, &channel->lock);
+			continue;
+		}
+
+		/* nobody signals when the cache lets go, look again shortly */
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += RECLAIM_INTERVAL_NS;
+		if (ts.tv_nsec >= 1000000000){
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&channel->released, &channel->lock, &ts);
+		reclaim(channel);
+	}
+	segment = (int)(intptr_t) steque_pop(&channel->free_list);
+	pthread_mutex_unlock(&channel->lock);
+
+	return segment;
+}
+
+void shm_channel_release(shm_channel_t *channel, int segment){
+	pthread_mutex_lock(&channel->lock);
+	steque_push(&channel->free_list, (steque_item)(intptr_t) segment);
+	pthread_mutex_unlock(&channel->lock);
+
+	pthread_cond_signal(&channel->released);
+}
+
+void shm_channel_quarantine(shm_channel_t *channel, int segment){
+	shm_segment_t *seg = channel->segments[segment];
+
+	/* a cache waiting for the chunk to be sent sees abort and stops */
+	seg->abort = 1;
+	sem_post(&seg->consumed);
+
+	pthread_mutex_lock(&channel->lock);
+	steque_enqueue(&channel->quarantine, (steque_item)(intptr_t) segment);
+	pthread_mutex_unlock(&channel->lock);
+}
+
+int shm_channel_request(shm_channel_t *channel, int segment, const char *key){
+	shm_request_t request;
+	shm_segment_t *seg = channel->segments[segment];
+	struct timespec ts;
+
+	if (strlen(key) >= SHM_CHANNEL_MAX_KEYLEN)
+		return -1;
+
+	/* Drop whatever an aborted exchange may have left behind */
+	while (sem_trywait(&seg->ready) == 0);
+	while (sem_trywait(&seg->consumed) == 0);
+	seg->status = SHM_STATUS_ERROR;
+	seg->abort = 0;
+	seg->file_len = 0;
+	seg->len = 0;
+
+	memset(&request, 0, sizeof(request));
+	request.owner = getpid();
+	request.segment = segment;
+	request.generation = ++seg->generation;
+	strcpy(request.key, key);
+
+	deadline(&ts);
+	while (mq_timedsend(channel->queue, (char *) &request, sizeof(request), 0, &ts) < 0){
+		if (errno != EINTR)
+			return -1;
+	}
+
+	return 0;
+}
+
+void shm_channel_destroy(shm_channel_t *channel){
+	char name[64];
+	int i;
+
+	for (i = 0; i < channel->nsegments; i++){
+		if (channel->segments[i] != NULL)
+			munmap(channel->segments[i], channel->segsize);
+		segment_name(name, sizeof(name), getpid(), i);
+		shm_unlink(name);
+	}
+
+	free(channel->segments);
+	channel->segments = NULL;
+	channel->nsegments = 0;
+	steque_destroy(&channel->free_list);
+	steque_destroy(&channel->quarantine);
+
+	mq_close(channel->queue);
+	mq_unlink(SHM_CHANNEL_QUEUE);
+}
+
+int shm_channel_attach(shm_channel_t *channel){
+	while ((mqd_t) -1 == (channel->queue = mq_open(SHM_CHANNEL_QUEUE, O_RDONLY))){
+		if (errno != ENOENT){
+			perror("Unable to open the request queue");
+			return -1;
+		}
+		/* the proxy has not started yet */
+		sleep(1);
+	}
+
+	channel->segments = NULL;
+	channel->nsegments = 0;
+	channel->mappings = NULL;
+	steque_init(&channel->retired);
+	pthread_mutex_init(&channel->lock, NULL);
+
+	return 0;
+}
+
+/*
+ * Moves to the queue now under SHM_CHANNEL_QUEUE if a new proxy replaced
+ * the one being read.  Other workers may still wait on the old queue, so
+ * it is only closed on detach.
+ */
+static void follow_queue(shm_channel_t *channel, mqd_t current){
+	struct stat old_st, new_st;
+	mqd_t queue;
+
+	if ((mqd_t) -1 == (queue = mq_open(SHM_CHANNEL_QUEUE, O_RDONLY)))
+		return;
+
+	pthread_mutex_lock(&channel->lock);
+	/* message queue descriptors are file descriptors on Linux */
+	if (channel->queue == current && 0 == fstat((int) current, &old_st) && 0 == fstat((int) queue, &new_st)
+	    && (old_st.st_dev != new_st.st_dev || old_st.st_ino != new_st.st_ino)){
+		steque_enqueue(&channel->retired, (steque_item)(intptr_t) current);
+		__atomic_store_n(&channel->queue, queue, __ATOMIC_RELEASE);
+		queue = (mqd_t) -1;
+	}
+	pthread_mutex_unlock(&channel->lock);
+
+	if (queue != (mqd_t) -1)
+		mq_close(queue);
+}
+
+int shm_channel_receive(shm_channel_t *channel, shm_request_t *request){
+	struct timespec ts;
+	mqd_t queue;
+	ssize_t n;
+
+	for ( ; ; ){
+		queue = __atomic_load_n(&channel->queue, __ATOMIC_ACQUIRE);
+		deadline(&ts);
+		if ((n = mq_timedreceive(queue, (char *) request, sizeof(shm_request_t), NULL, &ts)) >= 0)
+			break;
+		if (errno == ETIMEDOUT)
+			follow_queue(channel, queue);
+		else if (errno != EINTR)
+			return -1;
+	}
+
+	if (n != sizeof(shm_request_t))
+		return -1;
+	request->key[SHM_CHANNEL_MAX_KEYLEN - 1] = '\0';
+
+	return 0;
+}
+
+static void unmap(shm_mapping_t *mapping){
+	int i;
+
+	for (i = 0; i < mapping->nmapped; i++){
+		if (mapping->mapped[i] != NULL)
+			munmap(mapping->mapped[i], mapping->mapped_sizes[i]);
+	}
+
+	free(mapping->mapped);
+	free(mapping->mapped_sizes);
+	free(mapping);
+}
+
+/* A process that is gone, checked without signalling it */
+static int exited(pid_t pid){
+	return kill(pid, 0) < 0 && errno == ESRCH;
+}
+
+/*
+ * Returns the mapping of owner, adding one for a new proxy.  Returns NULL
+ * for a proxy that exited, whose requests are stale.  Lock held.
+ */
+static shm_mapping_t *find_mapping(shm_channel_t *channel, pid_t owner){
+	shm_mapping_t *mapping, **link;
+
+	for (mapping = channel->mappings; mapping != NULL; mapping = mapping->next){
+		if (mapping->owner == owner)
+			return mapping;
+	}
+
+	if (exited(owner))
+		return NULL;
+
+	/* forget earlier proxies whose segments nobody uses any more */
+	for (link = &channel->mappings; (mapping = *link) != NULL; ){
+		if (mapping->users == 0 && exited(mapping->owner)){
+			*link = mapping->next;
+			unmap(mapping);
+		} else
+			link = &mapping->next;
+	}
+
+	if (NULL == (mapping = (shm_mapping_t *) calloc(1, sizeof(shm_mapping_t)))){
+		perror("Unable to allocate memory");
+		exit(EXIT_FAILURE);
+	}
+	mapping->owner = owner;
+	mapping->next = channel->mappings;
+	channel->mappings = mapping;
+
+	return mapping;
+}
+
+shm_segment_t *shm_channel_map(shm_channel_t *channel, shm_request_t *request, size_t *capacity){
+	shm_mapping_t *mapping;
+	shm_segment_t *seg = NULL;
+	struct stat st;
+	char name[64];
+	int fd, n;
+
+	if (request->segment < 0)
+		return NULL;
+
+	pthread_mutex_lock(&channel->lock);
+
+	if (NULL == (mapping = find_mapping(channel, request->owner))){
+		pthread_mutex_unlock(&channel->lock);
+		return NULL;
+	}
+
+	if (request->segment >= mapping->nmapped){
+		n = request->segment + 1;
+		mapping->mapped = (shm_segment_t **) realloc(mapping->mapped, n * sizeof(shm_segment_t *));
+		mapping->mapped_sizes = (size_t *) realloc(mapping->mapped_sizes, n * sizeof(size_t));
+		if (mapping->mapped == NULL || mapping->mapped_sizes == NULL){
+			perror("Unable to allocate memory");
+			exit(EXIT_FAILURE);
+		}
+		memset(mapping->mapped + mapping->nmapped, 0, (n - mapping->nmapped) * sizeof(shm_segment_t *));
+		mapping->nmapped = n;
+	}
+
+	if (mapping->mapped[request->segment] == NULL){
+		segment_name(name, sizeof(name), request->owner, request->segment);
+		if (0 <= (fd = shm_open(name, O_RDWR, 0))){
+			if (0 == fstat(fd, &st) && (size_t) st.st_size > sizeof(shm_segment_t)){
+				seg = (shm_segment_t *) mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+				if (seg != MAP_FAILED){
+					mapping->mapped[request->segment] = seg;
+					mapping->mapped_sizes[request->segment] = st.st_size;
+				}
+			}
+			close(fd);
+		}
+	}
+
+	seg = mapping->mapped[request->segment];
+	if (seg != NULL){
+		*capacity = mapping->mapped_sizes[request->segment] - sizeof(shm_segment_t);
+		mapping->users++;
+	}
+
+	pthread_mutex_unlock(&channel->lock);
+
+	return seg;
+}
+
+void shm_channel_done(shm_channel_t *channel, shm_segment_t *seg, shm_request_t *request){
+	shm_mapping_t *mapping;
+	unsigned int done = __atomic_load_n(&seg->done, __ATOMIC_RELAXED);
+
+	/* a worker that finished an older exchange late must not move done back */
+	while ((int)(request->generation - done) > 0
+	       && !__atomic_compare_exchange_n(&seg->done, &done, request->generation, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+
+	pthread_mutex_lock(&channel->lock);
+	for (mapping = channel->mappings; mapping != NULL; mapping = mapping->next){
+		if (mapping->owner == request->owner){
+			mapping->users--;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&channel->lock);
+}
+
+void shm_channel_detach(shm_channel_t *channel){
+	shm_mapping_t *mapping;
+
+	pthread_mutex_lock(&channel->lock);
+	while (NULL != (mapping = channel->mappings)){
+		channel->mappings = mapping->next;
+		unmap(mapping);
+	}
+	while (!steque_isempty(&channel->retired))
+		mq_close((mqd_t)(intptr_t) steque_pop(&channel->retired));
+	pthread_mutex_unlock(&channel->lock);
+
+	mq_close(channel->queue);
+}
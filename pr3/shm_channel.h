@@ -1 +1,166 @@
-//In case you want to implement the shared memory IPC as a library...
\ No newline at end of file
+#ifndef _SHM_CHANNEL_H_
+#define _SHM_CHANNEL_H_
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <mqueue.h>
+#include <sys/types.h>
+
+#include "steque.h"
+
+/*
+ * Shared memory IPC between webproxy and simplecached.
+ *
+ * The proxy owns a pool of fixed-size shm_open segments and a POSIX
+ * message queue.  To fetch a file it takes a free segment, sends
+ * { key, segment } on the queue and waits on the segment.  The cache
+ * fills the segment with the status and the first chunk of the file and
+ * posts ready; every time the proxy has sent a chunk to its client it
+ * posts consumed, and the cache overwrites the segment with the next one.
+ * File bytes therefore only go cache -> shared memory -> client socket.
+ *
+ * Segment names carry the pid of the proxy, so a restarted proxy never
+ * shares a segment with requests left in the queue by a previous one.
+ *
+ * Every request carries the generation of its exchange, and the cache
+ * records the last generation it is done with in the segment.  A segment
+ * whose exchange timed out is quarantined instead of freed, and only
+ * goes back on the free list once the cache is done with that exchange,
+ * so a late answer can never land in the middle of a newer one.
+ */
+
+#define SHM_CHANNEL_QUEUE "/gfcache_requests"
+#define SHM_CHANNEL_SEGMENT "/gfcache_%d_%d"
+#define SHM_CHANNEL_MAX_KEYLEN 256
+/* seconds either side waits for the other before giving up */
+#define SHM_CHANNEL_TIMEOUT 5
+
+/* Values for shm_segment_t.status */
+#define SHM_STATUS_OK 0
+#define SHM_STATUS_NOT_FOUND 1
+#define SHM_STATUS_ERROR 2
+
+/* Header at the start of every segment, the file data follows it */
+typedef struct{
+	/* cache -> proxy: the segment holds a new chunk */
+	sem_t ready;
+	/* proxy -> cache: the chunk was sent, the segment may be reused */
+	sem_t consumed;
+	int status;
+	/* set by the proxy when its client went away */
+	int abort;
+	/* proxy: the current exchange; cache: the last one it let go of */
+	unsigned int generation;
+	unsigned int done;
+	size_t file_len;
+	/* bytes of the file in data */
+	size_t len;
+	char data[];
+} shm_segment_t;
+
+/* Message sent on the queue */
+typedef struct{
+	pid_t owner;
+	int segment;
+	unsigned int generation;
+	char key[SHM_CHANNEL_MAX_KEYLEN];
+} shm_request_t;
+
+/* Cache side: the segments of one proxy mapped so far, by index */
+typedef struct shm_mapping_t{
+	pid_t owner;
+	int nmapped;
+	shm_segment_t **mapped;
+	size_t *mapped_sizes;
+	/* requests being served from these segments */
+	int users;
+	struct shm_mapping_t *next;
+} shm_mapping_t;
+
+typedef struct{
+	mqd_t queue;
+
+	/* proxy side: the segments and the indexes of the free ones */
+	int nsegments;
+	size_t segsize;
+	shm_segment_t **segments;
+	steque_t free_list;
+	/* segments that timed out, waiting for the cache to let go */
+	steque_t quarantine;
+	pthread_mutex_t lock;
+	pthread_cond_t released;
+
+	/* cache side: one mapping per proxy, the newest first */
+	shm_mapping_t *mappings;
+	/* queues of earlier proxies, closed on detach */
+	steque_t retired;
+} shm_channel_t;
+
+/*
+ * Proxy side.  Creates the queue, replacing one left by an earlier proxy, and nsegments segments of segsize bytes
+ * each, header included.  Returns 0 on success.
+ */
+int shm_channel_create(shm_channel_t *channel, int nsegments, size_t segsize);
+
+/*
+ * Returns the index of a free segment, waiting for one if needed.
+ * Quarantined segments the cache is done with are freed first.
+ */
+int shm_channel_acquire(shm_channel_t *channel);
+
+/* Puts a segment back on the free list */
+void shm_channel_release(shm_channel_t *channel, int segment);
+
+/*
+ * Takes a segment whose exchange failed half way out of use until the
+ * cache is done with it, asking the cache to stop at its next chunk.
+ */
+void shm_channel_quarantine(shm_channel_t *channel, int segment);
+
+/* Asks the cache to stream key into segment.  Returns 0 on success */
+int shm_channel_request(shm_channel_t *channel, int segment, const char *key);
+
+/* Bytes of file data a segment of the channel holds */
+size_t shm_channel_capacity(shm_channel_t *channel);
+
+/* Unmaps and unlinks the segments and the queue */
+void shm_channel_destroy(shm_channel_t *channel);
+
+/*
+ * Cache side.  Opens the queue, waiting until a proxy has created it.
+ * Returns 0 on success.
+ */
+int shm_channel_attach(shm_channel_t *channel);
+
+/*
+ * Waits for the next request, switching to the queue of a new proxy when
+ * the one it reads from was replaced.  Returns 0 on success.
+ */
+int shm_channel_receive(shm_channel_t *channel, shm_request_t *request);
+
+/*
+ * Returns the segment named by request, mapping it on first use, and sets
+ * capacity to the bytes of file data it holds.  Returns NULL if the
+ * segment is gone, e.g. because the proxy that sent request exited, in
+ * which case the request is dropped.  The segments of a proxy that exited
+ * are unmapped once no request uses them any more.
+ */
+shm_segment_t *shm_channel_map(shm_channel_t *channel, shm_request_t *request, size_t *capacity);
+
+/*
+ * Tells the proxy the cache no longer touches seg, returned by
+ * shm_channel_map for request; it must follow the last post of ready for
+ * the exchange.
+ */
+void shm_channel_done(shm_channel_t *channel, shm_segment_t *seg, shm_request_t *request);
+
+/* Unmaps the segments and closes the queue */
+void shm_channel_detach(shm_channel_t *channel);
+
+/*
+ * Both sides.  Waits on one of the semaphores of a segment for at most
+ * SHM_CHANNEL_TIMEOUT seconds.  Returns 0 on success, -1 on timeout.
+ */
+int shm_segment_wait(sem_t *sem);
+
+#endif
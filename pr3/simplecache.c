@@ -1,10 +1,13 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <sys/stat.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 
+#include "simplecache.h"
+
 #define MAX_KEYLEN 256
 
 #if !defined(CACHE_FAILURE)
@@ -16,14 +19,83 @@ typedef struct{
 	char key[MAX_KEYLEN];
 } item_t;
 
+/* Open-addressing slot, a hash of 0 marks an empty one */
+typedef struct{
+	uint64_t hash;
+	uint32_t key;	/* offset of the key in the arena */
+	int fildes;
+} slot_t;
+
+static int index_type;
+
+/* SIMPLECACHE_INDEX_SORTED */
 static int nitems;
 static item_t *items;
 
+/* SIMPLECACHE_INDEX_HASH */
+static slot_t *slots;
+static size_t mask;
+static char *arena;
+static size_t arena_len;
+
 static int _itemcmp(const void *a, const void *b){
 	return strcmp(((item_t*) a)->key,((item_t*) b)->key);
 }
 
+/* 64-bit FNV-1a, never 0 */
+static uint64_t _hash(const char *key){
+	uint64_t h = 14695981039346656037ULL;
+
+	while(*key){
+		h ^= (unsigned char) *key++;
+		h *= 1099511628211ULL;
+	}
+
+	return h ? h : 1;
+}
+
+/* Moves the keys out of items into the arena and hashes them into slots */
+static void _build_hash(){
+	size_t capacity = 16, len, i;
+	int n;
+
+	for(n = 0, arena_len = 0; n < nitems; n++)
+		arena_len += strlen(items[n].key) + 1;
+
+	/* keep the load factor at or below 1/2 */
+	while(capacity < 2 * (size_t) nitems)
+		capacity *= 2;
+
+	arena = (char*) malloc(arena_len ? arena_len : 1);
+	slots = (slot_t*) calloc(capacity, sizeof(slot_t));
+	if(arena == NULL || slots == NULL){
+		fprintf(stderr, "Unable to allocate the cache index.\n");
+		exit(CACHE_FAILURE);
+	}
+	mask = capacity - 1;
+
+	for(n = 0, arena_len = 0; n < nitems; n++){
+		uint64_t h = _hash(items[n].key);
+
+		for(i = h & mask; slots[i].hash != 0; i = (i + 1) & mask);
+
+		len = strlen(items[n].key) + 1;
+		memcpy(arena + arena_len, items[n].key, len);
+		slots[i].hash = h;
+		slots[i].key = (uint32_t) arena_len;
+		slots[i].fildes = items[n].fildes;
+		arena_len += len;
+	}
+
+	free(items);
+	items = NULL;
+}
+
 int simplecache_init(char *filename){
+	return simplecache_init_index(filename, SIMPLECACHE_INDEX_HASH);
+}
+
+int simplecache_init_index(char *filename, int index){
 	FILE *filelist;
 	int capacity = 16;
 	char *path, *ptr;
@@ -59,12 +131,27 @@ int simplecache_init(char *filename){
 
 	fclose(filelist);
 
-	qsort(items, nitems, sizeof(item_t), _itemcmp);
+	index_type = index;
+	if(index_type == SIMPLECACHE_INDEX_HASH)
+		_build_hash();
+	else
+		qsort(items, nitems, sizeof(item_t), _itemcmp);
 
 	return EXIT_SUCCESS;
 }
 
-int simplecache_get(char *key){
+static int _get_hash(char *key){
+	uint64_t h = _hash(key);
+	size_t i;
+
+	for(i = h & mask; slots[i].hash != 0; i = (i + 1) & mask){
+		if(slots[i].hash == h && strcmp(arena + slots[i].key, key) == 0)
+			return slots[i].fildes;
+	}
+	return -1;
+}
+
+static int _get_sorted(char *key){
 	int lo = 0;
 	int hi = nitems - 1;
 	int mid, cmp;
@@ -74,18 +161,35 @@ int simplecache_get(char *key){
 		cmp = strcmp(key,items[mid].key);
 		if ( cmp < 0) hi = mid - 1;
 		else if (cmp > 0) lo = mid + 1;
-		else{
-			lseek(items[mid].fildes, 0, SEEK_SET);
+		else
 			return items[mid].fildes;
-		} 
 	}
 	return -1;
 }
 
+int simplecache_get(char *key){
+	if(index_type == SIMPLECACHE_INDEX_HASH)
+		return _get_hash(key);
+	return _get_sorted(key);
+}
+
 void simplecache_destroy(){
-	int i;
-	for(i = 0; i < nitems; i++)
-		close(items[i].fildes);
-	
+	size_t i;
+	int n;
+
+	if(index_type == SIMPLECACHE_INDEX_HASH){
+		for(i = 0; i <= mask; i++)
+			if(slots[i].hash != 0)
+				close(slots[i].fildes);
+		free(slots);
+		free(arena);
+		slots = NULL;
+		arena = NULL;
+		return;
+	}
+
+	for(n = 0; n < nitems; n++)
+		close(items[n].fildes);
+
 	free(items);
 }
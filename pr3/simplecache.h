@@ -8,11 +8,32 @@
  * Subsequent calls to simplecache_get with a key value
  * as an argument will return the file descriptor for the 
  * given file path.
+ *
+ * Keys are looked up in an open-addressing hash table; use
+ * simplecache_init_index to pick the index explicitly.
  */
 int simplecache_init(char *filename);
 
+/*
+ * Index backends for simplecache_init_index.
+ * - SIMPLECACHE_INDEX_SORTED keeps the items in a sorted array
+ *   and binary searches it with strcmp.
+ * - SIMPLECACHE_INDEX_HASH stores the keys in one arena and their
+ *   precomputed hashes in a linear-probing table, so a lookup
+ *   hashes the key once and usually compares a single string.
+ */
+#define SIMPLECACHE_INDEX_SORTED 0
+#define SIMPLECACHE_INDEX_HASH 1
+
+/*
+ * Same as simplecache_init, using the given index backend.
+ */
+int simplecache_init_index(char *filename, int index);
+
 /* 
  * Returns the file descriptor associated with the input key.
+ * The descriptor is shared by every caller and its offset is
+ * never reset, so read it with pread rather than read.
  */
 int simplecache_get(char *key);
 
@@ -0,0 +1,123 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "simplecache.h"
+
+/*
+ * Times simplecache_get with the sorted array and with the hash index over
+ * cache lists of growing size.  Keys share a long prefix, as the paths of
+ * a file corpus do, and one lookup in ten misses.  Every key opens
+ * /dev/null, so no files are needed, only enough file descriptors.
+ *
+ *   simplecache_bench [lookups]
+ */
+
+#define DEFAULT_LOOKUPS 2000000
+#define KEY_FORMAT "/courses/ud923/filecorpus/%06d-photo.jpg"
+#define MISS_FORMAT "/courses/ud923/filecorpus/%06d-photo.png"
+#define KEYLEN 64
+/* descriptors kept free for everything but the cache */
+#define SPARE_FDS 64
+
+static const int g_sizes[] = {16, 256, 4096, 16384};
+
+static double now(void){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Writes a cache list of nkeys keys, returns its path in name */
+static void write_list(char *name, int nkeys){
+	FILE *list;
+	int fd, i;
+
+	strcpy(name, "/tmp/simplecache_bench_XXXXXX");
+	if(0 > (fd = mkstemp(name)) || NULL == (list = fdopen(fd, "w"))){
+		perror("Unable to create the cache list");
+		exit(EXIT_FAILURE);
+	}
+
+	for(i = 0; i < nkeys; i++){
+		fprintf(list, KEY_FORMAT, i);
+		fprintf(list, " /dev/null\n");
+	}
+	fclose(list);
+}
+
+/* Returns ns per lookup of queries with the given index, found counts the hits */
+static double run(char *list, int index, char (*queries)[KEYLEN], long nqueries, long *found){
+	double start, elapsed;
+	long i;
+
+	simplecache_init_index(list, index);
+
+	*found = 0;
+	start = now();
+	for(i = 0; i < nqueries; i++)
+		*found += simplecache_get(queries[i]) >= 0;
+	elapsed = now() - start;
+
+	simplecache_destroy();
+
+	return elapsed * 1e9 / nqueries;
+}
+
+int main(int argc, char **argv){
+	long nqueries = argc > 1 ? atol(argv[1]) : DEFAULT_LOOKUPS;
+	char (*queries)[KEYLEN];
+	char list[64];
+	struct rlimit rl;
+	long i, sorted_found, hash_found;
+	double sorted, hash;
+	size_t s;
+	int nkeys;
+
+	if(nqueries < 1){
+		fprintf(stderr, "usage: simplecache_bench [lookups]\n");
+		return EXIT_FAILURE;
+	}
+
+	/* every key holds a descriptor */
+	getrlimit(RLIMIT_NOFILE, &rl);
+	rl.rlim_cur = rl.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &rl);
+
+	if(NULL == (queries = malloc(nqueries * sizeof(*queries)))){
+		fprintf(stderr, "Unable to allocate the queries.\n");
+		return EXIT_FAILURE;
+	}
+
+	printf("%8s %14s %14s %8s\n", "keys", "sorted ns/get", "hash ns/get", "speedup");
+	for(s = 0; s < sizeof(g_sizes) / sizeof(g_sizes[0]); s++){
+		nkeys = g_sizes[s];
+		if((rlim_t) nkeys + SPARE_FDS > rl.rlim_cur){
+			printf("%8d skipped, only %lu file descriptors\n", nkeys, (unsigned long) rl.rlim_cur);
+			continue;
+		}
+
+		srand(nkeys);
+		for(i = 0; i < nqueries; i++)
+			snprintf(queries[i], KEYLEN, rand() % 10 ? KEY_FORMAT : MISS_FORMAT, rand() % nkeys);
+
+		write_list(list, nkeys);
+		sorted = run(list, SIMPLECACHE_INDEX_SORTED, queries, nqueries, &sorted_found);
+		hash = run(list, SIMPLECACHE_INDEX_HASH, queries, nqueries, &hash_found);
+		unlink(list);
+
+		if(sorted_found != hash_found){
+			fprintf(stderr, "The indexes disagree: %ld and %ld hits.\n", sorted_found, hash_found);
+			return EXIT_FAILURE;
+		}
+		printf("%8d %14.1f %14.1f %7.2fx\n", nkeys, sorted, hash, sorted / hash);
+	}
+
+	free(queries);
+
+	return 0;
+}
@@ -5,6 +5,7 @@
 #include <string.h>
 #include <getopt.h>
 #include <pthread.h>
+#include <sys/stat.h>
 
 #include "shm_channel.h"
 #include "simplecache.h"
@@ -15,9 +16,12 @@
 
 #define MAX_CACHE_REQUEST_LEN 256
 
+static shm_channel_t channel;
+
 static void _sig_handler(int signo){
 	if (signo == SIGINT || signo == SIGTERM){
-		/* Unlink IPC mechanisms here*/
+		/* The proxy owns and unlinks the IPC objects */
+		shm_channel_detach(&channel);
 		exit(signo);
 	}
 }
@@ -42,10 +46,94 @@ void Usage() {
   fprintf(stdout, "%s", USAGE);
 }
 
+/*
+ * Streams the file of request->key into seg, one segment-sized chunk at a
+ * time.  Descriptors are shared by all workers, so the file is only read
+ * with pread and its offset is never moved.
+ */
+static void stream_file(shm_request_t *request, shm_segment_t *seg, size_t capacity){
+	size_t offset = 0;
+	ssize_t n;
+	struct stat st;
+	off_t file_len;
+	int fildes;
+
+	if (0 > (fildes = simplecache_get(request->key))){
+		seg->status = SHM_STATUS_NOT_FOUND;
+		sem_post(&seg->ready);
+		return;
+	}
+
+	if (0 > fstat(fildes, &st)){
+		seg->status = SHM_STATUS_ERROR;
+		sem_post(&seg->ready);
+		return;
+	}
+	file_len = st.st_size;
+
+	seg->status = SHM_STATUS_OK;
+	seg->file_len = file_len;
+	seg->len = 0;
+
+	for ( ; ; ){
+		if (offset < (size_t) file_len){
+			n = pread(fildes, seg->data, (size_t) file_len - offset < capacity ? (size_t) file_len - offset : capacity, offset);
+			if (n <= 0){
+				seg->status = SHM_STATUS_ERROR;
+				seg->len = 0;
+				sem_post(&seg->ready);
+				return;
+			}
+			seg->len = n;
+			offset += n;
+		}
+		sem_post(&seg->ready);
+
+		if (offset >= (size_t) file_len)
+			return;
+
+		/* wait until the proxy has sent the chunk */
+		if (0 > shm_segment_wait(&seg->consumed))
+			return;
+		if (seg->abort){
+			sem_post(&seg->ready);
+			return;
+		}
+	}
+}
+
+static void serve_request(shm_request_t *request){
+	shm_segment_t *seg;
+	size_t capacity;
+
+	if (NULL == (seg = shm_channel_map(&channel, request, &capacity)))
+		return;
+
+	stream_file(request, seg, capacity);
+	shm_channel_done(&channel, seg, request);
+}
+
+/* Each worker takes requests off the queue and serves them one at a time */
+static void *worker_main(void *arg){
+	shm_request_t request;
+
+	for ( ; ; ){
+		if (0 > shm_channel_receive(&channel, &request)){
+			perror("Unable to receive a request");
+			exit(CACHE_FAILURE);
+		}
+
+		serve_request(&request);
+	}
+
+	return NULL;
+}
+
 int main(int argc, char **argv) {
-	int nthreads = 1;
+	int i, nthreads = 1;
 	char *cachedir = "locals.txt";
 	char option_char;
+	pthread_t *workers;
 
 
 	while ((option_char = getopt_long(argc, argv, "t:c:h", gLongOptions, NULL)) != -1) {
@@ -83,5 +171,28 @@ int main(int argc, char **argv) {
 	/* Initializing the cache */
 	simplecache_init(cachedir);
 
-	//Your code here...
+	if (0 > shm_channel_attach(&channel))
+		exit(CACHE_FAILURE);
+
+	if (NULL == (workers = (pthread_t *) malloc(nthreads * sizeof(pthread_t)))){
+		perror("Unable to allocate memory");
+		exit(CACHE_FAILURE);
+	}
+
+	for (i = 0; i < nthreads; i++){
+		if (0 != pthread_create(&workers[i], NULL, worker_main, NULL)){
+			fprintf(stderr, "Error creating thread\n");
+			exit(CACHE_FAILURE);
+		}
+	}
+
+	/* Workers never return, the signal handler ends the process */
+	for (i = 0; i < nthreads; i++)
+		pthread_join(workers[i], NULL);
+
+	free(workers);
+	shm_channel_detach(&channel);
+	simplecache_destroy();
+
+	return 0;
 }
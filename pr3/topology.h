@@ -0,0 +1,36 @@
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+/* cpu_set_t needs _GNU_SOURCE defined before the first system header */
+#include <sched.h>
+
+/*
+ * NUMA nodes and the CPUs of each one, as listed under
+ * /sys/devices/system/node and restricted to the CPUs this process may
+ * run on.  Without that listing every CPU counts as node 0.  Memory is
+ * placed node-locally by touching it first from a thread pinned to the
+ * node, so no NUMA library is needed.
+ */
+
+/* Placement policies for pinned threads */
+#define TOPOLOGY_PIN_NONE 0  /* threads float */
+#define TOPOLOGY_PIN_CORE 1  /* one CPU per thread */
+#define TOPOLOGY_PIN_NODE 2  /* any CPU of the node of the thread */
+
+/*
+ * Returns the policy named "none", "core" or "node", -1 for any other name
+ */
+int topology_policy(const char* name);
+
+/* Returns the number of nodes with a CPU this process may run on */
+int topology_nnodes(void);
+
+/*
+ * Fills set for a thread on node under policy.  index counts the threads
+ * already placed on the node and picks the CPU for TOPOLOGY_PIN_CORE,
+ * wrapping around the CPUs of the node.  Returns -1 for TOPOLOGY_PIN_NONE,
+ * leaving set untouched, and 0 otherwise.
+ */
+int topology_placement(int policy, int node, int index, cpu_set_t* set);
+
+#endif
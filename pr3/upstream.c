@@ -0,0 +1,480 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "gfserver.h"
+#include "upstream.h"
+
+/*
+ * epoll data of a curl socket is its descriptor with this bit set, of a
+ * transfer waiting on its client a pointer to it, and of the eventfd 0.
+ */
+#define CURL_SOCKET_TAG (1ULL << 63)
+
+typedef struct{
+	upstream_loop_t *loop;
+	CURL *easy;
+	char *url;
+	int client;
+	int registered;
+	/* waiting for the client to take more */
+	int watching;
+
+	/* set by the first chunk */
+	int started;
+	/* the response is not a 200, its body is dropped */
+	int discard;
+	/* the header went out before the body, chunks are forwarded */
+	int streaming;
+	/* curl paused the transfer until the client catches up */
+	int paused;
+	/* curl is done with the transfer */
+	int done;
+	/* the body without a length outgrew UPSTREAM_MAX_UNSIZED */
+	int oversized;
+	size_t length;
+	size_t received;
+
+	char header[MAX_REQUEST_LEN];
+	size_t header_len;
+	size_t header_sent;
+	/* bytes not written to the client yet, from off to len */
+	char *buffer;
+	size_t off;
+	size_t len;
+	size_t capacity;
+} transfer_t;
+
+static long long now_ms(){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int pending(transfer_t *transfer){
+	return transfer->header_sent < transfer->header_len || transfer->off < transfer->len;
+}
+
+static int append(transfer_t *transfer, char *data, size_t len){
+	size_t capacity = transfer->capacity ? transfer->capacity : 4096;
+	char *buffer;
+
+	if (transfer->off > 0){
+		memmove(transfer->buffer, transfer->buffer + transfer->off, transfer->len - transfer->off);
+		transfer->len -= transfer->off;
+		transfer->off = 0;
+	}
+
+	if (transfer->len + len > transfer->capacity){
+		while (capacity < transfer->len + len)
+			capacity *= 2;
+		if (NULL == (buffer = realloc(transfer->buffer, capacity)))
+			return -1;
+		transfer->buffer = buffer;
+		transfer->capacity = capacity;
+	}
+
+	memcpy(transfer->buffer + transfer->len, data, len);
+	transfer->len += len;
+
+	return 0;
+}
+
+/* Writes what the client takes without blocking, -1 if it went away */
+static int flush_client(transfer_t *transfer){
+	ssize_t n;
+
+	if (transfer->header_len == 0)
+		return 0;
+
+	while (transfer->header_sent < transfer->header_len){
+		n = send(transfer->client, transfer->header + transfer->header_sent, transfer->header_len - transfer->header_sent, MSG_NOSIGNAL);
+		if (n < 0){
+			if (errno == EINTR)
+				continue;
+			return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+		}
+		transfer->header_sent += n;
+	}
+
+	while (transfer->off < transfer->len){
+		n = send(transfer->client, transfer->buffer + transfer->off, transfer->len - transfer->off, MSG_NOSIGNAL);
+		if (n < 0){
+			if (errno == EINTR)
+				continue;
+			return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+		}
+		transfer->off += n;
+	}
+
+	transfer->off = transfer->len = 0;
+	return 0;
+}
+
+static void watch_client(transfer_t *transfer, int writable){
+	struct epoll_event ev;
+
+	if (writable == transfer->watching)
+		return;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = writable ? EPOLLOUT : 0;
+	ev.data.ptr = transfer;
+	epoll_ctl(transfer->loop->epollfd, transfer->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, transfer->client, &ev);
+	transfer->registered = 1;
+	transfer->watching = writable;
+}
+
+static void finish(transfer_t *transfer){
+	if (transfer->easy != NULL){
+		curl_multi_remove_handle(transfer->loop->multi, transfer->easy);
+		curl_easy_cleanup(transfer->easy);
+	}
+
+	/* closing also drops it from the epoll set */
+	close(transfer->client);
+
+	__atomic_fetch_sub(&transfer->loop->active, 1, __ATOMIC_RELAXED);
+	free(transfer->buffer);
+	free(transfer->url);
+	free(transfer);
+}
+
+static size_t write_callback(char *ptr, size_t size, size_t nmemb, void *userp){
+	transfer_t *transfer = userp;
+	size_t realsize = size * nmemb;
+	long http_code = 0;
+	curl_off_t length = -1;
+
+	if (!transfer->started){
+		transfer->started = 1;
+
+		curl_easy_getinfo(transfer->easy, CURLINFO_RESPONSE_CODE, &http_code);
+		if (http_code != 200){
+			transfer->discard = 1;
+		} else {
+			curl_easy_getinfo(transfer->easy, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+			if (length >= 0){
+				transfer->length = (size_t) length;
+				transfer->streaming = 1;
+				transfer->header_len = gfs_format_header(transfer->header, sizeof(transfer->header), GF_OK, transfer->length);
+			}
+			/* otherwise the body is buffered until its length is known */
+		}
+	}
+
+	if (transfer->discard)
+		return realsize;
+
+	if (!transfer->streaming && transfer->len + realsize > UPSTREAM_MAX_UNSIZED){
+		transfer->oversized = 1;
+		return 0;
+	}
+
+	if (transfer->streaming){
+		if (transfer->received + realsize > transfer->length)
+			return 0;
+		if (transfer->len - transfer->off >= UPSTREAM_HIGH_WATER){
+			/* curl hands the same chunk back once unpaused */
+			transfer->paused = 1;
+			return CURL_WRITEFUNC_PAUSE;
+		}
+	}
+
+	if (0 > append(transfer, ptr, realsize))
+		return 0;
+
+	if (transfer->streaming){
+		transfer->received += realsize;
+		if (0 > flush_client(transfer))
+			return 0;
+		watch_client(transfer, pending(transfer));
+	}
+
+	return realsize;
+}
+
+static int socket_callback(CURL *easy, curl_socket_t s, int what, void *userp, void *socketp){
+	upstream_loop_t *loop = userp;
+	struct epoll_event ev;
+
+	if (what == CURL_POLL_REMOVE){
+		epoll_ctl(loop->epollfd, EPOLL_CTL_DEL, s, NULL);
+		curl_multi_assign(loop->multi, s, NULL);
+		return 0;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = (what & CURL_POLL_IN ? EPOLLIN : 0) | (what & CURL_POLL_OUT ? EPOLLOUT : 0);
+	ev.data.u64 = CURL_SOCKET_TAG | (uint64_t) s;
+
+	if (socketp == NULL){
+		epoll_ctl(loop->epollfd, EPOLL_CTL_ADD, s, &ev);
+		/* any non NULL marker tells the next call the socket is known */
+		curl_multi_assign(loop->multi, s, loop);
+	} else {
+		epoll_ctl(loop->epollfd, EPOLL_CTL_MOD, s, &ev);
+	}
+
+	return 0;
+}
+
+static int timer_callback(CURLM *multi, long timeout_ms, void *userp){
+	upstream_loop_t *loop = userp;
+
+	loop->deadline = timeout_ms < 0 ? -1 : now_ms() + timeout_ms;
+	return 0;
+}
+
+static void start_transfer(upstream_loop_t *loop, transfer_t *transfer){
+	fcntl(transfer->client, F_SETFL, fcntl(transfer->client, F_GETFL) | O_NONBLOCK);
+
+	if (NULL == (transfer->easy = curl_easy_init())){
+		finish(transfer);
+		return;
+	}
+
+	curl_easy_setopt(transfer->easy, CURLOPT_URL, transfer->url);
+	curl_easy_setopt(transfer->easy, CURLOPT_FOLLOWLOCATION, 1L);
+	curl_easy_setopt(transfer->easy, CURLOPT_NOSIGNAL, 1L);
+	curl_easy_setopt(transfer->easy, CURLOPT_WRITEFUNCTION, write_callback);
+	curl_easy_setopt(transfer->easy, CURLOPT_WRITEDATA, transfer);
+	curl_easy_setopt(transfer->easy, CURLOPT_PRIVATE, transfer);
+
+	curl_multi_add_handle(loop->multi, transfer->easy);
+}
+
+/* Answers the clients of the transfers curl is done with */
+static void check_done(upstream_loop_t *loop){
+	transfer_t *transfer;
+	CURLMsg *msg;
+	CURLcode result;
+	long http_code = 0;
+	int left;
+
+	while (NULL != (msg = curl_multi_info_read(loop->multi, &left))){
+		if (msg->msg != CURLMSG_DONE)
+			continue;
+
+		/* msg does not survive removing the handle */
+		result = msg->data.result;
+		curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **) &transfer);
+		curl_easy_getinfo(transfer->easy, CURLINFO_RESPONSE_CODE, &http_code);
+
+		curl_multi_remove_handle(loop->multi, transfer->easy);
+		curl_easy_cleanup(transfer->easy);
+		transfer->easy = NULL;
+		transfer->done = 1;
+
+		if (result != CURLE_OK)
+			fprintf(stderr, "upstream: %s: %s\n", transfer->url, curl_easy_strerror(result));
+
+		if (transfer->streaming){
+			if (result != CURLE_OK || transfer->received != transfer->length){
+				/* the header is gone already, all that is left is dropping the client */
+				finish(transfer);
+				continue;
+			}
+		} else if (transfer->oversized){
+			transfer->off = transfer->len = 0;
+			transfer->header_len = gfs_format_header(transfer->header, sizeof(transfer->header), GF_ERROR, 0);
+		} else if (result != CURLE_OK || http_code != 200){
+			transfer->off = transfer->len = 0;
+			transfer->header_len = gfs_format_header(transfer->header, sizeof(transfer->header), GF_FILE_NOT_FOUND, 0);
+		} else {
+			transfer->header_len = gfs_format_header(transfer->header, sizeof(transfer->header), GF_OK, transfer->len);
+		}
+
+		if (0 > flush_client(transfer) || !pending(transfer))
+			finish(transfer);
+		else
+			watch_client(transfer, 1);
+	}
+}
+
+static void client_writable(transfer_t *transfer, uint32_t events){
+	/* reported even while nothing is watched, and again until handled */
+	if (events & (EPOLLERR | EPOLLHUP)){
+		finish(transfer);
+		return;
+	}
+	if (0 > flush_client(transfer)){
+		finish(transfer);
+		return;
+	}
+	if (pending(transfer))
+		return;
+
+	watch_client(transfer, 0);
+	if (transfer->done){
+		finish(transfer);
+		return;
+	}
+	if (transfer->paused){
+		transfer->paused = 0;
+		curl_easy_pause(transfer->easy, CURLPAUSE_CONT);
+	}
+}
+
+static void start_submitted(upstream_loop_t *loop){
+	transfer_t *transfer;
+	uint64_t count;
+
+	if (read(loop->eventfd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		perror("upstream: eventfd");
+
+	for ( ; ; ){
+		pthread_mutex_lock(&loop->lock);
+		transfer = steque_isempty(&loop->submitted) ? NULL : steque_pop(&loop->submitted);
+		pthread_mutex_unlock(&loop->lock);
+
+		if (transfer == NULL)
+			break;
+		start_transfer(loop, transfer);
+	}
+}
+
+static void *loop_main(void *arg){
+	upstream_loop_t *loop = arg;
+	struct epoll_event events[UPSTREAM_MAX_EVENTS];
+	long long now;
+	int i, n, timeout, running;
+
+	for ( ; ; ){
+		timeout = -1;
+		if (loop->deadline >= 0){
+			now = now_ms();
+			timeout = loop->deadline > now ? (int)(loop->deadline - now) : 0;
+		}
+
+		if (0 > (n = epoll_wait(loop->epollfd, events, UPSTREAM_MAX_EVENTS, timeout))){
+			if (errno == EINTR)
+				continue;
+			perror("upstream: epoll_wait");
+			exit(SERVER_FAILURE);
+		}
+
+		for (i = 0; i < n; i++){
+			if (events[i].data.u64 == 0){
+				start_submitted(loop);
+			} else if (events[i].data.u64 & CURL_SOCKET_TAG){
+				curl_multi_socket_action(loop->multi, (curl_socket_t)(events[i].data.u64 & ~CURL_SOCKET_TAG),
+					(events[i].events & EPOLLIN ? CURL_CSELECT_IN : 0) |
+					(events[i].events & EPOLLOUT ? CURL_CSELECT_OUT : 0) |
+					(events[i].events & (EPOLLERR | EPOLLHUP) ? CURL_CSELECT_ERR : 0), &running);
+			} else {
+				client_writable((transfer_t *) events[i].data.ptr, events[i].events);
+			}
+		}
+
+		if (loop->deadline >= 0 && now_ms() >= loop->deadline){
+			loop->deadline = -1;
+			curl_multi_socket_action(loop->multi, CURL_SOCKET_TIMEOUT, 0, &running);
+		}
+
+		check_done(loop);
+	}
+
+	return NULL;
+}
+
+int upstream_init(upstream_t *upstream, const char *server, int nloops){
+	upstream_loop_t *loop;
+	struct epoll_event ev;
+	int i;
+
+	if (nloops < 1){
+		fprintf(stderr, "Invalid event loop count.\n");
+		return -1;
+	}
+
+	upstream->server = server;
+	upstream->nloops = nloops;
+	upstream->next = 0;
+	if (NULL == (upstream->loops = (upstream_loop_t *) calloc(nloops, sizeof(upstream_loop_t)))){
+		perror("Unable to allocate memory");
+		exit(SERVER_FAILURE);
+	}
+
+	for (i = 0; i < nloops; i++){
+		loop = &upstream->loops[i];
+		loop->deadline = -1;
+		steque_init(&loop->submitted);
+		pthread_mutex_init(&loop->lock, NULL);
+
+		if (0 > (loop->epollfd = epoll_create1(0)) || 0 > (loop->eventfd = eventfd(0, EFD_NONBLOCK))){
+			perror("Unable to create the event loop");
+			return -1;
+		}
+
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.u64 = 0;
+		epoll_ctl(loop->epollfd, EPOLL_CTL_ADD, loop->eventfd, &ev);
+
+		if (NULL == (loop->multi = curl_multi_init())){
+			fprintf(stderr, "curl_multi_init() failed\n");
+			return -1;
+		}
+		curl_multi_setopt(loop->multi, CURLMOPT_SOCKETFUNCTION, socket_callback);
+		curl_multi_setopt(loop->multi, CURLMOPT_SOCKETDATA, loop);
+		curl_multi_setopt(loop->multi, CURLMOPT_TIMERFUNCTION, timer_callback);
+		curl_multi_setopt(loop->multi, CURLMOPT_TIMERDATA, loop);
+
+		if (0 != pthread_create(&loop->thread, NULL, loop_main, loop)){
+			fprintf(stderr, "Error creating thread\n");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int upstream_fetch(upstream_t *upstream, int client, const char *path){
+	upstream_loop_t *loop, *candidate;
+	transfer_t *transfer;
+	size_t len;
+	unsigned int start;
+	int i;
+	uint64_t one = 1;
+
+	if (NULL == (transfer = (transfer_t *) calloc(1, sizeof(transfer_t))))
+		return -1;
+
+	len = strlen(upstream->server) + strlen(path) + 1;
+	if (NULL == (transfer->url = (char *) malloc(len))){
+		free(transfer);
+		return -1;
+	}
+	snprintf(transfer->url, len, "%s%s", upstream->server, path);
+	transfer->client = client;
+
+	/* the least busy loop, ties broken round robin */
+	start = __atomic_fetch_add(&upstream->next, 1, __ATOMIC_RELAXED);
+	loop = &upstream->loops[start % upstream->nloops];
+	for (i = 1; i < upstream->nloops; i++){
+		candidate = &upstream->loops[(start + i) % upstream->nloops];
+		if (__atomic_load_n(&candidate->active, __ATOMIC_RELAXED) < __atomic_load_n(&loop->active, __ATOMIC_RELAXED))
+			loop = candidate;
+	}
+	transfer->loop = loop;
+	__atomic_fetch_add(&loop->active, 1, __ATOMIC_RELAXED);
+
+	pthread_mutex_lock(&loop->lock);
+	steque_enqueue(&loop->submitted, transfer);
+	pthread_mutex_unlock(&loop->lock);
+
+	if (write(loop->eventfd, &one, sizeof(one)) < 0)
+		perror("upstream: eventfd");
+
+	return 0;
+}
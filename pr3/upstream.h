@@ -0,0 +1,63 @@
+#ifndef _UPSTREAM_H_
+#define _UPSTREAM_H_
+
+#include <pthread.h>
+#include <curl/curl.h>
+
+#include "steque.h"
+
+/*
+ * Asynchronous upstream engine for webproxy.
+ *
+ * A few event loop threads each drive a curl multi handle with
+ * curl_multi_socket_action over epoll.  Connections handed to the engine
+ * are answered from the loop: the GETFILE header goes out as soon as the
+ * server announces the length and body chunks are written to the client
+ * without blocking as curl receives them.  A transfer whose client
+ * cannot keep up is paused, so at most UPSTREAM_HIGH_WATER bytes per
+ * transfer wait in memory.  A body without a Content-Length has to be
+ * held whole until its length is known; it may take up to
+ * UPSTREAM_MAX_UNSIZED bytes, a larger one is answered with ERROR.  How
+ * many fetches are in flight no longer depends on the number of threads.
+ */
+
+#define UPSTREAM_HIGH_WATER 65536
+#define UPSTREAM_MAX_UNSIZED (16 * 1024 * 1024)
+#define UPSTREAM_MAX_EVENTS 64
+
+typedef struct{
+	pthread_t thread;
+	int epollfd;
+	/* wakes the loop up when transfers are submitted */
+	int eventfd;
+	CURLM *multi;
+	/* absolute CLOCK_MONOTONIC time of the curl timeout in ms, -1 if none */
+	long long deadline;
+
+	pthread_mutex_t lock;
+	steque_t submitted;
+	/* transfers submitted to this loop and not finished */
+	int active;
+} upstream_loop_t;
+
+typedef struct{
+	/* prefix of the fetched URLs */
+	const char *server;
+	int nloops;
+	upstream_loop_t *loops;
+	unsigned int next;
+} upstream_t;
+
+/* Starts nloops event loop threads fetching from server */
+int upstream_init(upstream_t *upstream, const char *server, int nloops);
+
+/*
+ * Fetches path from the server and answers the GETFILE connection client
+ * with it, FILE_NOT_FOUND unless the server returned a 200.  The
+ * engine takes ownership of client, which is closed once the response has
+ * been sent or the transfer failed.  Returns 0, or -1 if the transfer
+ * could not be queued, in which case client is left to the caller.
+ */
+int upstream_fetch(upstream_t *upstream, int client, const char *path);
+
+#endif
@@ -1,6 +1,7 @@
 #include <errno.h>
 #include <getopt.h>
 #include <signal.h>
+#include <string.h>
 #include <strings.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -8,6 +9,10 @@
 #include <curl/curl.h>
 
 #include "gfserver.h"
+#include "shm_channel.h"
+#include "handle_with_curl.h"
+#include "upstream.h"
+#include "topology.h"
 
 #define USAGE                                                                   \
 "usage:\n"                                                                      \
@@ -16,9 +21,19 @@
 "  -p [listen_port]    Listen port (Default: 8888)\n"                           \
 "  -t [thread_count]   Num worker threads (Default: 1, Range: 1-1000)\n"        \
 "  -s [server]         The server to connect to (Default: Udacity S3 instance)" \
+"  -q [scheduler]      Worker queue: fifo, ws or ws-rr (Default: fifo)\n"      \
+"  -c                  Serve files from simplecached instead of the server\n"  \
+"  -n [segment_count]  Number of shared memory segments (Default: 4)\n"        \
+"  -z [segment_size]   Size of each segment in bytes (Default: 8192)\n"        \
+"  -m [cache_size]     Bytes of server responses kept in memory (Default: 0)\n" \
+"  -a [loop_count]     Fetch asynchronously on this many event loops (Default: 0)\n" \
+"  -l [listener_count] Accept on this many SO_REUSEPORT sockets (Default: 1)\n" \
+"  -A [placement]      Pin workers: none, core or node (Default: none)\n"      \
 "  -h                  Show this help message\n"                                \
 "special options:\n"                                                            \
-"  -d [drop_factor]    Drop connects if f*t pending requests (Default: 5).\n"
+"  -d [drop_factor]    Drop connects if f*t pending requests (Default: 0, off).\n"  \
+"  -Q [target_ms]      Shed queued connections once their wait stays above\n"  \
+"                      target_ms for 100 ms, CoDel style (Default: 0, off)\n"
 
 
 /* OPTIONS DESCRIPTOR ====================================================== */
@@ -26,18 +41,37 @@ static struct option gLongOptions[] = {
         {"port",          required_argument,      NULL,           'p'},
         {"thread-count",  required_argument,      NULL,           't'},
         {"server",        required_argument,      NULL,           's'},
+        {"scheduler",     required_argument,      NULL,           'q'},
+        {"cache",         no_argument,            NULL,           'c'},
+        {"segment-count", required_argument,      NULL,           'n'},
+        {"segment-size",  required_argument,      NULL,           'z'},
+        {"cache-size",    required_argument,      NULL,           'm'},
+        {"async",         required_argument,      NULL,           'a'},
+        {"listeners",     required_argument,      NULL,           'l'},
+        {"affinity",      required_argument,      NULL,           'A'},
+        {"drop-factor",   required_argument,      NULL,           'd'},
+        {"codel-target",  required_argument,      NULL,           'Q'},
         {"help",          no_argument,            NULL,           'h'},
         {NULL,            0,                      NULL,             0}
 };
 
-extern ssize_t handle_with_curl(gfcontext_t *ctx, char *path, void* arg);
 extern ssize_t handle_with_cache(gfcontext_t *ctx, char *path, void* arg);
+extern ssize_t handle_with_upstream(gfcontext_t *ctx, char *path, void* arg);
 
 static gfserver_t gfs;
+static shm_channel_t channel;
+static int use_cache = 0;
+static objcache_t objcache;
+static curl_arg_t *curl_args;
+static CURLSH *curl_share;
+static upstream_t upstream;
 
 static void _sig_handler(int signo){
     if (signo == SIGINT || signo == SIGTERM){
         gfserver_stop(&gfs);
+        if (use_cache) {
+            shm_channel_destroy(&channel);
+        }
         exit(signo);
     }
 }
@@ -48,6 +82,15 @@ int main(int argc, char **argv) {
     unsigned short port = 8888;
     unsigned short nworkerthreads = 1;
     char *server = "s3.amazonaws.com/content.udacity-data.com";
+    int scheduler = GFS_SCHED_FIFO;
+    int nsegments = 4;
+    size_t segsize = 8192;
+    size_t cache_size = 0;
+    int nloops = 0;
+    int nlisteners = 1;
+    int placement = TOPOLOGY_PIN_NONE;
+    int drop_factor = 0;
+    long codel_target = 0;
 
     if (signal(SIGINT, _sig_handler) == SIG_ERR){
         fprintf(stderr,"Can't catch SIGINT...exiting.\n");
@@ -60,7 +103,7 @@ int main(int argc, char **argv) {
     }
 
     // Parse and set command line arguments
-    while ((option_char = getopt_long(argc, argv, "p:t:s:h", gLongOptions, NULL)) != -1) {
+    while ((option_char = getopt_long(argc, argv, "p:t:s:q:cn:z:m:a:l:A:d:Q:h", gLongOptions, NULL)) != -1) {
         switch (option_char) {
             case 'p': // listen-port
                 port = atoi(optarg);
@@ -71,6 +114,48 @@ int main(int argc, char **argv) {
             case 's': // file-path
                 server = optarg;
                 break;
+            case 'q': // scheduler
+                if (strcmp(optarg, "ws") == 0) {
+                    scheduler = GFS_SCHED_WS_LEAST_LOADED;
+                } else if (strcmp(optarg, "ws-rr") == 0) {
+                    scheduler = GFS_SCHED_WS_ROUND_ROBIN;
+                } else if (strcmp(optarg, "fifo") == 0) {
+                    scheduler = GFS_SCHED_FIFO;
+                } else {
+                    fprintf(stderr, "%s", USAGE);
+                    exit(1);
+                }
+                break;
+            case 'c': // cache
+                use_cache = 1;
+                break;
+            case 'n': // segment-count
+                nsegments = atoi(optarg);
+                break;
+            case 'z': // segment-size
+                segsize = (size_t)atol(optarg);
+                break;
+            case 'm': // cache-size
+                cache_size = (size_t)atol(optarg);
+                break;
+            case 'a': // async
+                nloops = atoi(optarg);
+                break;
+            case 'l': // listeners
+                nlisteners = atoi(optarg);
+                break;
+            case 'A': // affinity
+                if ((placement = topology_policy(optarg)) < 0) {
+                    fprintf(stderr, "%s", USAGE);
+                    exit(1);
+                }
+                break;
+            case 'd': // drop-factor
+                drop_factor = atoi(optarg);
+                break;
+            case 'Q': // codel-target
+                codel_target = atol(optarg) * 1000;
+                break;
             case 'h': // help
                 fprintf(stdout, "%s", USAGE);
                 exit(0);
@@ -86,10 +171,39 @@ int main(int argc, char **argv) {
         exit(1);
     }
 
+    if (nloops > 0 && (use_cache || cache_size > 0)) {
+        fprintf(stderr, "The async engine does not work with -c or -m\n");
+        exit(1);
+    }
+
     // initialize curl
     curl_global_init(CURL_GLOBAL_ALL);
 
     /* SHM initialization...*/
+    if (use_cache && shm_channel_create(&channel, nsegments, segsize) < 0) {
+        exit(SERVER_FAILURE);
+    }
+
+    /* Async engine, the workers only parse requests and hand them over */
+    if (nloops > 0 && upstream_init(&upstream, server, nloops) < 0) {
+        exit(SERVER_FAILURE);
+    }
+
+    /* Responses cache, off unless given a size */
+    if (!use_cache && cache_size > 0) {
+        objcache_init(&objcache, cache_size);
+    }
+
+    /* One persistent easy handle per worker, pooling DNS and connections */
+    if (!use_cache && nloops == 0) {
+        curl_share = curl_arg_share_init();
+        if ((curl_args = calloc(nworkerthreads, sizeof(curl_arg_t))) == NULL) {
+            perror("Unable to allocate memory");
+            exit(SERVER_FAILURE);
+        }
+        for (i = 0; i < nworkerthreads; i++)
+            curl_arg_init(&curl_args[i], server, cache_size > 0 ? &objcache : NULL, curl_share, nworkerthreads);
+    }
 
     /*Initializing server*/
     gfserver_init(&gfs, nworkerthreads);
@@ -97,13 +211,35 @@ int main(int argc, char **argv) {
     /*Setting options*/
     gfserver_setopt(&gfs, GFS_PORT, port);
     gfserver_setopt(&gfs, GFS_MAXNPENDING, 10);
-    gfserver_setopt(&gfs, GFS_WORKER_FUNC, handle_with_curl);
-    for(i = 0; i < nworkerthreads; i++)
-        gfserver_setopt(&gfs, GFS_WORKER_ARG, i, server);
+    gfserver_setopt(&gfs, GFS_SCHEDULER, scheduler);
+    gfserver_setopt(&gfs, GFS_LISTENERS, nlisteners);
+    gfserver_setopt(&gfs, GFS_PLACEMENT, placement);
+    gfserver_setopt(&gfs, GFS_DROP_FACTOR, drop_factor);
+    gfserver_setopt(&gfs, GFS_CODEL_TARGET, codel_target);
+    if (use_cache) {
+        gfserver_setopt(&gfs, GFS_WORKER_FUNC, handle_with_cache);
+        for(i = 0; i < nworkerthreads; i++)
+            gfserver_setopt(&gfs, GFS_WORKER_ARG, i, &channel);
+    } else if (nloops > 0) {
+        gfserver_setopt(&gfs, GFS_WORKER_FUNC, handle_with_upstream);
+        for(i = 0; i < nworkerthreads; i++)
+            gfserver_setopt(&gfs, GFS_WORKER_ARG, i, &upstream);
+    } else {
+        gfserver_setopt(&gfs, GFS_WORKER_FUNC, handle_with_curl);
+        for(i = 0; i < nworkerthreads; i++)
+            gfserver_setopt(&gfs, GFS_WORKER_ARG, i, &curl_args[i]);
+    }
 
     /*Loops forever*/
     gfserver_serve(&gfs);
 
     // clean up curl
+    if (!use_cache && nloops == 0) {
+        for (i = 0; i < nworkerthreads; i++)
+            curl_arg_cleanup(&curl_args[i]);
+        free(curl_args);
+        if (curl_share)
+            curl_arg_share_cleanup(curl_share);
+    }
     curl_global_cleanup();
 }
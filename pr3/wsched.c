@@ -0,0 +1,218 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sched.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include "wsched.h"
+
+#define WSCHED_DEQUE_CAPACITY 1024
+#define WSCHED_INBOX_CAPACITY 1024
+/* Inbox items moved into the deque at a time, the rest stay stealable */
+#define WSCHED_BATCH 8
+
+static void futex_wait(uint32_t* addr, uint32_t val){
+  syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void futex_wake(uint32_t* addr, int n){
+  syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+void wsched_init(wsched_t* this, int nworkers, int policy){
+  int i;
+
+  if(posix_memalign((void**) &this->workers, MPMCQ_CACHELINE, nworkers * sizeof(wsched_worker_t)) != 0){
+    fprintf(stderr, "Error: unable to allocate wsched.\n");
+    fflush(stderr);
+    exit(EXIT_FAILURE);
+  }
+
+  for(i = 0; i < nworkers; i++){
+    wsdeque_init(&this->workers[i].deque, WSCHED_DEQUE_CAPACITY);
+    mpmcq_init(&this->workers[i].inbox, WSCHED_INBOX_CAPACITY);
+    this->workers[i].load = 0;
+    this->workers[i].running = 0;
+    this->workers[i].futex_seq = 0;
+    this->workers[i].parked = 0;
+  }
+
+  this->nworkers = nworkers;
+  this->policy = policy;
+  this->next = 0;
+}
+
+static void wake(wsched_worker_t* w){
+  if(__atomic_load_n(&w->parked, __ATOMIC_SEQ_CST)){
+    __atomic_fetch_add(&w->futex_seq, 1, __ATOMIC_SEQ_CST);
+    futex_wake(&w->futex_seq, 1);
+  }
+}
+
+/* Wakes the first parked worker after worker, if any */
+static void wake_peer(wsched_t* this, int worker){
+  wsched_worker_t* peer;
+  int i;
+
+  for(i = 1; i < this->nworkers; i++){
+    peer = &this->workers[(worker + i) % this->nworkers];
+    if(__atomic_load_n(&peer->parked, __ATOMIC_RELAXED)){
+      wake(peer);
+      break;
+    }
+  }
+}
+
+/* Items waiting for worker plus the one it is running */
+static long worker_load(wsched_worker_t* w){
+  return __atomic_load_n(&w->load, __ATOMIC_RELAXED) + __atomic_load_n(&w->running, __ATOMIC_RELAXED);
+}
+
+static int least_loaded(wsched_t* this){
+  int i, idx, best;
+  long load, best_load;
+  /* rotate the starting point so ties do not always land on worker 0 */
+  int start = (int) (__atomic_fetch_add(&this->next, 1, __ATOMIC_RELAXED) % this->nworkers);
+
+  best = start;
+  best_load = worker_load(&this->workers[start]);
+  for(i = 1; i < this->nworkers && best_load > 0; i++){
+    idx = (start + i) % this->nworkers;
+    load = worker_load(&this->workers[idx]);
+    if(load < best_load){
+      best = idx;
+      best_load = load;
+    }
+  }
+
+  return best;
+}
+
+void wsched_submit(wsched_t* this, steque_item item){
+  wsched_worker_t* w;
+  int idx, tries = 0;
+
+  if(this->policy == WSCHED_LEAST_LOADED)
+    idx = least_loaded(this);
+  else
+    idx = (int) (__atomic_fetch_add(&this->next, 1, __ATOMIC_RELAXED) % this->nworkers);
+
+  /* count the item before it becomes visible so the load never goes negative */
+  for(;;){
+    w = &this->workers[idx];
+    __atomic_fetch_add(&w->load, 1, __ATOMIC_RELAXED);
+    if(mpmcq_enqueue(&w->inbox, item) == 0)
+      break;
+    __atomic_fetch_sub(&w->load, 1, __ATOMIC_RELAXED);
+
+    /* inbox full: try the next worker, back off after a full round */
+    idx = (idx + 1) % this->nworkers;
+    if(++tries % this->nworkers == 0)
+      sched_yield();
+  }
+
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  /* a busy target would leave the item waiting while a peer sleeps: let one steal it */
+  if(__atomic_load_n(&w->parked, __ATOMIC_SEQ_CST))
+    wake(w);
+  else
+    wake_peer(this, idx);
+}
+
+/* Returns 1 if any queue holds an item the worker could run */
+static int has_work(wsched_t* this){
+  int i;
+
+  for(i = 0; i < this->nworkers; i++){
+    if(!mpmcq_isempty(&this->workers[i].inbox) || wsdeque_size(&this->workers[i].deque) > 0)
+      return 1;
+  }
+
+  return 0;
+}
+
+static void park(wsched_t* this, wsched_worker_t* w){
+  uint32_t seq = __atomic_load_n(&w->futex_seq, __ATOMIC_SEQ_CST);
+
+  /* Publish parked before the last look, the fence pairs with the one in
+     wsched_submit: has_work loads relaxed, which may otherwise pass the store */
+  __atomic_store_n(&w->parked, 1, __ATOMIC_SEQ_CST);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if(!has_work(this))
+    futex_wait(&w->futex_seq, seq);
+  __atomic_store_n(&w->parked, 0, __ATOMIC_SEQ_CST);
+}
+
+/* Moves up to WSCHED_BATCH inbox items into the deque. Returns the count */
+static int refill(wsched_worker_t* w){
+  steque_item item;
+  int n = 0;
+
+  while(n < WSCHED_BATCH && wsdeque_size(&w->deque) < WSCHED_DEQUE_CAPACITY){
+    if(mpmcq_trypop(&w->inbox, &item) < 0)
+      break;
+    wsdeque_push(&w->deque, item);
+    n++;
+  }
+
+  return n;
+}
+
+static int steal(wsched_t* this, int worker, steque_item* item){
+  wsched_worker_t* victim;
+  int i;
+
+  for(i = 1; i < this->nworkers; i++){
+    victim = &this->workers[(worker + i) % this->nworkers];
+    if(wsdeque_steal(&victim->deque, item) == 0 || mpmcq_trypop(&victim->inbox, item) == 0){
+      __atomic_fetch_sub(&victim->load, 1, __ATOMIC_RELAXED);
+      return 0;
+    }
+  }
+
+  return -1;
+}
+
+steque_item wsched_next(wsched_t* this, int worker){
+  wsched_worker_t* w = &this->workers[worker];
+  steque_item item;
+
+  /* asking for the next item means the previous one is done */
+  __atomic_store_n(&w->running, 0, __ATOMIC_RELAXED);
+
+  for(;;){
+    if(wsdeque_take(&w->deque, &item) == 0){
+      __atomic_fetch_sub(&w->load, 1, __ATOMIC_RELAXED);
+      break;
+    }
+
+    if(refill(w) > 1){
+      /* more than we need right now: let a parked peer steal the rest */
+      __atomic_thread_fence(__ATOMIC_SEQ_CST);
+      wake_peer(this, worker);
+      continue;
+    }
+    if(wsdeque_size(&w->deque) > 0)
+      continue;
+
+    if(steal(this, worker, &item) == 0)
+      break;
+
+    park(this, w);
+  }
+
+  __atomic_store_n(&w->running, 1, __ATOMIC_RELAXED);
+  return item;
+}
+
+void wsched_destroy(wsched_t* this){
+  int i;
+
+  for(i = 0; i < this->nworkers; i++){
+    wsdeque_destroy(&this->workers[i].deque);
+    mpmcq_destroy(&this->workers[i].inbox);
+  }
+
+  free(this->workers);
+  this->workers = NULL;
+}